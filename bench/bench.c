@@ -0,0 +1,101 @@
+#include "bench.h"
+
+static atomic_ulong syscalls = 0;
+
+// the real calls, which the linker's --wrap renames the originals to
+int __real_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen,
+                    int flags);
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t __real_sendto(int fd, const void *buf, size_t len, int flags,
+                      const struct sockaddr *addr, socklen_t addr_len);
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+ssize_t __real_recvmsg(int fd, struct msghdr *msg, int flags);
+ssize_t __real_recvfrom(int fd, void *buf, size_t len, int flags,
+                        struct sockaddr *addr, socklen_t *addr_len);
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+
+// declared here, since nothing calls them by these names but the linker
+int __wrap_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen,
+                    int flags);
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags);
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags,
+                      const struct sockaddr *addr, socklen_t addr_len);
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags);
+ssize_t __wrap_recvmsg(int fd, struct msghdr *msg, int flags);
+ssize_t __wrap_recvfrom(int fd, void *buf, size_t len, int flags,
+                        struct sockaddr *addr, socklen_t *addr_len);
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags);
+
+static void count_syscall(void) {
+  atomic_fetch_add_explicit(&syscalls, 1, memory_order_relaxed);
+}
+
+int __wrap_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen,
+                    int flags) {
+  count_syscall();
+  return __real_sendmmsg(fd, msgs, vlen, flags);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) {
+  count_syscall();
+  return __real_sendmsg(fd, msg, flags);
+}
+
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags,
+                      const struct sockaddr *addr, socklen_t addr_len) {
+  count_syscall();
+  return __real_sendto(fd, buf, len, flags, addr, addr_len);
+}
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags) {
+  count_syscall();
+  return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr *msg, int flags) {
+  count_syscall();
+  return __real_recvmsg(fd, msg, flags);
+}
+
+ssize_t __wrap_recvfrom(int fd, void *buf, size_t len, int flags,
+                        struct sockaddr *addr, socklen_t *addr_len) {
+  count_syscall();
+  return __real_recvfrom(fd, buf, len, flags, addr, addr_len);
+}
+
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags) {
+  count_syscall();
+  return __real_recv(fd, buf, len, flags);
+}
+
+uint64_t get_bench_syscalls(void) { return atomic_load(&syscalls); }
+
+static uint64_t read_clock(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t get_thread_cpu_ns(void) {
+  return read_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+uint64_t get_process_cpu_ns(void) {
+  return read_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+int parse_params(char *arg, long *values) {
+  int n = 0;
+  for (char *value = strtok(arg, ","); value != NULL;
+       value = strtok(NULL, ",")) {
+    if (n == BENCH_MAX_PARAMS || atol(value) <= 0)
+      return -1;
+    values[n++] = atol(value);
+  }
+  return n;
+}
+
+void bench_snapshot(hist_snapshot_t *snap, histogram_t *hist) {
+  memset(snap, 0, sizeof(*snap));
+  hist_merge(snap, hist);
+}
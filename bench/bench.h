@@ -0,0 +1,66 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdatomic.h>
+
+#include "histogram.h"
+#include "util.h"
+
+/**
+ * Helpers shared by the microbenchmarks in bench/ (built with `make bench`).
+ *
+ * Every benchmark is linked with the socket calls the server makes wrapped
+ * (see BENCH_WRAP in the Makefile), so it can count the syscalls a code path
+ * makes without strace or perf: the wrappers bump a counter and call through.
+ */
+
+#define BENCH_MAX_PARAMS 16 // values a comma-separated option may list
+
+/**
+ * Counts socket syscalls (sends and receives of any kind) made so far, by any
+ * thread.
+ *
+ * Returns:
+ * - the count
+ */
+uint64_t get_bench_syscalls(void);
+
+/**
+ * Reads the calling thread's CPU clock.
+ *
+ * Returns:
+ * - the CPU time the thread has used, in nanoseconds
+ */
+uint64_t get_thread_cpu_ns(void);
+
+/**
+ * Reads the process's CPU clock (every thread's time, added up).
+ *
+ * Returns:
+ * - the CPU time the process has used, in nanoseconds
+ */
+uint64_t get_process_cpu_ns(void);
+
+/**
+ * Parses a comma-separated list of positive numbers, e.g. "1,100,10000".
+ *
+ * Inputs:
+ * - char *arg: the list; modified
+ * - long *values: where to store the numbers
+ *
+ * Returns:
+ * - how many there were, or -1 if one isn't a positive number or there are
+ * more than BENCH_MAX_PARAMS
+ */
+int parse_params(char *arg, long *values);
+
+/**
+ * Copies a live histogram into a snapshot.
+ *
+ * Inputs:
+ * - hist_snapshot_t *snap: where to copy it
+ * - histogram_t *hist: the histogram
+ */
+void bench_snapshot(hist_snapshot_t *snap, histogram_t *hist);
+
+#endif
@@ -0,0 +1,410 @@
+#include <sys/eventfd.h>
+
+#include "bench.h"
+#include "snowcast_server.h"
+
+/**
+ * Control-plane microbenchmark: runs the server's own poller, thread pool and
+ * handle_request against in-process clients, with no network and no streaming.
+ *
+ * Each client is a socketpair. The server's end is handed to register_clients
+ * as if process_connection had just accepted it, and the bench drives the
+ * other end from a single epoll loop: first every client says Hello at once,
+ * then each keeps one SetStation outstanding (closed loop) for a while. The
+ * stations exist, with their streamers stopped, so swaps only move listeners
+ * between lists. The listener the poller watches is an eventfd that never
+ * fires.
+ */
+
+#define DEFAULT_THREADS "1,4,16"
+#define DEFAULT_CLIENTS "100,1000,4000"
+#define DEFAULT_STATIONS "1,16"
+#define DEFAULT_DURATION_MS 1000 // time spent switching per run
+#define PHASE_TIMEOUT_MS 10000   // give up on a phase after this long
+#define BENCH_EVENTS 256         // events handled per epoll_wait
+
+/**
+ * The bench's end of a client.
+ */
+typedef struct {
+  int fd;                   // our end of the socketpair
+  int station;              // station last asked for, or -1
+  uint64_t sent_ns;         // when the outstanding command was sent
+  uint8_t in[MAXREPLYSIZE]; // partial reply
+  size_t in_len;            // number of bytes in `in`
+} bench_client_t;
+
+/**
+ * What one phase of a run measured.
+ */
+typedef struct {
+  histogram_t latency_ns; // command to its reply
+  uint64_t done;          // replies received
+  uint64_t elapsed_ns;    // how long the phase took
+} phase_t;
+
+// the server's own state, from snowcast_server.c
+extern server_control_t server_control;
+extern station_control_t station_control;
+extern client_control_t client_control;
+
+static int listener = -1; // what the poller thinks is the listener
+static pthread_t poller;
+
+static void usage(void) {
+  fprintf(stderr, "Usage: ./bench/bench_control [-t <THREADS,...>] "
+                  "[-c <CLIENTS,...>] [-s <STATIONS,...>] [-d <MS>]\n");
+  exit(1);
+}
+
+/**
+ * Starts the server's control plane: a thread pool of `threads` workers,
+ * `num_stations` silent stations, and the poller.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int start_server(long threads, long num_stations) {
+  init_server_control(&server_control, threads, threads);
+
+  char *songs[num_stations];
+  uint64_t weights[num_stations];
+  for (long i = 0; i < num_stations; i++) {
+    songs[i] = "/dev/zero";
+    weights[i] = 1;
+  }
+  station_config_t config = {.t_pool = server_control.t_pool};
+  if (init_station_control(&station_control, num_stations, songs, &config, 0,
+                           weights))
+    return -1;
+  for (long i = 0; i < num_stations; i++)
+    stop_station(station_control.stations[i]);
+
+  int ret = pthread_create(&poller, NULL, poll_connections, &listener);
+  if (ret) {
+    errno = ret;
+    perror("start_server: pthread_create");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Stops everything start_server started. Every client must be gone.
+ */
+static void stop_server(void) {
+  lock_server_control(&server_control);
+  server_control.stopped = 1;
+  unlock_server_control(&server_control);
+  // the poller notices within HANDSHAKE_SWEEP_MS
+  int ret = pthread_join(poller, NULL);
+  if (ret)
+    handle_error_en(ret, "stop_server: pthread_join");
+  wait_thread_pool(server_control.t_pool);
+  reap_clients(&client_control);
+
+  // the streamers are already stopped, so not destroy_station_control
+  for (size_t i = 0; i < station_control.num_stations; i++)
+    destroy_station(station_control.stations[i]);
+  free(station_control.stations);
+  destroy_egress(&station_control.egress);
+  destroy_server_control(&server_control);
+}
+
+/**
+ * Sends a command from a client, noting when.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int send_command(bench_client_t *c, uint8_t type, uint16_t val) {
+  hello_t cmd = {type, htons(val)};
+  c->sent_ns = get_time_ns();
+  // three bytes into a socketpair with room either all go, or none do
+  if (send(c->fd, &cmd, sizeof(cmd), MSG_NOSIGNAL) != sizeof(cmd)) {
+    perror("send_command: send");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Reads whatever the server sent a client.
+ *
+ * Returns:
+ * - the number of complete replies (each ends the outstanding command), or
+ * -1 if the server closed the client or sent an InvalidCommand
+ */
+static int read_replies(bench_client_t *c) {
+  int replies = 0;
+  while (1) {
+    ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return replies;
+    if (n <= 0)
+      return -1;
+    c->in_len += n;
+
+    // replies are a type, then either a 2-byte value or a sized string
+    while (c->in_len >= 2) {
+      size_t size = c->in[0] == REPLY_WELCOME ? sizeof(welcome_t)
+                                              : sizeof(announce_t) + c->in[1];
+      if (c->in_len < size)
+        break;
+      if (c->in[0] == REPLY_INVALID)
+        return -1;
+      memmove(c->in, c->in + size, c->in_len - size);
+      c->in_len -= size;
+      replies++;
+    }
+  }
+}
+
+/**
+ * Switches a client to some station other than its current one.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int send_switch(bench_client_t *c, long num_stations) {
+  int station = rand() % num_stations;
+  if (num_stations > 1 && station == c->station)
+    station = (station + 1) % num_stations;
+  c->station = station;
+  return send_command(c, MESSAGE_SET_STATION, station);
+}
+
+/**
+ * Connects every client: hands the server its end, then says Hello.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int connect_clients(bench_client_t *clients, long num_clients,
+                           int epoll_fd) {
+  // a made-up peer address; nothing is ever streamed to it
+  struct sockaddr_in peer = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  int fds[ACCEPT_BATCH];
+  struct sockaddr_storage addrs[ACCEPT_BATCH];
+  socklen_t addr_lens[ACCEPT_BATCH];
+  size_t batch = 0;
+  for (long i = 0; i < num_clients; i++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   sv) == -1) {
+      perror("connect_clients: socketpair");
+      return -1;
+    }
+    clients[i] = (bench_client_t){.fd = sv[1], .station = -1};
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &clients[i]};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sv[1], &ev) == -1) {
+      perror("connect_clients: epoll_ctl");
+      return -1;
+    }
+
+    // in batches, as process_connection would
+    fds[batch] = sv[0];
+    memcpy(&addrs[batch], &peer, sizeof(peer));
+    addr_lens[batch++] = sizeof(peer);
+    if (batch == ACCEPT_BATCH || i == num_clients - 1) {
+      register_clients(&client_control, fds, addrs, addr_lens, batch);
+      batch = 0;
+    }
+  }
+
+  for (long i = 0; i < num_clients; i++)
+    if (send_command(&clients[i], MESSAGE_HELLO, 9))
+      return -1;
+  return 0;
+}
+
+/**
+ * Handles replies until `until` (or until `target` replies have come in, if
+ * it's nonzero), counting them and their latencies. With `num_stations` set,
+ * each reply is followed by another SetStation.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int run_phase(phase_t *phase, int epoll_fd, uint64_t target,
+                     uint64_t until, long num_stations) {
+  struct epoll_event events[BENCH_EVENTS];
+  uint64_t start = get_time_ns();
+  while ((target == 0 || phase->done < target) && get_time_ns() < until) {
+    int n = epoll_wait(epoll_fd, events, BENCH_EVENTS, 1);
+    if (n == -1 && errno != EINTR) {
+      perror("run_phase: epoll_wait");
+      return -1;
+    }
+    for (int i = 0; i < n; i++) {
+      bench_client_t *c = events[i].data.ptr;
+      int replies = read_replies(c);
+      if (replies == -1) {
+        fprintf(stderr, "[run_phase] The server closed a client.\n");
+        return -1;
+      }
+      if (replies == 0)
+        continue;
+      uint64_t now = get_time_ns();
+      hist_record(&phase->latency_ns, now - c->sent_ns);
+      phase->done++;
+      if (num_stations > 0 && send_switch(c, num_stations))
+        return -1;
+    }
+  }
+  phase->elapsed_ns = get_time_ns() - start;
+  if (target != 0 && phase->done < target) {
+    fprintf(stderr, "[run_phase] Only %lu of %lu replies in time.\n",
+            phase->done, target);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Disconnects every client, and waits for the server to remove them all. Each
+ * client only says it's done sending first (so the server sees an orderly
+ * disconnect, even with replies still unread), and is closed once removed.
+ *
+ * Returns:
+ * - 0 on success, -1 if the server didn't in time
+ */
+static int disconnect_clients(bench_client_t *clients, long num_clients) {
+  for (long i = 0; i < num_clients; i++)
+    shutdown(clients[i].fd, SHUT_WR);
+  uint64_t deadline = get_time_ns() + PHASE_TIMEOUT_MS * 1000000ULL;
+  int ret = 0;
+  while (atomic_load(&client_control.num_clients) > 0) {
+    if (get_time_ns() > deadline) {
+      fprintf(stderr, "[disconnect_clients] %zu clients never went away.\n",
+              atomic_load(&client_control.num_clients));
+      ret = -1;
+      break;
+    }
+    usleep(1000);
+  }
+  for (long i = 0; i < num_clients; i++)
+    close(clients[i].fd);
+  return ret;
+}
+
+/**
+ * Prints a phase's rate and latency percentiles.
+ */
+static void print_phase(phase_t *phase) {
+  hist_snapshot_t snap;
+  bench_snapshot(&snap, &phase->latency_ns);
+  printf(" %10.0f %9.1f %9.1f %9.1f", phase->done / (phase->elapsed_ns / 1e9),
+         hist_percentile(&snap, 50) / 1000.0,
+         hist_percentile(&snap, 99) / 1000.0,
+         hist_percentile(&snap, 99.9) / 1000.0);
+}
+
+/**
+ * Runs both phases for one configuration, and prints a line of results.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int run(long threads, long num_clients, long num_stations,
+               long duration_ms) {
+  bench_client_t *clients = malloc(num_clients * sizeof(bench_client_t));
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (clients == NULL || epoll_fd == -1) {
+    fprintf(stderr, "[run] Failed to allocate clients.\n");
+    return -1;
+  }
+  if (start_server(threads, num_stations))
+    return -1;
+
+  phase_t handshakes = {0}, switches = {0};
+  hist_init(&handshakes.latency_ns);
+  hist_init(&switches.latency_ns);
+  uint64_t start = get_time_ns();
+  int ret = connect_clients(clients, num_clients, epoll_fd) ||
+            run_phase(&handshakes, epoll_fd, num_clients,
+                      start + PHASE_TIMEOUT_MS * 1000000ULL, 0);
+  // the rate counts registering clients, too
+  handshakes.elapsed_ns = get_time_ns() - start;
+
+  if (!ret) {
+    for (long i = 0; i < num_clients && !ret; i++)
+      ret = send_switch(&clients[i], num_stations);
+    if (!ret)
+      ret = run_phase(&switches, epoll_fd, 0,
+                      get_time_ns() + duration_ms * 1000000ULL, num_stations);
+  }
+  if (disconnect_clients(clients, num_clients))
+    ret = -1;
+  stop_server();
+  close(epoll_fd);
+  free(clients);
+  if (ret)
+    return -1;
+
+  printf("%7ld %7ld %8ld", threads, num_clients, num_stations);
+  print_phase(&handshakes);
+  print_phase(&switches);
+  printf("\n");
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char default_threads[] = DEFAULT_THREADS, default_clients[] = DEFAULT_CLIENTS,
+       default_stations[] = DEFAULT_STATIONS;
+  long threads[BENCH_MAX_PARAMS], clients[BENCH_MAX_PARAMS],
+      stations[BENCH_MAX_PARAMS];
+  int num_threads = parse_params(default_threads, threads);
+  int num_clients = parse_params(default_clients, clients);
+  int num_stations = parse_params(default_stations, stations);
+  long duration_ms = DEFAULT_DURATION_MS;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:c:s:d:")) != -1) {
+    switch (opt) {
+    case 't':
+      if ((num_threads = parse_params(optarg, threads)) <= 0)
+        usage();
+      break;
+    case 'c':
+      if ((num_clients = parse_params(optarg, clients)) <= 0)
+        usage();
+      break;
+    case 's':
+      if ((num_stations = parse_params(optarg, stations)) <= 0)
+        usage();
+      break;
+    case 'd':
+      if ((duration_ms = atol(optarg)) <= 0)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc)
+    usage();
+
+  // every connect, switch and disconnect would otherwise be logged
+  set_log_level(LOG_LEVEL_WARN);
+  srand(getpid());
+
+  listener = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (listener == -1 || init_client_control(&client_control, listener)) {
+    perror("main: eventfd");
+    exit(1);
+  }
+
+  printf("%7s %7s %8s %10s %9s %9s %9s %10s %9s %9s %9s\n", "threads",
+         "clients", "stations", "hello/s", "p50(us)", "p99(us)", "p999(us)",
+         "switch/s", "p50(us)", "p99(us)", "p999(us)");
+  for (int t = 0; t < num_threads; t++)
+    for (int c = 0; c < num_clients; c++)
+      for (int s = 0; s < num_stations; s++)
+        if (run(threads[t], clients[c], stations[s], duration_ms))
+          exit(1);
+
+  destroy_client_control(&client_control);
+  return 0;
+}
@@ -0,0 +1,234 @@
+#include "bench.h"
+#include "station.h"
+
+/**
+ * Fan-out microbenchmark: sends ticks to N synthetic listeners on loopback,
+ * through each fan-out strategy, with no streamer pacing, no control clients
+ * and no song to read.
+ *
+ * Listeners are spread over a few sink sockets that are never read: once
+ * their queues fill, loopback discards what arrives, which costs the sender
+ * the same as delivering it. Each strategy gets its own station, stopped right
+ * away so the bench drives send_to_connections itself.
+ */
+
+#define DEFAULT_LISTENERS "1,100,10000,100000"
+#define DEFAULT_SINKS 64     // sink sockets listeners are spread over
+#define DEFAULT_MAX_TICKS 64 // most ticks measured per run
+#define BENCH_MIN_TICKS 3    // fewest ticks measured per run...
+#define BENCH_MIN_MS 1000    // ...which stops after this long
+#define TICKS_PER_SEC (1000000 / WAIT_TIME)
+
+/**
+ * A way of sending one tick to every listener.
+ */
+typedef struct {
+  const char *name;         // what to report it as
+  int tx_timestamps;        // whether its station has -T on
+  int (*tick)(station_t *); // sends a tick; returns datagrams sent
+} strategy_t;
+
+/**
+ * The original fan-out, one sendto per listener; kept as a baseline.
+ */
+static int tick_sendto(station_t *station) {
+  int sent = 0;
+  lock_station_clients(station);
+  client_connection_t *it;
+  list_iterate_begin(&station->client_list.sync_list, it, client_connection_t,
+                     link) {
+    int fd = it->udp_addr.ss_family == PF_INET ? station->ipv4_stream_fd
+                                               : station->ipv6_stream_fd;
+    if (sendtoall(fd, station->buf, sizeof(station->buf),
+                  (struct sockaddr *)&it->udp_addr, it->addr_len) == 0)
+      sent++;
+  }
+  list_iterate_end();
+  unlock_station_clients(station);
+  return sent;
+}
+
+/**
+ * The server's fan-out: batched sendmmsg, with error queue and keepalive
+ * draining, parking and egress accounting.
+ */
+static int tick_sendmmsg(station_t *station) {
+  size_t listeners;
+  return send_to_connections(station, &listeners);
+}
+
+static strategy_t strategies[] = {
+    {"sendto", 0, tick_sendto},
+    {"sendmmsg", 0, tick_sendmmsg},
+    {"sendmmsg -T", 1, tick_sendmmsg},
+};
+#define NUM_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+static void usage(void) {
+  fprintf(stderr, "Usage: ./bench/bench_fanout [-n <LISTENERS,...>] "
+                  "[-s <SINKS>] [-t <MAX_TICKS>]\n");
+  exit(1);
+}
+
+/**
+ * Opens sink sockets on loopback.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int open_sinks(int *sinks, struct sockaddr_in *addrs, int num_sinks) {
+  for (int i = 0; i < num_sinks; i++) {
+    addrs[i] = (struct sockaddr_in){.sin_family = AF_INET,
+                                    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addrs[i]);
+    if ((sinks[i] = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+        bind(sinks[i], (struct sockaddr *)&addrs[i], len) == -1 ||
+        getsockname(sinks[i], (struct sockaddr *)&addrs[i], &len) == -1) {
+      perror("open_sinks: socket/bind/getsockname");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Gives a station `n` listeners, spread over the sinks.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int add_listeners(station_t *station, struct sockaddr_in *addrs,
+                         int num_sinks, long n) {
+  lock_station_clients(station);
+  for (long i = 0; i < n; i++) {
+    struct sockaddr_in *addr = &addrs[i % num_sinks];
+    // no control connection; destroy_connection closes -1, harmlessly
+    client_connection_t *conn =
+        init_connection(-1, ntohs(addr->sin_port), (struct sockaddr *)addr,
+                        sizeof(*addr));
+    if (conn == NULL) {
+      unlock_station_clients(station);
+      return -1;
+    }
+    accept_connection(station, conn);
+  }
+  unlock_station_clients(station);
+  return 0;
+}
+
+/**
+ * Takes every listener off a station, and frees them.
+ */
+static void remove_listeners(station_t *station) {
+  lock_station_clients(station);
+  while (!list_empty(&station->client_list.sync_list)) {
+    client_connection_t *conn = list_head(&station->client_list.sync_list,
+                                          client_connection_t, link);
+    remove_connection(station, conn);
+    destroy_connection(conn);
+  }
+  unlock_station_clients(station);
+}
+
+/**
+ * Runs ticks through a strategy until there are enough, and prints a line of
+ * results.
+ */
+static void run(strategy_t *s, station_t *station, long listeners,
+                long max_ticks) {
+  s->tick(station); // warm up: fault in the batch, fill the sinks
+  uint64_t syscalls = get_bench_syscalls();
+  uint64_t cpu = get_thread_cpu_ns();
+  uint64_t start = get_time_ns(), now = start;
+  uint64_t sent = 0;
+  long ticks = 0;
+  while (ticks < max_ticks &&
+         (ticks < BENCH_MIN_TICKS || now - start < BENCH_MIN_MS * 1000000ULL)) {
+    sent += s->tick(station);
+    ticks++;
+    now = get_time_ns();
+  }
+  double wall_ns = now - start;
+  double cpu_ns = get_thread_cpu_ns() - cpu;
+  syscalls = get_bench_syscalls() - syscalls;
+
+  // a station needs its CPU per tick, TICKS_PER_SEC times a second
+  printf("%-12s %10ld %6ld %12.0f %10.1f %10.1f %12.1f %9.2f%%\n", s->name,
+         listeners, ticks, sent / (wall_ns / 1e9), sent ? wall_ns / sent : 0,
+         (double)syscalls / ticks, cpu_ns / ticks / 1000,
+         cpu_ns / ticks * TICKS_PER_SEC / 1e7);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  char default_listeners[] = DEFAULT_LISTENERS;
+  long counts[BENCH_MAX_PARAMS];
+  int num_counts = parse_params(default_listeners, counts);
+  int opt, num_sinks = DEFAULT_SINKS;
+  long max_ticks = DEFAULT_MAX_TICKS;
+  while ((opt = getopt(argc, argv, "n:s:t:")) != -1) {
+    switch (opt) {
+    case 'n':
+      if ((num_counts = parse_params(optarg, counts)) <= 0)
+        usage();
+      break;
+    case 's':
+      if ((num_sinks = atoi(optarg)) <= 0)
+        usage();
+      break;
+    case 't':
+      if ((max_ticks = atol(optarg)) < BENCH_MIN_TICKS)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc)
+    usage();
+
+  // destroying 100k listeners would otherwise log 100k lines
+  set_log_level(LOG_LEVEL_WARN);
+
+  int sinks[num_sinks];
+  struct sockaddr_in addrs[num_sinks];
+  if (open_sinks(sinks, addrs, num_sinks))
+    exit(1);
+
+  // no budget: every tick goes out
+  egress_t egress;
+  if (init_egress(&egress, 0, NUM_STRATEGIES))
+    exit(1);
+  station_t *stations[NUM_STRATEGIES];
+  for (size_t i = 0; i < NUM_STRATEGIES; i++) {
+    // the song is never read (the streamer is stopped straight away), and
+    // /dev/zero never ends, so no announcement needs a thread pool
+    station_config_t config = {.t_pool = NULL,
+                               .keepalive_timeout_ns = 0,
+                               .egress = &egress,
+                               .tx_timestamps = strategies[i].tx_timestamps};
+    if ((stations[i] = init_station(i, "/dev/zero", &config, 1)) == NULL)
+      exit(1);
+    stop_station(stations[i]);
+  }
+
+  printf("%-12s %10s %6s %12s %10s %10s %12s %10s\n", "strategy", "listeners",
+         "ticks", "sends/s", "ns/dgram", "calls/tick", "cpu/tick(us)",
+         "core/stn");
+  for (int c = 0; c < num_counts; c++) {
+    for (size_t i = 0; i < NUM_STRATEGIES; i++) {
+      if (add_listeners(stations[i], addrs, num_sinks, counts[c])) {
+        fprintf(stderr, "[main] Failed to add %ld listeners.\n", counts[c]);
+        exit(1);
+      }
+      run(&strategies[i], stations[i], counts[c], max_ticks);
+      remove_listeners(stations[i]);
+    }
+  }
+
+  for (size_t i = 0; i < NUM_STRATEGIES; i++)
+    destroy_station(stations[i]);
+  for (int i = 0; i < num_sinks; i++)
+    close(sinks[i]);
+  return 0;
+}
@@ -0,0 +1,277 @@
+#include "bench.h"
+#include "thread_pool.h"
+
+/**
+ * Thread pool microbenchmark: producer threads push synthetic jobs through a
+ * fixed-size pool, measuring jobs per second and how long each job waited
+ * between being submitted and starting.
+ *
+ * The pool has a single queueing design, but jobs reach a worker by one of
+ * three paths, and each is measured as a mode of its own:
+ * - inject: the producer calls add_job per job, onto the injection queue.
+ * - batch: the producer calls add_jobs once per burst, onto the same queue
+ * with a single round of wakeups.
+ * - deque: the producer submits one seed job per burst, which calls add_job
+ * from inside a worker, so the burst lands on that worker's own deque and the
+ * others have to steal it.
+ *
+ * Producers work in bursts: each submits a burst, then waits until all of it
+ * has run before submitting the next one. A burst of 1 measures a round trip
+ * through an idle pool (i.e. waking a parked worker); larger bursts queue.
+ */
+
+#define DEFAULT_PRODUCERS "1,4"
+#define DEFAULT_WORKERS "1,4,16"
+#define DEFAULT_JOB_NS "1,10000"
+#define DEFAULT_BURSTS "1,64"
+#define DEFAULT_DURATION_MS 200 // time spent submitting per run
+
+/**
+ * A way of submitting a burst of jobs.
+ */
+typedef enum {
+  MODE_INJECT, // add_job, from outside the pool
+  MODE_BATCH,  // add_jobs, from outside the pool
+  MODE_DEQUE,  // add_job, from a job on a worker
+  NUM_MODES
+} submit_mode_t;
+
+static const char *mode_names[NUM_MODES] = {"inject", "batch", "deque"};
+
+/**
+ * One producer thread.
+ */
+typedef struct {
+  pthread_t thread;        // submits the bursts
+  atomic_long outstanding; // jobs of the current burst yet to finish
+  uint64_t submitted;      // jobs submitted so far
+} producer_t;
+
+/**
+ * A job's argument; allocated from bench_slab, and freed by the pool.
+ */
+typedef struct {
+  producer_t *producer;  // whose burst it's part of
+  uint64_t submitted_ns; // when it was handed to the pool
+} bench_job_t;
+
+static slab_t bench_slab =
+    SLAB_INITIALIZER("bench_job_t", sizeof(bench_job_t));
+
+// the current run's settings, fixed while its producers are running
+static thread_pool_t *pool;
+static submit_mode_t mode;
+static long job_ns, burst;
+static atomic_int stopped;
+static histogram_t wait_ns; // submitted to started, across every job
+
+static void usage(void) {
+  fprintf(stderr, "Usage: ./bench/bench_pool [-p <PRODUCERS,...>] "
+                  "[-w <WORKERS,...>] [-j <JOB_NS,...>] [-b <BURSTS,...>] "
+                  "[-d <MS>]\n");
+  exit(1);
+}
+
+/**
+ * The synthetic job: notes how long it waited, then spins for job_ns.
+ */
+static void run_job(void *arg) {
+  bench_job_t *job = arg;
+  uint64_t start = get_time_ns();
+  hist_record(&wait_ns, start - job->submitted_ns);
+  while (get_time_ns() - start < job_ns)
+    ;
+  atomic_fetch_sub(&job->producer->outstanding, 1);
+}
+
+/**
+ * Allocates a job's argument, stamped with the current time.
+ *
+ * Returns:
+ * - the argument, or NULL on failure
+ */
+static bench_job_t *new_job(producer_t *producer) {
+  bench_job_t *job = slab_alloc(&bench_slab);
+  if (job == NULL) {
+    fprintf(stderr, "[new_job] Failed to allocate a job.\n");
+    return NULL;
+  }
+  job->producer = producer;
+  job->submitted_ns = get_time_ns();
+  return job;
+}
+
+/**
+ * Submits a burst one job at a time, with add_job. Jobs that can't be added
+ * are taken off the producer's count.
+ */
+static void submit_each(producer_t *producer, long n) {
+  for (long i = 0; i < n; i++) {
+    bench_job_t *job = new_job(producer);
+    if (job == NULL || add_job(pool, JOB_PRIO_SWITCH, run_job, job) != 1) {
+      slab_free(job);
+      atomic_fetch_sub(&producer->outstanding, n - i);
+      return;
+    }
+  }
+}
+
+/**
+ * The deque mode's seed job: submits a burst from inside a worker.
+ */
+static void run_seed(void *arg) {
+  bench_job_t *seed = arg;
+  submit_each(seed->producer, burst);
+}
+
+/**
+ * Submits one burst in the current mode.
+ */
+static void submit_burst(producer_t *producer) {
+  atomic_store(&producer->outstanding, burst);
+  if (mode == MODE_INJECT) {
+    submit_each(producer, burst);
+  } else if (mode == MODE_BATCH) {
+    void *jobs[burst];
+    long n;
+    for (n = 0; n < burst && (jobs[n] = new_job(producer)) != NULL; n++)
+      ;
+    size_t added = add_jobs(pool, JOB_PRIO_SWITCH, run_job, jobs, n);
+    for (long i = added; i < n; i++)
+      slab_free(jobs[i]);
+    atomic_fetch_sub(&producer->outstanding, burst - added);
+  } else {
+    bench_job_t *seed = new_job(producer);
+    if (seed == NULL || add_job(pool, JOB_PRIO_SWITCH, run_seed, seed) != 1) {
+      slab_free(seed);
+      atomic_store(&producer->outstanding, 0);
+    }
+  }
+}
+
+/**
+ * Submits bursts until the run is stopped, each once the last one is done.
+ *
+ * Inputs:
+ * - producer_t *producer: this producer
+ *
+ * Returns:
+ * - NULL
+ */
+static void *produce(void *arg) {
+  producer_t *producer = arg;
+  while (!atomic_load(&stopped)) {
+    submit_burst(producer);
+    producer->submitted += burst;
+    while (atomic_load(&producer->outstanding) > 0)
+      sched_yield();
+  }
+  return NULL;
+}
+
+/**
+ * Runs one configuration, and prints a line of results.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int run(long producers, long workers, long duration_ms) {
+  pool = init_thread_pool(workers, workers); // never resized
+  hist_init(&wait_ns);
+  atomic_store(&stopped, 0);
+
+  producer_t ps[producers];
+  uint64_t start = get_time_ns();
+  for (long i = 0; i < producers; i++) {
+    ps[i].submitted = 0;
+    atomic_init(&ps[i].outstanding, 0);
+    int ret = pthread_create(&ps[i].thread, NULL, produce, &ps[i]);
+    if (ret)
+      handle_error_en(ret, "run: pthread_create");
+  }
+  usleep(duration_ms * 1000);
+  atomic_store(&stopped, 1);
+  uint64_t jobs = 0;
+  for (long i = 0; i < producers; i++) {
+    int ret = pthread_join(ps[i].thread, NULL);
+    if (ret)
+      handle_error_en(ret, "run: pthread_join");
+    jobs += ps[i].submitted;
+  }
+  wait_thread_pool(pool);
+  double elapsed_ns = get_time_ns() - start;
+  destroy_thread_pool(pool);
+
+  hist_snapshot_t snap;
+  bench_snapshot(&snap, &wait_ns);
+  if (snap.count != jobs) {
+    fprintf(stderr, "[run] Submitted %lu jobs, but %lu ran.\n", jobs,
+            snap.count);
+    return -1;
+  }
+  printf("%-7s %9ld %7ld %7ld %6ld %10.0f %9.1f %9.1f %9.1f\n",
+         mode_names[mode], producers, workers, job_ns, burst,
+         jobs / (elapsed_ns / 1e9), hist_percentile(&snap, 50) / 1000.0,
+         hist_percentile(&snap, 99) / 1000.0,
+         hist_percentile(&snap, 99.9) / 1000.0);
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char default_producers[] = DEFAULT_PRODUCERS,
+       default_workers[] = DEFAULT_WORKERS, default_job_ns[] = DEFAULT_JOB_NS,
+       default_bursts[] = DEFAULT_BURSTS;
+  long producers[BENCH_MAX_PARAMS], workers[BENCH_MAX_PARAMS],
+      job_sizes[BENCH_MAX_PARAMS], bursts[BENCH_MAX_PARAMS];
+  int num_producers = parse_params(default_producers, producers);
+  int num_workers = parse_params(default_workers, workers);
+  int num_job_sizes = parse_params(default_job_ns, job_sizes);
+  int num_bursts = parse_params(default_bursts, bursts);
+  long duration_ms = DEFAULT_DURATION_MS;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:w:j:b:d:")) != -1) {
+    switch (opt) {
+    case 'p':
+      if ((num_producers = parse_params(optarg, producers)) <= 0)
+        usage();
+      break;
+    case 'w':
+      if ((num_workers = parse_params(optarg, workers)) <= 0)
+        usage();
+      break;
+    case 'j':
+      if ((num_job_sizes = parse_params(optarg, job_sizes)) <= 0)
+        usage();
+      break;
+    case 'b':
+      if ((num_bursts = parse_params(optarg, bursts)) <= 0)
+        usage();
+      break;
+    case 'd':
+      if ((duration_ms = atol(optarg)) <= 0)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc)
+    usage();
+
+  printf("%-7s %9s %7s %7s %6s %10s %9s %9s %9s\n", "mode", "producers",
+         "workers", "job(ns)", "burst", "jobs/s", "p50(us)", "p99(us)",
+         "p999(us)");
+  for (int m = 0; m < NUM_MODES; m++)
+    for (int j = 0; j < num_job_sizes; j++)
+      for (int b = 0; b < num_bursts; b++)
+        for (int p = 0; p < num_producers; p++)
+          for (int w = 0; w < num_workers; w++) {
+            mode = m;
+            job_ns = job_sizes[j];
+            burst = bursts[b];
+            if (run(producers[p], workers[w], duration_ms))
+              exit(1);
+          }
+  return 0;
+}
@@ -14,16 +14,32 @@ int main(int argc, char *argv[]) {
   }
 
   char buf[BSIZ];
+  struct sockaddr_storage from;
+  socklen_t from_len;
+  keepalive_t keepalive = {MESSAGE_KEEPALIVE};
+  uint64_t last_keepalive = 0;
   while (1) {
-    // we don't care about receiving all the information or knowing where it
-    // came from
+    // we don't care about receiving all the information, but we do want to
+    // know where it came from, to tell it we're still here
     memset(buf, 0, sizeof(buf));
-    int ret = recvfrom(udp_fd, buf, BSIZ, 0, NULL, NULL);
+    from_len = sizeof(from);
+    int ret =
+        recvfrom(udp_fd, buf, BSIZ, 0, (struct sockaddr *)&from, &from_len);
     if (ret == -1) {
       perror("recvfrom");
       exit(1);
     }
 
+    // every so often, let the station know we're alive; if this fails, the
+    // server just thinks we're gone, so keep listening either way
+    uint64_t now = get_time_ns();
+    if (now - last_keepalive >= KEEPALIVE_INTERVAL_MS * 1000000ULL) {
+      if (sendto(udp_fd, &keepalive, sizeof(keepalive), 0,
+                 (struct sockaddr *)&from, from_len) == -1)
+        perror("sendto");
+      last_keepalive = now;
+    }
+
     // print all information received
     fwrite(buf, sizeof(char), BSIZ, stdout);
   }
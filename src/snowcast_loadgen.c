@@ -0,0 +1,554 @@
+#include "snowcast_loadgen.h"
+
+static loadgen_t lg;
+
+static void usage(void) {
+  fprintf(stderr, "Usage: ./snowcast_loadgen [-n <CLIENTS>] [-c <CONNECTS/S>] "
+                  "[-r <SWITCHES/S>] [-S <SLOW_PCT>] [-d <SECONDS>] "
+                  "[-R <DATAGRAMS/S>] [-i <INTERVAL_MS>] <SERVERNAME> "
+                  "<SERVERPORT>\n");
+  exit(1);
+}
+
+/**
+ * Reads the realtime clock, which is what the kernel's receive timestamps
+ * use.
+ */
+static uint64_t get_realtime_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Adds a client's current stream to its class's loss count, and ends it.
+ */
+static void end_stream(load_client_t *c) {
+  if (c->received > 0) {
+    load_stats_t *stats = &lg.stats[c->slow];
+    stats->datagrams += c->received;
+    stats->expected +=
+        (c->last_ns - c->first_ns + lg.nominal_ns / 2) / lg.nominal_ns + 1;
+  }
+  c->received = 0;
+}
+
+/**
+ * Closes a client's sockets, for good.
+ */
+static void close_client(load_client_t *c) {
+  if (c->state == LOAD_CLOSED)
+    return;
+  end_stream(c);
+  // closing removes them from the epoll set
+  if (c->tcp_fd != -1)
+    close(c->tcp_fd);
+  if (c->udp_fd != -1)
+    close(c->udp_fd);
+  c->tcp_fd = c->udp_fd = -1;
+  c->state = LOAD_CLOSED;
+  lg.closed++;
+}
+
+/**
+ * Sends a SetStation to some station other than the client's current one.
+ */
+static void switch_station(load_client_t *c) {
+  if (lg.num_stations == 0 || (lg.num_stations == 1 && c->station == 0))
+    return;
+  int station;
+  do
+    station = rand() % lg.num_stations;
+  while (station == c->station);
+
+  end_stream(c);
+  c->old_src = c->src;
+  c->switching = 1;
+  c->announced = 0;
+  c->old_station = c->station;
+  c->station = station;
+  c->switch_ns = get_realtime_ns();
+  set_station_t cmd = {MESSAGE_SET_STATION, htons(station)};
+  // three bytes into an empty buffer either all go, or the connection's gone
+  if (send(c->tcp_fd, &cmd, sizeof(cmd), MSG_NOSIGNAL) != sizeof(cmd)) {
+    close_client(c);
+    return;
+  }
+  lg.switches++;
+}
+
+/**
+ * Starts connecting a client: opens its listener, then the control
+ * connection, without waiting for either.
+ */
+static void start_client(load_client_t *c) {
+  c->connect_ns = get_time_ns();
+  c->state = LOAD_CONNECTING;
+  c->udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  c->tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->udp_fd == -1 || c->tcp_fd == -1) {
+    perror("start_client: socket");
+    close_client(c);
+    return;
+  }
+
+  // any port will do; the Hello says which
+  struct sockaddr_in addr = {.sin_family = AF_INET};
+  socklen_t addr_len = sizeof(addr);
+  int yes = 1, rcvbuf = SLOW_RCVBUF;
+  if (bind(c->udp_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      getsockname(c->udp_fd, (struct sockaddr *)&addr, &addr_len) == -1 ||
+      setsockopt(c->udp_fd, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes)) ==
+          -1 ||
+      (c->slow && setsockopt(c->udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                             sizeof(rcvbuf)) == -1)) {
+    perror("start_client: bind/getsockname/setsockopt");
+    close_client(c);
+    return;
+  }
+  c->src.sin_port = addr.sin_port; // only the port, until the stream starts
+
+  if (connect(c->tcp_fd, (struct sockaddr *)&lg.server, sizeof(lg.server)) ==
+          -1 &&
+      errno != EINPROGRESS) {
+    close_client(c);
+    return;
+  }
+
+  // slow clients' listeners are only ever read by drain_slow_clients
+  struct epoll_event ev = {.events = EPOLLOUT,
+                           .data.u64 = (uint64_t)(c - lg.clients) << 1};
+  if (epoll_ctl(lg.epoll_fd, EPOLL_CTL_ADD, c->tcp_fd, &ev) == -1 ||
+      (!c->slow &&
+       epoll_ctl(lg.epoll_fd, EPOLL_CTL_ADD, c->udp_fd,
+                 &(struct epoll_event){.events = EPOLLIN,
+                                       .data.u64 = ev.data.u64 | 1}) == -1)) {
+    perror("start_client: epoll_ctl");
+    close_client(c);
+  }
+}
+
+/**
+ * Finishes connecting a client, and sends its Hello.
+ */
+static void send_hello(load_client_t *c) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(c->tcp_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+    close_client(c);
+    return;
+  }
+
+  hello_t hello = {MESSAGE_HELLO, c->src.sin_port}; // already network order
+  struct epoll_event ev = {.events = EPOLLIN,
+                           .data.u64 = (uint64_t)(c - lg.clients) << 1};
+  if (send(c->tcp_fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+      epoll_ctl(lg.epoll_fd, EPOLL_CTL_MOD, c->tcp_fd, &ev) == -1) {
+    close_client(c);
+    return;
+  }
+  c->state = LOAD_HANDSHAKE;
+}
+
+/**
+ * Handles one complete reply from the server.
+ */
+static void handle_reply(load_client_t *c, uint8_t *reply) {
+  load_stats_t *stats = &lg.stats[c->slow];
+  switch (reply[0]) {
+  case REPLY_WELCOME:
+    if (c->state != LOAD_HANDSHAKE) {
+      close_client(c);
+      return;
+    }
+    hist_record(&stats->handshake_ns, get_time_ns() - c->connect_ns);
+    lg.num_stations = ntohs(((welcome_t *)reply)->num_stations);
+    lg.connected++;
+    c->state = LOAD_READY;
+    // from here on, slow clients only read when drained
+    if (c->slow)
+      epoll_ctl(lg.epoll_fd, EPOLL_CTL_DEL, c->tcp_fd, NULL);
+    switch_station(c);
+    break;
+  case REPLY_ANNOUNCE:
+    // a full station refuses the switch with an Announce of its own; the
+    // client stays on its old station, and may switch again
+    if (c->switching &&
+        memmem(reply + sizeof(announce_t), reply[1], REFUSED_TEXT,
+               strlen(REFUSED_TEXT)) != NULL) {
+      c->switching = 0;
+      c->station = c->old_station;
+      lg.refused++;
+      break;
+    }
+    // the reference server may announce after the stream has started, and
+    // stations also announce when their song repeats
+    if (c->station != -1 && !c->announced) {
+      hist_record(&stats->announce_ns, get_realtime_ns() - c->switch_ns);
+      c->announced = 1;
+    }
+    break;
+  default:
+    lg.invalid++;
+    close_client(c);
+  }
+}
+
+/**
+ * Reads whatever the server sent a client, and handles every complete reply.
+ */
+static void read_replies(load_client_t *c) {
+  while (c->state != LOAD_CLOSED) {
+    ssize_t n =
+        recv(c->tcp_fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0) {
+      close_client(c);
+      return;
+    }
+    c->in_len += n;
+
+    // replies are a type, then either a 2-byte value or a sized string
+    while (c->state != LOAD_CLOSED && c->in_len >= 2) {
+      size_t size = c->in[0] == REPLY_WELCOME ? sizeof(welcome_t)
+                                              : sizeof(announce_t) + c->in[1];
+      if (c->in_len < size)
+        break;
+      handle_reply(c, c->in);
+      memmove(c->in, c->in + size, c->in_len - size);
+      c->in_len -= size;
+    }
+  }
+}
+
+/**
+ * Accounts for a datagram that reached a client's listener.
+ */
+static void handle_datagram(load_client_t *c, struct sockaddr_in *from,
+                            uint64_t arrived_ns) {
+  lg.total_datagrams++;
+  load_stats_t *stats = &lg.stats[c->slow];
+  if (c->switching) {
+    // buffered datagrams from the old station keep coming after the switch,
+    // Announce or not; only a station known to stream from the same socket
+    // (a server that uses one for all of them) can be told apart by nothing
+    // better than its Announce
+    struct sockaddr_in *known = &lg.station_srcs[c->station];
+    if (c->has_src &&
+        same_address((struct sockaddr *)from, (struct sockaddr *)&c->old_src) &&
+        !(c->announced && known->sin_family != 0 &&
+          same_address((struct sockaddr *)known,
+                       (struct sockaddr *)&c->old_src)))
+      return; // still the old station
+    *known = *from;
+    hist_record(&stats->switch_ns, arrived_ns > c->switch_ns
+                                       ? arrived_ns - c->switch_ns
+                                       : 0);
+    c->switching = 0;
+    c->src = *from;
+    c->has_src = 1;
+    c->first_ns = c->last_ns = arrived_ns;
+    c->received = 1;
+    return;
+  }
+  if (c->received == 0) {
+    // a refused switch leaves the client on its old station, if it had one;
+    // that stream starts over here
+    if (c->station != -1) {
+      c->first_ns = c->last_ns = arrived_ns;
+      c->received = 1;
+    }
+    return;
+  }
+
+  // datagrams carry no sequence numbers, so measure from the nearest multiple
+  // of the interval; otherwise every lost datagram would count as jitter
+  uint64_t gap = arrived_ns - c->last_ns;
+  uint64_t intervals = (gap + lg.nominal_ns / 2) / lg.nominal_ns;
+  uint64_t nearest = (intervals ? intervals : 1) * lg.nominal_ns;
+  hist_record(&stats->jitter_ns, gap > nearest ? gap - nearest : nearest - gap);
+  c->last_ns = arrived_ns;
+  c->received++;
+}
+
+/**
+ * Reads the datagrams waiting on a client's listener, up to a limit.
+ */
+static void read_datagrams(load_client_t *c, int max) {
+  char buf[MAXBUFSIZ * 8];
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  for (int i = 0; i < max && c->state != LOAD_CLOSED; i++) {
+    struct sockaddr_in from;
+    struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+    struct msghdr msg = {.msg_name = &from,
+                         .msg_namelen = sizeof(from),
+                         .msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    if (recvmsg(c->udp_fd, &msg, 0) == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("read_datagrams: recvmsg");
+      return;
+    }
+
+    // when the kernel got it, not when we got around to it
+    uint64_t arrived_ns = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      arrived_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    } else {
+      arrived_ns = get_realtime_ns();
+    }
+    handle_datagram(c, &from, arrived_ns);
+  }
+}
+
+/**
+ * Reads everything slow clients were sent since they last looked.
+ */
+static void drain_slow_clients(void) {
+  for (int i = 0; i < lg.next_client; i++) {
+    load_client_t *c = &lg.clients[i];
+    if (!c->slow || c->state != LOAD_READY)
+      continue;
+    read_replies(c);
+    read_datagrams(c, INT32_MAX);
+  }
+}
+
+/**
+ * Tells every stream's station that its listener is still there, as
+ * snowcast_listener does.
+ */
+static void send_keepalives(void) {
+  keepalive_t keepalive = {MESSAGE_KEEPALIVE};
+  for (int i = 0; i < lg.next_client; i++) {
+    load_client_t *c = &lg.clients[i];
+    // mid-switch, the old station no longer listens for us; the new one
+    // does, if we know where it streams from
+    struct sockaddr_in *to = &c->src;
+    if (c->switching && lg.station_srcs[c->station].sin_family != 0)
+      to = &lg.station_srcs[c->station];
+    else if (c->switching || !c->has_src)
+      continue;
+    if (c->state == LOAD_READY)
+      sendto(c->udp_fd, &keepalive, sizeof(keepalive), 0,
+             (struct sockaddr *)to, sizeof(*to));
+  }
+}
+
+/**
+ * Connects and switches as many clients as the rates allow by now.
+ */
+static void pace(double secs) {
+  lg.connect_credit += secs * lg.connect_rate;
+  for (; lg.connect_credit >= 1 && lg.next_client < lg.num_clients;
+       lg.connect_credit--)
+    start_client(&lg.clients[lg.next_client++]);
+  if (lg.next_client == lg.num_clients)
+    lg.connect_credit = 0;
+
+  lg.switch_credit += secs * lg.switch_rate;
+  if (lg.connected == 0) {
+    lg.switch_credit = 0;
+    return;
+  }
+  // a few tries per switch, in case we keep picking busy clients
+  for (int tries = 0; lg.switch_credit >= 1 && tries < 16 * lg.switch_credit;
+       tries++) {
+    load_client_t *c = &lg.clients[rand() % lg.next_client];
+    if (c->state != LOAD_READY || c->switching)
+      continue;
+    switch_station(c);
+    lg.switch_credit--;
+  }
+  if (lg.switch_credit > lg.switch_rate)
+    lg.switch_credit = lg.switch_rate; // don't let a backlog pile up
+}
+
+/**
+ * Prints what one class of clients saw over the whole run.
+ */
+static void print_stats(const char *name, load_stats_t *stats) {
+  hist_snapshot_t snap;
+  printf("%s clients:\n", name);
+  memset(&snap, 0, sizeof(snap));
+  hist_merge(&snap, &stats->handshake_ns);
+  hist_print_ns(stdout, "  handshake", &snap);
+  memset(&snap, 0, sizeof(snap));
+  hist_merge(&snap, &stats->announce_ns);
+  hist_print_ns(stdout, "  switch to announce", &snap);
+  memset(&snap, 0, sizeof(snap));
+  hist_merge(&snap, &stats->switch_ns);
+  hist_print_ns(stdout, "  switch to audio", &snap);
+  memset(&snap, 0, sizeof(snap));
+  hist_merge(&snap, &stats->jitter_ns);
+  hist_print_ns(stdout, "  inter-arrival jitter", &snap);
+  printf("  datagrams: %lu received, %lu expected (%.2f%% lost)\n",
+         stats->datagrams, stats->expected,
+         stats->expected > stats->datagrams
+             ? (stats->expected - stats->datagrams) * 100.0 / stats->expected
+             : 0);
+}
+
+int main(int argc, char *argv[]) {
+  // parse options
+  int opt, slow_pct = 0;
+  long duration_s = DEFAULT_DURATION_S, report_ms = DEFAULT_REPORT_MS;
+  double datagram_rate = DATAGRAM_RATE;
+  lg.num_clients = DEFAULT_CLIENTS;
+  lg.connect_rate = DEFAULT_CONNECT_RATE;
+  lg.switch_rate = DEFAULT_SWITCH_RATE;
+  while ((opt = getopt(argc, argv, "n:c:r:S:d:R:i:")) != -1) {
+    switch (opt) {
+    case 'n':
+      if ((lg.num_clients = atoi(optarg)) <= 0)
+        usage();
+      break;
+    case 'c':
+      if ((lg.connect_rate = atof(optarg)) <= 0)
+        usage();
+      break;
+    case 'r':
+      if ((lg.switch_rate = atof(optarg)) < 0)
+        usage();
+      break;
+    case 'S':
+      slow_pct = atoi(optarg);
+      if (slow_pct < 0 || slow_pct > 100)
+        usage();
+      break;
+    case 'd':
+      if ((duration_s = atol(optarg)) <= 0)
+        usage();
+      break;
+    case 'R':
+      if ((datagram_rate = atof(optarg)) <= 0)
+        usage();
+      break;
+    case 'i':
+      if ((report_ms = atol(optarg)) <= 0)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind != 2)
+    usage();
+  lg.nominal_ns = 1e9 / datagram_rate;
+
+  // resolve the server; like everything else here, IPv4 only
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM},
+                  *res;
+  int ret = getaddrinfo(argv[optind], argv[optind + 1], &hints, &res);
+  if (ret) {
+    fprintf(stderr, "[main] getaddrinfo: %s\n", gai_strerror(ret));
+    exit(1);
+  }
+  memcpy(&lg.server, res->ai_addr, sizeof(lg.server));
+  freeaddrinfo(res);
+
+  // every client takes two descriptors
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if ((rlim_t)lg.num_clients * 2 + 16 > rl.rlim_cur) {
+      lg.num_clients = (rl.rlim_cur - 16) / 2;
+      fprintf(stderr, "[main] Only enough descriptors for %d clients.\n",
+              lg.num_clients);
+    }
+  }
+
+  lg.clients = calloc(lg.num_clients, sizeof(load_client_t));
+  lg.station_srcs = calloc(UINT16_MAX + 1, sizeof(struct sockaddr_in));
+  lg.epoll_fd = epoll_create1(0);
+  if (lg.clients == NULL || lg.station_srcs == NULL || lg.epoll_fd == -1) {
+    fprintf(stderr, "[main] Failed to allocate clients.\n");
+    exit(1);
+  }
+  srand(getpid());
+  for (int i = 0; i < lg.num_clients; i++) {
+    load_client_t *c = &lg.clients[i];
+    c->tcp_fd = c->udp_fd = -1;
+    c->station = -1;
+    c->old_station = -1;
+    // spread the slow ones evenly, rather than leaving chance to it
+    c->slow = (i + 1) * slow_pct / 100 > i * slow_pct / 100;
+  }
+
+  uint64_t start = get_time_ns(), last = start, last_report = start;
+  uint64_t last_drain = start, last_keepalive = start;
+  uint64_t prev_connected = 0, prev_switches = 0, prev_datagrams = 0;
+  struct epoll_event events[LOADGEN_EVENTS];
+  while (1) {
+    uint64_t now = get_time_ns();
+    if (now - start >= duration_s * 1000000000ULL)
+      break;
+    pace((now - last) / 1e9);
+    last = now;
+
+    if (now - last_drain >= SLOW_DRAIN_MS * 1000000ULL) {
+      drain_slow_clients();
+      last_drain = now;
+    }
+    if (now - last_keepalive >= KEEPALIVE_INTERVAL_MS * 1000000ULL) {
+      send_keepalives();
+      last_keepalive = now;
+    }
+    if (now - last_report >= report_ms * 1000000ULL) {
+      double secs = (now - last_report) / 1e9;
+      printf("[%5.1fs] clients %lu/%d (%lu closed), %.1f handshakes/s, "
+             "%.1f switches/s, %.1f datagrams/s\n",
+             (now - start) / 1e9, lg.connected, lg.num_clients, lg.closed,
+             (lg.connected - prev_connected) / secs,
+             (lg.switches - prev_switches) / secs,
+             (lg.total_datagrams - prev_datagrams) / secs);
+      fflush(stdout);
+      prev_connected = lg.connected;
+      prev_switches = lg.switches;
+      prev_datagrams = lg.total_datagrams;
+      last_report = now;
+    }
+
+    int n = epoll_wait(lg.epoll_fd, events, LOADGEN_EVENTS, LOADGEN_TICK_MS);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("main: epoll_wait");
+      exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+      load_client_t *c = &lg.clients[events[i].data.u64 >> 1];
+      if (c->state == LOAD_CLOSED)
+        continue; // closed earlier in this batch
+      if (events[i].data.u64 & 1)
+        read_datagrams(c, LOADGEN_DRAIN_MAX);
+      else if (c->state == LOAD_CONNECTING)
+        send_hello(c);
+      else
+        read_replies(c);
+    }
+  }
+
+  // finish off every stream, so the loss counts include them
+  for (int i = 0; i < lg.next_client; i++)
+    close_client(&lg.clients[i]);
+  printf("%lu of %d clients welcomed, %lu switches (%lu refused), "
+         "%lu InvalidCommands\n",
+         lg.connected, lg.num_clients, lg.switches, lg.refused, lg.invalid);
+  print_stats("normal", &lg.stats[0]);
+  if (slow_pct > 0)
+    print_stats("slow", &lg.stats[1]);
+
+  close(lg.epoll_fd);
+  free(lg.clients);
+  free(lg.station_srcs);
+  return 0;
+}
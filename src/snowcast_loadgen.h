@@ -0,0 +1,96 @@
+#ifndef __SNOWCAST_LOADGEN__
+#define __SNOWCAST_LOADGEN__
+
+#include <sys/resource.h>
+
+#include "./util/histogram.h"
+#include "./util/protocol.h"
+#include "./util/station.h"
+#include "./util/util.h"
+
+#define DEFAULT_CLIENTS 100       // simulated clients, unless told otherwise
+#define DEFAULT_CONNECT_RATE 1000 // new connections per second
+#define DEFAULT_SWITCH_RATE 10    // SetStations per second, across clients
+#define DEFAULT_DURATION_S 10     // how long to run for
+#define DEFAULT_REPORT_MS 1000    // time between progress lines
+#define LOADGEN_TICK_MS 5         // longest we sleep in epoll_wait
+#define LOADGEN_EVENTS 1024       // events handled per epoll_wait
+#define LOADGEN_DRAIN_MAX 64      // datagrams read per socket per event
+#define SLOW_DRAIN_MS 500         // how often slow clients read anything
+#define SLOW_RCVBUF 4096          // slow clients' UDP receive buffer
+#define DATAGRAM_RATE (STREAM_RATE / CHUNK_SIZE) // datagrams per second
+#define REFUSED_TEXT " is full;" // in the Announce refusing a switch
+
+/**
+ * What a simulated client is doing.
+ */
+typedef enum {
+  LOAD_IDLE,       // not started yet
+  LOAD_CONNECTING, // waiting for connect to finish
+  LOAD_HANDSHAKE,  // sent a Hello, waiting for the Welcome
+  LOAD_READY,      // welcomed; may switch stations
+  LOAD_CLOSED,     // gone, one way or another
+} load_state_t;
+
+/**
+ * What one class of clients (normal or slow) saw.
+ */
+typedef struct {
+  histogram_t handshake_ns; // connect to Welcome
+  histogram_t announce_ns;  // SetStation to its Announce
+  histogram_t switch_ns;    // SetStation to the new station's first datagram
+  histogram_t jitter_ns;    // inter-arrival times' distance from nominal
+  uint64_t datagrams;       // datagrams received in finished streams
+  uint64_t expected;        // datagrams those streams should have had
+} load_stats_t;
+
+/**
+ * A simulated client: a control connection plus its UDP listener.
+ */
+typedef struct {
+  int tcp_fd;                 // control connection
+  int udp_fd;                 // listener
+  load_state_t state;         // what it's doing
+  int slow;                   // whether it's a slow consumer
+  int station;                // station it last switched to, or -1
+  int old_station;            // ...and the one before, for a refused switch
+  int switching;              // waiting for the new station's first datagram
+  int announced;              // got the Announce for its latest switch
+  uint64_t connect_ns;        // when it started connecting (monotonic)
+  uint64_t switch_ns;         // when it sent its SetStation (realtime)
+  struct sockaddr_in src;     // where the stream comes from
+  struct sockaddr_in old_src; // ...and where it came from before the switch
+  int has_src;                // whether src is set
+  uint64_t first_ns;          // arrival of the stream's first datagram
+  uint64_t last_ns;           // ...and its latest (realtime)
+  uint64_t received;          // datagrams received from the stream
+  uint8_t in[MAXREPLYSIZE];   // partial reply from the server
+  size_t in_len;              // number of bytes in `in`
+} load_client_t;
+
+/**
+ * The whole run.
+ */
+typedef struct {
+  struct sockaddr_in server;        // where to connect
+  int epoll_fd;                     // every normal client's sockets
+  load_client_t *clients;           // every client
+  int num_clients;                  // ...and how many
+  int next_client;                  // next one to connect
+  int num_stations;                 // as the server's Welcome said
+  struct sockaddr_in *station_srcs; // each station's source, once seen
+  double connect_rate;              // connections per second
+  double switch_rate;               // SetStations per second
+  double connect_credit;            // connections owed so far
+  double switch_credit;             // SetStations owed so far
+  uint64_t nominal_ns;              // expected time between datagrams
+  load_stats_t stats[2];            // [0] for normal clients, [1] for slow ones
+  uint64_t connected;               // clients welcomed so far
+  uint64_t closed;                  // clients the server closed (or failed)
+  uint64_t invalid;                 // InvalidCommands received
+  uint64_t switches;                // SetStations sent
+  uint64_t refused;                 // ...that were refused (station full)
+  uint64_t total_datagrams;         // datagrams received, from any station
+} loadgen_t;
+
+#endif
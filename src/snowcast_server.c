@@ -5,34 +5,121 @@ server_control_t server_control;
 station_control_t station_control;
 client_control_t client_control;
 
+// one of these per readiness event; recycled through a slab
+static slab_t request_slab =
+    SLAB_INITIALIZER("handle_request_t", sizeof(handle_request_t));
+
+static void usage(void) {
+  fprintf(stderr, "Usage: ./snowcast_server [-b <BACKLOG>] [-k <INTERVALS>] "
+                  "[-e <KIBPS> [-w <W1>,<W2>,...]] [-m <SOCKET>] [-s <SHM>] "
+                  "[-T] [-L <LEVEL>] <PORT> <FILE1> [<FILE2> [<FILE3> "
+                  "[...]]]\n");
+  exit(1);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 3) {
-    fprintf(
-        stderr,
-        "Usage: ./snowcast_server <PORT> <FILE1> [<FILE2> [<FILE3> [...]]]\n");
-    exit(1);
+  // parse options
+  int opt, backlog = DEFAULT_BACKLOG, keepalive_intervals = 0;
+  int tx_timestamps = 0, log_level;
+  long egress_kibps = 0;
+  char *weights_arg = NULL, *metrics_path = NULL, *stats_name = NULL;
+  while ((opt = getopt(argc, argv, "b:k:e:w:m:s:TL:")) != -1) {
+    switch (opt) {
+    case 'b':
+      backlog = atoi(optarg);
+      if (backlog <= 0)
+        usage();
+      break;
+    case 'k':
+      // a listener that just switched stations may have its next keepalive
+      // go to the old one, so allow for missing one
+      keepalive_intervals = atoi(optarg);
+      if (keepalive_intervals < 2)
+        usage();
+      break;
+    case 'e':
+      egress_kibps = atol(optarg);
+      if (egress_kibps <= 0)
+        usage();
+      break;
+    case 'w':
+      weights_arg = optarg;
+      break;
+    case 'm':
+      metrics_path = optarg;
+      break;
+    case 's':
+      stats_name = optarg;
+      break;
+    case 'T':
+      tx_timestamps = 1;
+      break;
+    case 'L':
+      if ((log_level = parse_log_level(optarg)) == -1)
+        usage();
+      set_log_level(log_level);
+      break;
+    default:
+      usage();
+    }
   }
+  if (argc - optind < 2)
+    usage();
+
+  // from here on, connections and stations log through the flusher; if it
+  // can't start, they just log synchronously
+  start_logging();
 
   /* +-+-+-+-+-+-+-+-+-+-+-+-+-+-+ */
   /* |I|N|I|T|I|A|L|I|Z|A|T|I|O|N| */
   /* +-+-+-+-+-+-+-+-+-+-+-+-+-+-+ */
   // open listener socket
-  int listener = get_socket(NULL, argv[1], SOCK_STREAM);
+  int listener = get_socket(NULL, argv[optind], SOCK_STREAM);
   if (listener == -1)
     exit(1); // get_socket handles error printing
 
+  // listen again with our own backlog (this just updates it), and make the
+  // listener non-blocking so connections can be accepted until there are none
+  if (listen(listener, backlog) == -1 ||
+      fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK) == -1) {
+    perror("main: listen/fcntl");
+    close(listener);
+    exit(1);
+  }
+
   int ret;
   // Initialize client, server, and station control structs
   // clean up everything on failure
   // TODO: do I actually need the destroy_struct... calls? so tedious........
-  if ((ret = init_server_control(&server_control, INIT_NUM_THREADS))) {
+  if ((ret = init_server_control(&server_control, MIN_NUM_THREADS,
+                                 MAX_NUM_THREADS))) {
     close(listener);
     exit(1);
   }
 
-  size_t num_stations = argc - 2;
-  char **songs = argv + 2;
-  if ((ret = init_station_control(&station_control, num_stations, songs))) {
+  size_t num_stations = argc - optind - 1;
+  char **songs = argv + optind + 1;
+
+  // every station weighs 1 in the egress budget, unless -w says otherwise
+  uint64_t weights[num_stations];
+  for (size_t i = 0; i < num_stations; i++)
+    weights[i] = 1;
+  char *weight = weights_arg ? strtok(weights_arg, ",") : NULL;
+  for (size_t i = 0; weight != NULL && i < num_stations; i++) {
+    if (atol(weight) <= 0)
+      usage();
+    weights[i] = atol(weight);
+    weight = strtok(NULL, ",");
+  }
+
+  station_config_t config = {
+      .t_pool = server_control.t_pool,
+      .keepalive_timeout_ns =
+          keepalive_intervals * KEEPALIVE_INTERVAL_MS * 1000000ULL,
+      .tx_timestamps = tx_timestamps,
+  };
+  if ((ret = init_station_control(&station_control, num_stations, songs,
+                                  &config, egress_kibps * 1024, weights))) {
     close(listener);
     exit(1);
   }
@@ -42,6 +129,30 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
+  // serve metrics to anyone who asks, if we were told where
+  if (metrics_path != NULL) {
+    server_control.metrics_fd = open_metrics_socket(metrics_path);
+    if (server_control.metrics_fd == -1) {
+      close(listener);
+      exit(1);
+    }
+    if ((ret = pthread_create(&server_control.metrics_thread, NULL,
+                              serve_metrics, &server_control.metrics_fd)))
+      handle_error_en(ret, "main: pthread_create");
+  }
+
+  // and publish counters to shared memory, for readers like snowcast_stats
+  if (stats_name != NULL) {
+    server_control.stats = create_stats_segment(stats_name, num_stations);
+    if (server_control.stats == NULL) {
+      close(listener);
+      exit(1);
+    }
+    if ((ret = pthread_create(&server_control.stats_thread, NULL,
+                              publish_stats, server_control.stats)))
+      handle_error_en(ret, "main: pthread_create");
+  }
+
   /* +-+-+-+-+ +-+-+-+-+-+-+-+ */
   /* |P|O|L|L| |C|L|I|E|N|T|S| */
   /* +-+-+-+-+ +-+-+-+-+-+-+-+ */
@@ -62,11 +173,18 @@ int main(int argc, char *argv[]) {
   printf("Usage: \n"
          "\t'p <file>': Print all stations, their current songs, and who's "
          "connected. Can optionally supply a file for output location.\n"
+         "\t'a': Print allocator statistics.\n"
+         "\t'm': Print metrics.\n"
+         "\t't <file>': Dump every station's recent ticks as CSV. Can "
+         "optionally supply a file for output location.\n"
+         "\t's': Print client counters, thread pool statistics and (with "
+         "-T) transmit timing.\n"
+         "\t'l': Print lock contention (if built with LOCK_PROFILE=1).\n"
          "\t'q': Terminate the server.\n");
 
   // loop until REPL receives 'q' or '<C-D>' to stop.
   while (fgets(msg, MAXBUFSIZ, stdin)) {
-    process_input(msg, MAXBUFSIZ);
+    process_input(msg);
     if (check_stopped(&server_control))
       break;
   }
@@ -91,18 +209,38 @@ int main(int argc, char *argv[]) {
   // wait for threads to finish
   wait_thread_pool(server_control.t_pool);
 
-  // cancel polling thread, so it releases the client control mutex
+  // cancel polling thread; it's blocked in epoll_wait, a cancellation point
   ret = pthread_cancel(poller);
   if (ret)
     handle_error_en(ret, "main: pthread_cancel");
 
   printf("Closed listener socket and shut down poller thread.\n");
 
+  // stop serving metrics; the thread is only cancelled while it waits
+  if (server_control.metrics_fd != -1) {
+    if ((ret = pthread_cancel(server_control.metrics_thread)) ||
+        (ret = pthread_join(server_control.metrics_thread, NULL)))
+      handle_error_en(ret, "main: pthread_{cancel, join}");
+    close(server_control.metrics_fd);
+    unlink(metrics_path);
+  }
+
+  // same for the stats segment
+  if (server_control.stats != NULL) {
+    if ((ret = pthread_cancel(server_control.stats_thread)) ||
+        (ret = pthread_join(server_control.stats_thread, NULL)))
+      handle_error_en(ret, "main: pthread_{cancel, join}");
+    destroy_stats_segment(server_control.stats, stats_name);
+  }
+
   // destroy control structs
   destroy_station_control(&station_control);
   destroy_client_control(&client_control);
   destroy_server_control(&server_control);
 
+  // write out whatever's still buffered
+  stop_logging();
+
   printf("Goodbye!\n");
   return 0;
 }
@@ -115,7 +253,8 @@ int main(int argc, char *argv[]) {
 // So this doesn't actually return -1 on failure, it just exits. This is fine
 // since it's the first init call, but I may want to change how I report errors
 // here in the future.
-int init_server_control(server_control_t *server_control, size_t num_threads) {
+int init_server_control(server_control_t *server_control, size_t min_threads,
+                        size_t max_threads) {
   // initialize synchronization primitives
   int ret = pthread_mutex_init(&server_control->server_mtx, NULL) ||
             pthread_cond_init(&server_control->server_cond, NULL);
@@ -123,7 +262,7 @@ int init_server_control(server_control_t *server_control, size_t num_threads) {
     handle_error_en(ret, "init_server_control: pthread_{mutex,cond}_init");
 
   // attempt to create thread pool
-  server_control->t_pool = init_thread_pool(num_threads);
+  server_control->t_pool = init_thread_pool(min_threads, max_threads);
   if (server_control->t_pool == NULL) {
     // cleanup on failure
     ret = pthread_mutex_destroy(&server_control->server_mtx) ||
@@ -132,6 +271,8 @@ int init_server_control(server_control_t *server_control, size_t num_threads) {
       handle_error_en(ret, "init_server_control: pthread_{mutex,cond}_destroy");
   }
   server_control->stopped = 0;
+  server_control->metrics_fd = -1;
+  server_control->stats = NULL;
 
   return 0;
 }
@@ -149,62 +290,62 @@ void destroy_server_control(server_control_t *server_control) {
 }
 
 int init_station_control(station_control_t *station_control,
-                         size_t num_stations, char *songs[]) {
+                         size_t num_stations, char *songs[],
+                         station_config_t *config, uint64_t egress_rate,
+                         uint64_t *weights) {
+  // set up the egress budget the stations share
+  uint64_t total_weight = 0;
+  for (size_t i = 0; i < num_stations; i++)
+    total_weight += weights[i];
+  if (init_egress(&station_control->egress, egress_rate, total_weight))
+    return -1;
+  config->egress = &station_control->egress;
+
   // attempt to malloc enough space for the stations
   station_control->stations = malloc(num_stations * sizeof(station_t *));
   if (station_control->stations == NULL) {
     fprintf(stderr,
             "[init_station_control] Could not malloc stations array.\n");
+    destroy_egress(&station_control->egress);
     return -1;
   }
 
   station_control->num_stations = num_stations;
+  station_control->t_pool = config->t_pool;
   // attempt to init every station
   for (size_t i = 0; i < num_stations; i++) {
-    station_control->stations[i] = init_station(i, songs[i]);
+    station_control->stations[i] =
+        init_station(i, songs[i], config, weights[i]);
     if (station_control->stations[i] == NULL) {
-      // cleanup previously initialized stations
+      // cleanup previously initialized stations, and their announcements
       for (int j = 0; j < i; j++)
-        destroy_station(station_control->stations[i]);
+        stop_station(station_control->stations[j]);
+      wait_thread_pool(config->t_pool);
+      for (int j = 0; j < i; j++)
+        destroy_station(station_control->stations[j]);
       free(station_control->stations);
+      destroy_egress(&station_control->egress);
       return -1;
     }
   }
 
-  // initialize mutex
-  int ret = pthread_mutex_init(&station_control->station_mtx, NULL);
-  if (ret) {
-    // TODO: print better output
-    fprintf(stderr, "[init_station_control] Failed to initialize mutex.\n");
-    // if failure, cleanup previously initialized stations
-    for (size_t i = 0; i < num_stations; i++)
-      destroy_station(station_control->stations[i]);
-    free(station_control->stations);
-    return -1;
-  }
-
   return 0;
 }
 
 void destroy_station_control(station_control_t *station_control) {
-  // lock access to prevent others from editing stations while destroying
-  lock_station_control(station_control);
-  // cleanup all stations
+  // nobody else is using stations anymore (the poller is gone), except for the
+  // streamers and their announcements: stop the streamers, then let the last
+  // announcements finish before cleaning up all stations
+  for (size_t i = 0; i < station_control->num_stations; i++)
+    stop_station(station_control->stations[i]);
+  wait_thread_pool(station_control->t_pool);
   for (size_t i = 0; i < station_control->num_stations; i++)
     destroy_station(station_control->stations[i]);
   // free stations array
   free(station_control->stations);
-
-  // unlock and destroy mutex
-  unlock_station_control(station_control);
+  destroy_egress(&station_control->egress);
 
   printf("Stopped stations. ");
-
-  int ret = pthread_mutex_destroy(&station_control->station_mtx);
-  if (ret) {
-    // TODO: print better output
-    fprintf(stderr, "[destroy_station_control] Failed to destroy mutex.\n");
-  }
 }
 
 int init_client_control(client_control_t *client_control, int listener) {
@@ -213,106 +354,367 @@ int init_client_control(client_control_t *client_control, int listener) {
   if (ret)
     return -1;
 
-  client_control->num_pending = 0;
-  if ((ret = pthread_mutex_init(&client_control->clients_mtx, NULL) ||
-             pthread_cond_init(&client_control->pending_cond, NULL))) {
+  // watch the listener for new connections; clients are added as they come.
+  // Like clients, it's one-shot, since accepting is handed to the thread pool.
+  client_control->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {.events = CLIENT_EVENTS, .data.ptr = NULL};
+  if (client_control->epoll_fd == -1 ||
+      epoll_ctl(client_control->epoll_fd, EPOLL_CTL_ADD, listener, &ev) == -1) {
+    perror("init_client_control: epoll");
+    if (client_control->epoll_fd != -1)
+      close(client_control->epoll_fd);
+    destroy_client_vector(&client_control->client_vec);
+    return -1;
+  }
+
+  if ((ret = pthread_mutex_init(&client_control->clients_mtx, NULL))) {
     // TODO: print better output
-    fprintf(stderr, "[init_station_control] Failed to init cv/mutex.\n");
+    fprintf(stderr, "[init_client_control] Failed to init mutex.\n");
+    close(client_control->epoll_fd);
     destroy_client_vector(&client_control->client_vec);
     return -1;
   }
+  atomic_init(&client_control->num_clients, 0);
+  atomic_init(&client_control->num_switches, 0);
+  list_init(&client_control->handshakes);
+  list_init(&client_control->closing);
+  list_init(&client_control->graveyard);
 
   return 0;
 }
 
 void destroy_client_control(client_control_t *client_control) {
+  // destroy whatever the poller didn't get to
+  reap_clients(client_control);
+
   // first, try lock then unlock to ensure that mutex is properly cleaned up
   lock_client_control(client_control);
   // also synchronizes client cleanup
   destroy_client_vector(&client_control->client_vec);
+  close(client_control->epoll_fd);
   unlock_client_control(client_control);
 
   printf("Destroyed client information.\n");
 
-  // now, destroy mutex and cv
+  // now, destroy mutex
   int ret = pthread_mutex_destroy(&client_control->clients_mtx);
   if (ret) {
     handle_error_en(ret, "destroy_client_control: pthread_mutex_destroy");
   }
-
-  ret = pthread_cond_destroy(&client_control->pending_cond);
-  if (ret)
-    handle_error_en(ret, "destroy_client_control: pthread_cond_destroy");
 }
 
 void lock_server_control(server_control_t *server_control) {
-  pthread_mutex_lock(&server_control->server_mtx);
+  profiled_lock(&server_control->server_mtx, "server_control");
 }
 
 void unlock_server_control(server_control_t *server_control) {
-  pthread_mutex_unlock(&server_control->server_mtx);
+  profiled_unlock(&server_control->server_mtx);
 }
 
-void lock_station_control(station_control_t *station_control) {
-  pthread_mutex_lock(&station_control->station_mtx);
+void lock_client_control(client_control_t *client_control) {
+  profiled_lock(&client_control->clients_mtx, "client_control");
 }
 
-void unlock_station_control(station_control_t *station_control) {
-  pthread_mutex_unlock(&station_control->station_mtx);
+void unlock_client_control(client_control_t *client_control) {
+  profiled_unlock(&client_control->clients_mtx);
 }
 
-void lock_client_control(client_control_t *client_control) {
-  pthread_mutex_lock(&client_control->clients_mtx);
+/**
+ * Output of dump_stations, formatted into buf before being written out.
+ */
+typedef struct {
+  FILE *out;               // where the dump goes
+  size_t len;              // bytes formatted into buf so far
+  char buf[DUMP_BUF_SIZE]; // formatted output not yet written
+} dump_t;
+
+static void dump_flush(dump_t *dump) {
+  fwrite(dump->buf, 1, dump->len, dump->out);
+  dump->len = 0;
 }
 
-void unlock_client_control(client_control_t *client_control) {
-  pthread_mutex_unlock(&client_control->clients_mtx);
+static void dump_printf(dump_t *dump, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  size_t room = DUMP_BUF_SIZE - dump->len;
+  int n = vsnprintf(dump->buf + dump->len, room, fmt, args);
+  va_end(args);
+  if (n < room) {
+    dump->len += n;
+    return;
+  }
+
+  // didn't fit; write out what we have, and try again with an empty buffer
+  dump_flush(dump);
+  va_start(args, fmt);
+  if (n < DUMP_BUF_SIZE)
+    dump->len = vsnprintf(dump->buf, DUMP_BUF_SIZE, fmt, args);
+  else
+    vfprintf(dump->out, fmt, args);
+  va_end(args);
 }
 
-void process_input(char *msg, size_t size) {
+int dump_stations(FILE *out, int compact) {
+  // the REPL is the only one dumping, so the buffer needn't be on the stack
+  static dump_t dump;
+  dump.out = out;
+  dump.len = 0;
+
+  station_snapshot_t snap = {0};
+  char ipstr[INET6_ADDRSTRLEN];
+  int ret = 0;
+  for (size_t i = 0; i < station_control.num_stations; i++) {
+    if ((ret = snapshot_station(station_control.stations[i], &snap)))
+      break;
+
+    if (compact)
+      dump_printf(&dump, "S\t%d\t%zu\t%s\n", snap.station_number,
+                  snap.num_listeners, snap.song_name);
+    else
+      dump_printf(&dump, "%d,%s", snap.station_number, snap.song_name);
+    for (size_t j = 0; j < snap.num_listeners; j++) {
+      struct sockaddr *sa = &snap.addrs[j].sa;
+      get_addr_str(ipstr, sa);
+      if (compact)
+        dump_printf(&dump, "L\t%d\t%s\t%d\n", snap.station_number, ipstr,
+                    get_in_port(sa));
+      else
+        dump_printf(&dump, ",%s:%d", ipstr, get_in_port(sa));
+    }
+    if (!compact)
+      dump_printf(&dump, "\n");
+  }
+  dump_flush(&dump);
+  fflush(out);
+
+  free(snap.addrs);
+  return ret;
+}
+
+void dump_traces(FILE *out) {
+  // the REPL is the only one dumping, so these needn't be on the stack
+  static dump_t dump;
+  static trace_entry_t entries[TRACE_RING_SIZE];
+  dump.out = out;
+  dump.len = 0;
+
+  dump_printf(&dump, "station,tick,scheduled_ns,wake_ns,read_ns,fanout_ns,"
+                     "listeners,sent\n");
+  for (size_t i = 0; i < station_control.num_stations; i++) {
+    uint64_t first;
+    size_t n = trace_snapshot(&station_control.stations[i]->trace, entries,
+                              &first);
+    for (size_t j = 0; j < n; j++) {
+      trace_entry_t *e = &entries[j];
+      dump_printf(&dump, "%zu,%lu,%lu,%lu,%u,%u,%u,%u\n", i, first + j,
+                  e->scheduled_ns, e->wake_ns, e->read_ns, e->fanout_ns,
+                  e->listeners, e->sent);
+    }
+  }
+  dump_flush(&dump);
+  fflush(out);
+}
+
+void report_metrics(FILE *out) {
+  print_metrics(out);
+  fprintf(out, "snowcast_clients %zu\n",
+          atomic_load(&client_control.num_clients));
+  for (size_t i = 0; i < station_control.num_stations; i++)
+    print_station_metrics(station_control.stations[i], out);
+  print_egress_metrics(&station_control.egress, out);
+  print_pool_metrics(server_control.t_pool, out);
+}
+
+int open_metrics_socket(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "[open_metrics_socket] Path %s is too long.\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("open_metrics_socket: socket");
+    return -1;
+  }
+
+  // only ever replace a socket nobody listens on, never some unrelated file
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+      connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+      errno == ECONNREFUSED)
+    unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, METRICS_BACKLOG) == -1) {
+    perror("open_metrics_socket: bind/listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void *serve_metrics(void *arg) {
+  int metrics_fd = *(int *)arg;
+  struct timeval timeout = {
+      .tv_sec = METRICS_SEND_TIMEOUT_MS / 1000,
+      .tv_usec = METRICS_SEND_TIMEOUT_MS % 1000 * 1000,
+  };
+
+  // only get cancelled while waiting for a reader, never halfway through one
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  while (1) {
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    int fd = accept(metrics_fd, NULL, NULL);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    if (fd == -1) {
+      if (errno != EINTR && errno != ECONNABORTED)
+        perror("serve_metrics: accept");
+      continue;
+    }
+
+    // format everything first, so a slow reader holds up nothing but us
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (out == NULL) {
+      perror("serve_metrics: open_memstream");
+      close(fd);
+      continue;
+    }
+    report_metrics(out);
+    fclose(out);
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    for (size_t sent = 0; sent < len;) {
+      ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      sent += n;
+    }
+    free(buf);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+void collect_stats(stats_segment_t *staged) {
+  staged->publish_ns = get_time_ns();
+  staged->clients = atomic_load(&client_control.num_clients);
+
+  metrics_snapshot_t snap;
+  get_metrics(&snap);
+  memcpy(staged->counters, snap.counters, sizeof(staged->counters));
+  memcpy(staged->timers, snap.timers, sizeof(staged->timers));
+
+  egress_t *egress = &station_control.egress;
+  staged->egress_committed = atomic_load(&egress->committed);
+  staged->egress_shed_ticks = atomic_load(&egress->shed_ticks);
+  staged->egress_refused = atomic_load(&egress->refused);
+
+  pool_stats_t pool;
+  get_pool_stats(server_control.t_pool, &pool);
+  staged->pool_threads = pool.num_threads;
+  for (int c = 0; c < NUM_JOB_PRIOS; c++) {
+    staged->pool_queued[c] = pool.queued[c];
+    staged->pool_wait[c] = pool.wait_ns[c];
+  }
+  memset(&staged->lock_wait, 0, sizeof(staged->lock_wait));
+  get_lock_waits(&staged->lock_wait);
+
+  for (size_t i = 0; i < station_control.num_stations; i++) {
+    station_t *station = station_control.stations[i];
+    station_metrics_t *m = &station->metrics;
+    stats_station_t *out = &staged->stations[i];
+    lock_station_clients(station);
+    out->listeners = station->num_listeners;
+    unlock_station_clients(station);
+    out->datagrams = atomic_load_explicit(&m->datagrams, memory_order_relaxed);
+    out->bytes = atomic_load_explicit(&m->bytes, memory_order_relaxed);
+    out->send_errors =
+        atomic_load_explicit(&m->send_errors, memory_order_relaxed);
+    out->ticks = atomic_load_explicit(&m->tick_ns.count, memory_order_relaxed);
+    out->overruns = atomic_load_explicit(&m->overruns, memory_order_relaxed);
+  }
+}
+
+void *publish_stats(void *arg) {
+  stats_segment_t *seg = (stats_segment_t *)arg;
+  stats_segment_t *staged =
+      calloc(1, stats_segment_size(station_control.num_stations));
+  if (staged == NULL) {
+    fprintf(stderr, "[publish_stats] Failed to malloc staging segment.\n");
+    return NULL;
+  }
+
+  // only get cancelled while sleeping, never holding a station's lock
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  pthread_cleanup_push(free, staged);
+  while (1) {
+    collect_stats(staged);
+    publish_stats_segment(seg, staged);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    usleep(STATS_PUBLISH_MS * 1000);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  }
+  pthread_cleanup_pop(1);
+
+  return NULL;
+}
+
+void process_input(char *msg) {
   // if error, EOF, or 'q', mark server as stopped
   if (msg[0] == 'q') {
     lock_server_control(&server_control);
     server_control.stopped = 1;
     unlock_server_control(&server_control);
     // otherwise, print information
-  } else if (msg[0] == 'p') {
-    // prevent changes to stations while we print
-    // [TODO: maybe change to rwlock?]
-    // TODO: this isn't necessary until I implement adding servers. Blegh!
-    lock_station_control(&station_control);
-    station_t *station;
+  } else if (msg[0] == 'p' || msg[0] == 'P') {
     char name[MAXBUFSIZ];
     // get file name, if it exists
     FILE *out =
         sscanf(&msg[1], "%255s", name) == 1 ? fopen(name, "w+") : stdout;
     if (out == NULL) {
-      // TODO: do some error checking
-      ;
+      perror("process_input: fopen");
+      return;
     }
     // for every station, print the current song and connected clients.
-    for (size_t i = 0; i < station_control.num_stations; i++) {
-      station = station_control.stations[i];
-      fprintf(out, "%d,%s", station->station_number, station->song_name);
-      client_connection_t *conn;
-      sync_list_iterate_begin(&station->client_list, conn, client_connection_t,
-                              link) {
-        // clear buffer
-        memset(msg, 0, size);
-        // get and print client info
-        get_address(msg, (struct sockaddr *)&conn->udp_addr);
-        fprintf(out, ",%s", msg);
-      }
-      sync_list_iterate_end(&station->client_list);
-      fprintf(out, "\n");
-    }
+    if (dump_stations(out, msg[0] == 'P'))
+      fprintf(stderr, "[process_input] Station dump is incomplete.\n");
 
     // close file if we don't need anymore
     if (out != stdout)
       fclose(out);
-
-    // allow changes again
-    unlock_station_control(&station_control);
+  } else if (msg[0] == 'a') {
+    print_slab_stats(stdout);
+  } else if (msg[0] == 'm') {
+    report_metrics(stdout);
+  } else if (msg[0] == 't') {
+    char name[MAXBUFSIZ];
+    FILE *out =
+        sscanf(&msg[1], "%255s", name) == 1 ? fopen(name, "w+") : stdout;
+    if (out == NULL) {
+      perror("process_input: fopen");
+      return;
+    }
+    dump_traces(out);
+    if (out != stdout)
+      fclose(out);
+  } else if (msg[0] == 's') {
+    printf("clients: %zu connected, %lu station switches\n",
+           atomic_load(&client_control.num_clients),
+           atomic_load(&client_control.num_switches));
+    print_egress_stats(&station_control.egress, STREAM_RATE, stdout);
+    print_pool_stats(server_control.t_pool, stdout);
+    for (size_t i = 0; i < station_control.num_stations; i++)
+      print_tx_stamps(station_control.stations[i], stdout);
+  } else if (msg[0] == 'l') {
+    print_lock_profile(stdout);
   }
 }
 
@@ -323,21 +725,93 @@ int check_stopped(server_control_t *server_control) {
   return stopped;
 }
 
-size_t get_num_stations(station_control_t *station_control) {
-  lock_station_control(station_control);
-  size_t num_stations = station_control->num_stations;
-  unlock_station_control(station_control);
-  return num_stations;
+int rearm_client(client_control_t *cc, int sockfd, client_connection_t *conn) {
+  // clients may also have replies to flush
+  if (conn != NULL)
+    return arm_connection(conn);
+
+  struct epoll_event ev = {.events = CLIENT_EVENTS, .data.ptr = conn};
+  if (epoll_ctl(cc->epoll_fd, EPOLL_CTL_MOD, sockfd, &ev) == -1) {
+    log_error("[rearm_client] epoll_ctl: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
 }
 
-void atomic_incr(size_t *val, pthread_mutex_t *mtx) {
-  pthread_mutex_lock(mtx);
-  *val += 1;
-  pthread_mutex_unlock(mtx);
+int welcome_client(client_control_t *cc, client_connection_t *conn,
+                   hello_t *hello) {
+  // now we know where to stream to
+  lock_connection(conn);
+  set_in_port((struct sockaddr *)&conn->udp_addr, hello->udp_port);
+  unlock_connection(conn);
+
+  // unless it's too late, the handshake is done
+  lock_client_control(cc);
+  int state = atomic_load(&conn->state);
+  if (state == CONN_HANDSHAKE) {
+    list_remove(&conn->link);
+    atomic_store(&conn->state, CONN_ACTIVE);
+  }
+  unlock_client_control(cc);
+  if (state != CONN_HANDSHAKE)
+    return -1;
+
+  log_info("[Client %d] Received Hello! Sending Welcome...", conn->client_fd);
+
+  // send "Welcome" reply message; if fails, close stuff
+  if (queue_reply(conn, REPLY_WELCOME, station_control.num_stations, NULL)) {
+    log_warn("[Client %d] Failed to send Welcome. Closing connection.",
+             conn->client_fd);
+    return -1;
+  }
+  metric_add(METRIC_HANDSHAKES, 1);
+  uint64_t handshake_ns = get_time_ns() - conn->accepted_ns;
+  metric_time(TIMER_HANDSHAKE, handshake_ns);
+  probe2(conn__handshake, conn->client_fd, handshake_ns);
+  return 0;
+}
+
+void expire_handshakes(client_control_t *cc, uint64_t now) {
+  lock_client_control(cc);
+  // oldest first, so stop at the first one that still has time
+  while (!list_empty(&cc->handshakes)) {
+    client_connection_t *conn =
+        list_head(&cc->handshakes, client_connection_t, link);
+    if (now - conn->accepted_ns < HANDSHAKE_TIMEOUT_MS * 1000000ULL)
+      break;
+
+    list_remove(&conn->link);
+    atomic_store(&conn->state, CONN_EXPIRED);
+    metric_add(METRIC_HANDSHAKE_TIMEOUTS, 1);
+    log_warn("[Client %d] Didn't send a Hello in time. Closing...",
+             conn->client_fd);
+    // we can't remove it here, since a handler could be using it. Instead, the
+    // client now looks disconnected, and its handler removes it as usual.
+    shutdown(conn->client_fd, SHUT_RDWR);
+  }
+  unlock_client_control(cc);
+}
+
+void expire_closing(client_control_t *cc, uint64_t now) {
+  lock_client_control(cc);
+  // oldest first, so stop at the first one that still has time
+  while (!list_empty(&cc->closing)) {
+    client_connection_t *conn =
+        list_head(&cc->closing, client_connection_t, link);
+    if (now - conn->rejected_ns < CLOSE_LINGER_MS * 1000000ULL)
+      break;
+
+    // its handler removes it, and takes it off the list then
+    list_remove(&conn->link);
+    log_warn("[Client %d] Didn't take its last reply in time. Closing...",
+             conn->client_fd);
+    shutdown(conn->client_fd, SHUT_RDWR);
+  }
+  unlock_client_control(cc);
 }
 
 int swap_stations(station_control_t *sc, client_connection_t *conn,
-                  int new_station, int num_stations) {
+                  int new_station, int num_stations, uint64_t ready_ns) {
   // verify that station is valid
   if (new_station >= num_stations || new_station < 0) {
     /* fprintf(stderr, */
@@ -347,13 +821,18 @@ int swap_stations(station_control_t *sc, client_connection_t *conn,
     return -1;
   }
 
-  int old_station = conn->current_station;
+  int old_station = conn->current_station, ret = 0;
   // if not currently in a station, join that one
   if (old_station == -1) {
-    conn->current_station = new_station;
-    // synchronously add to list
+    // synchronously add to list, if the egress budget allows
     lock_station_clients(sc->stations[new_station]);
-    accept_connection(sc->stations[new_station], conn);
+    if (can_accept_connection(sc->stations[new_station])) {
+      conn->current_station = new_station;
+      accept_connection(sc->stations[new_station], conn);
+      conn->switched_ns = ready_ns;
+    } else {
+      ret = -2;
+    }
     unlock_station_clients(sc->stations[new_station]);
   } else if (old_station != new_station) {
     int lower_station = old_station < new_station ? old_station : new_station;
@@ -362,52 +841,118 @@ int swap_stations(station_control_t *sc, client_connection_t *conn,
     lock_station_clients(sc->stations[lower_station]);
     lock_station_clients(sc->stations[higher_station]);
 
-    conn->current_station = new_station;
-    // remove from old station, then add to new
-    remove_connection(conn);
-    accept_connection(sc->stations[new_station], conn);
+    // remove from old station, then add to new; if the new station is full,
+    // stay where we are
+    if (can_accept_connection(sc->stations[new_station])) {
+      conn->current_station = new_station;
+      remove_connection(sc->stations[old_station], conn);
+      accept_connection(sc->stations[new_station], conn);
+      conn->switched_ns = ready_ns;
+    } else {
+      ret = -2;
+    }
 
     // unlock
     unlock_station_clients(sc->stations[higher_station]);
     unlock_station_clients(sc->stations[lower_station]);
   }
   // if identical, do nothing
-  return 0;
+  return ret;
 }
 
-void remove_client_from_server(client_control_t *cc, station_control_t *sc,
-                               int sockfd) {
-  // get which connection it is
-  lock_client_control(cc);
-  int index = get_client_index(&cc->client_vec, sockfd);
-  if (index == -1) {
-    unlock_client_control(cc);
-    return;
-  }
-  client_connection_t *conn = get_client(&cc->client_vec, index);
-  // in this case, we've already swapped it with a different value, so we can
-  // just ignore
-  if (conn == NULL) {
-    unlock_client_control(cc);
-    return;
-  }
+/**
+ * Takes a client off its station, if it's actually on one.
+ */
+static void leave_station(station_control_t *sc, client_connection_t *conn) {
+  lock_connection(conn);
   int which_station = conn->current_station;
-
-  // only remove from station if client is actually connected
   if (which_station >= 0) {
-    // lock station
     lock_station_clients(sc->stations[which_station]);
-    // remove from station
-    remove_connection(conn);
-    // successfully cleaned up from station
+    remove_connection(sc->stations[which_station], conn);
     unlock_station_clients(sc->stations[which_station]);
+    conn->current_station = -1;
   }
+  unlock_connection(conn);
+}
+
+void remove_client_from_server(client_control_t *cc, station_control_t *sc,
+                               client_connection_t *conn) {
+  // nothing more gets queued for it
+  close_connection(conn);
+
+  // first, take the client off its station
+  leave_station(sc, conn);
+
+  // stop watching the client; it's disarmed (we're its handler), so the poller
+  // can't be holding on to it
+  if (epoll_ctl(cc->epoll_fd, EPOLL_CTL_DEL, conn->client_fd, NULL) == -1)
+    log_error("[remove_client_from_server] epoll_ctl: %s", strerror(errno));
+
+  // then remove it from the client vector. The poller may have collected an
+  // event for it that it's yet to look at, so leave destroying it to the poller
+  lock_client_control(cc);
+  int state = atomic_load(&conn->state);
+  // a closing client is off the list once the poller gave up on it
+  if (state == CONN_HANDSHAKE ||
+      (state == CONN_CLOSING && conn->link.l_next != NULL))
+    list_remove(&conn->link);
+  detach_client(&cc->client_vec, conn->index);
+  list_insert_tail(&cc->graveyard, &conn->link);
+  resize_client_vector(&cc->client_vec, -1);
+  unlock_client_control(cc);
+  atomic_fetch_sub(&cc->num_clients, 1);
+  metric_add(METRIC_DISCONNECTS, 1);
+}
+
+void reject_client(client_control_t *cc, station_control_t *sc,
+                   client_connection_t *conn) {
+  // nothing more gets queued for it, and no more audio goes to it
+  close_connection(conn);
+  leave_station(sc, conn);
+
+  // usually, the socket takes the reply right away
+  if (flush_connection(conn) == -1 || !conn_pending(conn)) {
+    remove_client_from_server(cc, sc, conn);
+    return;
+  }
+
+  // otherwise, stop reading from it, and wait until there's room for the rest
+  shutdown(conn->client_fd, SHUT_RD);
+  conn->rejected_ns = get_time_ns();
+  lock_client_control(cc);
+  atomic_store(&conn->state, CONN_CLOSING);
+  list_insert_tail(&cc->closing, &conn->link);
+  unlock_client_control(cc);
+  if (rearm_client(cc, conn->client_fd, conn) == -1)
+    remove_client_from_server(cc, sc, conn);
+}
 
-  // remove client from client vector
-  remove_client(&cc->client_vec, index);
+void reap_clients(client_control_t *cc) {
+  list_t dead;
+  list_init(&dead);
 
-  // done with client control
+  // take everything at once, then destroy them without holding the lock
+  lock_client_control(cc);
+  while (!list_empty(&cc->graveyard)) {
+    list_link_t *link = cc->graveyard.l_next;
+    list_remove(link);
+    list_insert_tail(&dead, link);
+  }
   unlock_client_control(cc);
+
+  client_connection_t *conn;
+  list_iterate_begin(&dead, conn, client_connection_t, link) {
+    // an announcement may still be sending to it; try again next time
+    if (atomic_load(&conn->refs) > 0) {
+      list_remove(&conn->link);
+      lock_client_control(cc);
+      list_insert_tail(&cc->graveyard, &conn->link);
+      unlock_client_control(cc);
+      continue;
+    }
+    destroy_connection(conn);
+  }
+  list_iterate_end();
 }
 
 /* ===============================================================================
@@ -416,251 +961,316 @@ void remove_client_from_server(client_control_t *cc, station_control_t *sc,
  */
 
 void process_connection(void *arg) {
-  int listener = *(int *)arg;
+  handle_request_t *args = (handle_request_t *)arg;
+  int listener = args->sockfd;
 
   // store connection information
-  char address[MAXADDRLEN];
-  struct sockaddr_storage from_addr;
-  socklen_t addr_len = sizeof(from_addr);
-
-  // wrap in do {...} while(0) to allow breaking
-  // attempt to add client
-  do {
-    // accept client; this shouldn't block, since it's only called upon return
-    // from poll.
-    int client_fd = accept(listener, (struct sockaddr *)&from_addr, &addr_len);
+  int fds[ACCEPT_BATCH];
+  struct sockaddr_storage addrs[ACCEPT_BATCH];
+  socklen_t addr_lens[ACCEPT_BATCH];
+
+  // accept everything that's waiting, up to a cap so one storm can't hog this
+  // worker; if we hit the cap, the listener fires again once it's re-armed
+  size_t num_accepted = 0;
+  while (num_accepted < ACCEPT_BATCH) {
+    addr_lens[num_accepted] = sizeof(addrs[num_accepted]);
+    int client_fd =
+        accept4(listener, (struct sockaddr *)&addrs[num_accepted],
+                &addr_lens[num_accepted], SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (client_fd == -1) {
-      // if errors, exit function prematurely
-      perror("process_connection: accept");
-      break;
-    }
-
-    get_address(address, (struct sockaddr *)&from_addr);
-    printf("[Client %d] New client connected from %s; Awaiting a Hello...\n",
-           client_fd, address);
-
-    // wait for a response; this times out after 100ms, so if client still
-    // doesn't send HELLO, they get disconnected.
-    uint8_t type;
-    int res;
-    void *msg = recv_command_msg(client_fd, &type, &res);
-    // if NULL, an error occurred while recving, close the connection
-    if (msg == NULL) {
-      fprintf(stderr,
-              "[process_connection] Failed to receive message from client %s. "
-              "Closing connection...\n",
-              address);
-      close(client_fd);
+      // the client gave up before we got to it; try the next one
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      // otherwise, nothing left (or out of fds); stop here
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        log_error("[process_connection] accept4: %s", strerror(errno));
       break;
     }
-    // if reply type is not MESSAGE_HELLO, close the connection
-    if (type != MESSAGE_HELLO) {
-      fprintf(
-          stderr,
-          "[Client %d] Sent incorrect initial message. Expected: %s\tGot: %s\n",
-          client_fd, "MESSAGE_HELLO",
-          type > MESSAGE_SET_STATION ? "INVALID TYPE" : "MESSAGE_SET_STATION");
-      fprintf(stderr, "Closing connection [%d]...\n", client_fd);
-      close(client_fd);
-      break;
-    }
-    // get UDP port from message, then free it (we don't need anymore)
-    uint16_t udp_port = ((hello_t *)msg)->udp_port;
-    free(msg);
-
-    printf("[Client %d] Received Hello! Sending Welcome...\n", client_fd);
-
-    // get num stations
-    size_t num_stations = get_num_stations(&station_control);
-
-    // synchronize access to client connections
-    lock_client_control(&client_control);
-    int index = add_client(&client_control.client_vec, client_fd, udp_port,
-                           (struct sockaddr *)&from_addr, addr_len);
-    // on failure, close client connection and stop
-    if (index == -1) {
-      close(client_fd);
-      unlock_client_control(&client_control);
-      break;
-    }
-    // send "Welcome" reply message; if fails, close stuff
-    if (send_reply_msg(client_fd, REPLY_WELCOME, num_stations, NULL)) {
-      fprintf(stderr, "Failed to send Welcome. Closing connection.\n");
-      remove_client(&client_control.client_vec, index);
-      unlock_client_control(&client_control);
-      break;
-    }
-    unlock_client_control(&client_control);
-  } while (0);
+    fds[num_accepted++] = client_fd;
+  }
+  metric_add(METRIC_ACCEPTS, num_accepted);
+  probe1(conn__accept, num_accepted);
+  register_clients(&client_control, fds, addrs, addr_lens, num_accepted);
 
-  lock_client_control(&client_control);
-  // unlock; if we're the last pending operation, signal to cv
-  if (--client_control.num_pending == 0)
-    pthread_cond_signal(&client_control.pending_cond);
-  unlock_client_control(&client_control);
+  // watch for the next connection
+  rearm_client(&client_control, listener, NULL);
 }
 
-void pthread_unlock_cleanup_handler(void *arg) {
-  printf("Polling thread cancelled. Unlocking mutex...\n");
-  pthread_mutex_unlock((pthread_mutex_t *)arg);
+void register_clients(client_control_t *cc, int fds[],
+                      struct sockaddr_storage addrs[], socklen_t addr_lens[],
+                      size_t num) {
+  // anything bigger is added ACCEPT_BATCH clients at a time
+  for (; num > ACCEPT_BATCH; num -= ACCEPT_BATCH) {
+    register_clients(cc, fds, addrs, addr_lens, ACCEPT_BATCH);
+    fds += ACCEPT_BATCH;
+    addrs += ACCEPT_BATCH;
+    addr_lens += ACCEPT_BATCH;
+  }
+  client_connection_t *conns[ACCEPT_BATCH];
+
+  // add the whole batch to the client vector at once; clients have to say
+  // Hello before they're welcomed, which handle_request takes care of
+  lock_client_control(cc);
+  for (size_t i = 0; i < num; i++) {
+    int index = add_client(&cc->client_vec, fds[i], 0,
+                           (struct sockaddr *)&addrs[i], addr_lens[i]);
+    conns[i] = index == -1 ? NULL : get_client(&cc->client_vec, index);
+    if (conns[i] != NULL)
+      list_insert_tail(&cc->handshakes, &conns[i]->link);
+  }
+  unlock_client_control(cc);
+
+  // then start watching each of them
+  char address[MAXADDRLEN];
+  for (size_t i = 0; i < num; i++) {
+    // on failure, close client connection and move on
+    if (conns[i] == NULL) {
+      close(fds[i]);
+      continue;
+    }
+    atomic_fetch_add(&cc->num_clients, 1);
+
+    get_address(address, (struct sockaddr *)&addrs[i]);
+    log_info("[Client %d] New client connected from %s; Awaiting a Hello...",
+             fds[i], address);
+
+    // it's armed as soon as it's registered
+    conns[i]->epoll_fd = cc->epoll_fd;
+    conns[i]->armed = 1;
+    struct epoll_event ev = {.events = CLIENT_EVENTS, .data.ptr = conns[i]};
+    if (epoll_ctl(cc->epoll_fd, EPOLL_CTL_ADD, fds[i], &ev)) {
+      log_error("[register_clients] epoll_ctl: %s", strerror(errno));
+      // it was never watched, so nobody else can have a hold of it
+      lock_client_control(cc);
+      if (atomic_load(&conns[i]->state) == CONN_HANDSHAKE)
+        list_remove(&conns[i]->link);
+      remove_client(&cc->client_vec, conns[i]->index);
+      unlock_client_control(cc);
+      atomic_fetch_sub(&cc->num_clients, 1);
+    }
+  }
 }
 
 void *poll_connections(void *arg) {
   int listener = *(int *)arg;
-  int num_events;
-  size_t num_fds;
-  struct pollfd *pfds;
+  struct epoll_event events[REQUEST_BATCH];
+  void *batch[REQUEST_BATCH];
+  uint64_t last_sweep = get_time_ns();
   // repeat until stopped
   while (!check_stopped(&server_control)) {
-    // first, check if any client operations are still pending
-    lock_client_control(&client_control);
-    pthread_cleanup_push(pthread_unlock_cleanup_handler,
-                         &client_control.clients_mtx);
-    while (client_control.num_pending > 0) {
-      pthread_cond_wait(&client_control.pending_cond,
-                        &client_control.clients_mtx);
+    // every event we collected is dealt with, so nothing refers to removed
+    // clients anymore; don't get cancelled halfway through destroying them
+    int old_state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+    reap_clients(&client_control);
+    pthread_setcancelstate(old_state, NULL);
+
+    // wait until a request/connection. No locking needed: clients can be added
+    // and removed while we wait, and a client whose request is still being
+    // handled is disarmed, so it can't show up again until done. Wake up every
+    // so often to expire clients that never said Hello.
+    int num_events = epoll_wait(client_control.epoll_fd, events, REQUEST_BATCH,
+                                HANDSHAKE_SWEEP_MS);
+
+    uint64_t now = get_time_ns();
+    if (now - last_sweep >= HANDSHAKE_SWEEP_MS * 1000000ULL) {
+      expire_handshakes(&client_control, now);
+      expire_closing(&client_control, now);
+      last_sweep = now;
     }
 
-    // check to resize
-    resize_client_vector(&client_control.client_vec, -1);
-
-    // once it's safe to attempt, poll indefinitely until a request/connection
-    //
-    // [Aside: how is safety guaranteed? In this implementation, this function
-    // (i.e. the poller) is the only one capable of appending tasks that can
-    // modify the client control vector; thus, as long as no tasks added by this
-    // function are waiting, we can synchronously poll.]
-    num_fds = client_control.client_vec.size + 1;
-    pfds = client_control.client_vec.pfds;
-
-    num_events = 0;
-    num_events = poll(pfds, num_fds, -1);
-
-    // once we're done polling, we can unlock the mutex
-    // only execute cleanup on error, since it has a print statement
-    pthread_cleanup_pop(0);
-    unlock_client_control(&client_control);
-
     // if no event (somehow) or an error occurred, go again
     if (num_events <= 0) {
-      if (num_events < 0)
-        perror("poll_connections: poll");
+      if (num_events < 0 && errno != EINTR)
+        perror("poll_connections: epoll_wait");
       continue;
     }
 
-    // if listener has something, handle its connection
-    if (pfds[0].revents & POLLIN) {
-      atomic_incr(&client_control.num_pending, &client_control.clients_mtx);
-      process_connection(&listener);
-    }
-
-    // loop through all client connections
-    for (size_t i = 1; i < num_fds; i++) {
-      // if there's a request, spawn a worker thread to deal with it
-      if (client_control.client_vec.pfds[i].revents & POLLIN) {
-        // indicate that we're going to change the client list
-        atomic_incr(&client_control.num_pending, &client_control.clients_mtx);
-        handle_request_t *args = malloc(sizeof(handle_request_t));
-        args->sockfd = client_control.client_vec.pfds[i].fd;
-        add_job(server_control.t_pool, handle_request, (void *)args);
+    // hand requests to the thread pool in one batch
+    size_t batch_size = 0;
+    for (int i = 0; i < num_events; i++) {
+      // the listener is the only one without a connection
+      client_connection_t *conn = events[i].data.ptr;
+      int sockfd = conn == NULL ? listener : conn->client_fd;
+
+      // a reply may have re-registered a client just as it fired; whoever
+      // disarms it first gets to handle it
+      if (conn != NULL && !disarm_connection(conn))
+        continue;
+
+      handle_request_t *args = slab_alloc(&request_slab);
+      if (args == NULL) {
+        log_error("[poll_connections] Failed to allocate request.");
+        // try again later, rather than leaving the fd disarmed forever
+        rearm_client(&client_control, sockfd, conn);
+        continue;
+      }
+      args->sockfd = sockfd;
+      args->conn = conn;
+      args->ready_ns = now;
+
+      // if listener has something, accept it at a lower priority than requests
+      // from clients that are already connected
+      if (conn == NULL) {
+        if (add_job(server_control.t_pool, JOB_PRIO_HANDSHAKE,
+                    process_connection, args) != 1)
+          slab_free(args);
+        continue;
       }
+
+      // otherwise, it's a client request; spawn a worker thread to deal with it
+      batch[batch_size++] = args;
     }
+    if (batch_size > 0)
+      dispatch_requests(batch, batch_size);
   }
 
   return NULL;
 }
 
+void dispatch_requests(void **batch, size_t batch_size) {
+  size_t added = add_jobs(server_control.t_pool, JOB_PRIO_SWITCH,
+                          handle_request, batch, batch_size);
+
+  // the rest will never run (i.e. we're stopping), so just release them
+  for (size_t i = added; i < batch_size; i++)
+    slab_free(batch[i]);
+}
+
 void handle_request(void *arg) {
   // get arguments
   handle_request_t *args = (handle_request_t *)arg;
-  int sockfd = args->sockfd, res;
-  uint8_t type;
+  client_connection_t *conn = args->conn;
+  int sockfd = args->sockfd, res, removed = 0;
+  command_t cmd;
 
-  // receive message from client
-  void *msg = recv_command_msg(sockfd, &type, &res);
+  // send whatever replies are still waiting, if the client takes them now
+  if (flush_connection(conn) == -1) {
+    remove_client_from_server(&client_control, &station_control, conn);
+    return;
+  }
+
+  // a rejected client is only waiting for its last reply to drain
+  if (atomic_load(&conn->state) == CONN_CLOSING) {
+    if (conn_pending(conn) && rearm_client(&client_control, sockfd, conn) == 0)
+      return;
+    remove_client_from_server(&client_control, &station_control, conn);
+    return;
+  }
+
+  // receive message from client, or whatever part of it has arrived
+  res = recv_command_msg_nb(sockfd, &conn->in, &cmd);
+  uint8_t type = cmd.command_type;
+
+  // if the rest of the message isn't here yet, wait for it
+  if (res == 2) {
+    rearm_client(&client_control, sockfd, conn);
+    return;
+  }
 
   // if failed to receive message, server closes connection
   if (res != 0) {
-    // this case handles if msg == NULL! Only close if client disconnected.
+    // a socket error (e.g. a reset) is a disconnect, not a protocol violation
     if (res == -1) {
-      fprintf(stderr, "[Client %d] Invalid command type.\n", sockfd);
+      log_warn("[Client %d] Invalid command type.", sockfd);
+      metric_add(METRIC_INVALID_COMMANDS, 1);
     }
-    remove_client_from_server(&client_control, &station_control, sockfd);
+    remove_client_from_server(&client_control, &station_control, conn);
+    removed = 1;
   } else {
-    // sanity check; recv_command_msg should only be NULL if res != 0
-    assert(msg != NULL);
+    probe2(command__receive, sockfd, type);
 
     // store message
     char buf[MAXBUFSIZ];
     memset(buf, 0, sizeof(buf));
-    if (type == MESSAGE_SET_STATION) {
-      // get num stations
-      int num_stations = get_num_stations(&station_control);
-
-      // swap stations
-      uint16_t new_station = ((set_station_t *)msg)->station_number;
-      lock_client_control(&client_control);
-      int index = get_client_index(&client_control.client_vec, sockfd);
-      assert(index != -1);
-      if (index == -1) {
-        unlock_client_control(&client_control);
-        return;
+    if (atomic_load(&conn->state) != CONN_ACTIVE) {
+      // a new client must start with a Hello
+      if (type != MESSAGE_HELLO) {
+        log_warn("[Client %d] Sent incorrect initial message. Expected: "
+                 "%s\tGot: %s. Closing...",
+                 sockfd, "MESSAGE_HELLO", "MESSAGE_SET_STATION");
+        metric_add(METRIC_INVALID_COMMANDS, 1);
+        remove_client_from_server(&client_control, &station_control, conn);
+        removed = 1;
+      } else if (welcome_client(&client_control, conn, &cmd.hello)) {
+        remove_client_from_server(&client_control, &station_control, conn);
+        removed = 1;
       }
-      res = swap_stations(&station_control,
-                          get_client(&client_control.client_vec, index),
-                          new_station, num_stations);
-      unlock_client_control(&client_control);
+    } else if (type == MESSAGE_SET_STATION) {
+      // get num stations
+      int num_stations = station_control.num_stations;
+
+      // swap stations; only this client and the stations involved are locked
+      uint16_t new_station = cmd.set_station.station_number;
+      lock_connection(conn);
+      res = swap_stations(&station_control, conn, new_station, num_stations,
+                          args->ready_ns);
+      unlock_connection(conn);
 
       // if they had invalid set stations request, send invalid request reply
       if (res == -1) {
         sprintf(buf,
                 "Requested station %d, but server only has stations [0, %d).",
                 new_station, num_stations);
-        send_reply_msg(sockfd, REPLY_INVALID, strlen(buf), buf);
-
-        // print to server, then close connection
-        fprintf(stderr, "[Client %d] %s\n", sockfd, buf);
-        remove_client_from_server(&client_control, &station_control, sockfd);
+        queue_reply(conn, REPLY_INVALID, strlen(buf), buf);
+
+        // print to server, then close connection once the reply is out
+        metric_add(METRIC_INVALID_COMMANDS, 1);
+        log_warn("[Client %d] %s", sockfd, buf);
+        reject_client(&client_control, &station_control, conn);
+        removed = 1;
+      } else if (res == -2) {
+        // the egress budget has no room; the client stays where it was
+        metric_add(METRIC_STATIONS_FULL, 1);
+        if (conn->current_station == -1)
+          snprintf(buf, sizeof(buf),
+                   "Station %d is full; not listening to any station.",
+                   new_station);
+        else
+          snprintf(buf, sizeof(buf),
+                   "Station %d is full; still listening to Station %d.",
+                   new_station, conn->current_station);
+        if (queue_reply(conn, REPLY_ANNOUNCE, strlen(buf), buf) == -1) {
+          remove_client_from_server(&client_control, &station_control, conn);
+          removed = 1;
+        }
+        log_info("[Client %d] %s", sockfd, buf);
       } else {
-        // otherwise, announce to client that station switch was successful
-        // synchronize access
-        lock_station_control(&station_control);
-
-        // get station's song
-        char song_name[MAXSONGLEN];
-        memset(song_name, 0, sizeof(song_name));
-        strcpy(song_name, station_control.stations[new_station]->song_name);
-
-        // no longer need synchronization
-        unlock_station_control(&station_control);
-
-        // send response to client
-        sprintf(buf, "\"%s\" [switched to Station %d]", song_name, new_station);
-        if (send_reply_msg(sockfd, REPLY_ANNOUNCE, strlen(buf), buf) == -1) {
+        // otherwise, announce to client that station switch was successful;
+        // song names never change, so no locking needed
+        atomic_fetch_add_explicit(&client_control.num_switches, 1,
+                                  memory_order_relaxed);
+        metric_add(METRIC_SET_STATIONS, 1);
+        snprintf(buf, sizeof(buf), "\"%.*s\" [switched to Station %d]",
+                 MAXSONGLEN - 1,
+                 station_control.stations[new_station]->song_name, new_station);
+        if (queue_reply(conn, REPLY_ANNOUNCE, strlen(buf), buf) == -1) {
           // on failure, remove client from connections
-          fprintf(stderr, "[handle_request] See above error messages.\n");
-          remove_client_from_server(&client_control, &station_control, sockfd);
+          log_warn("[handle_request] See above error messages.");
+          remove_client_from_server(&client_control, &station_control, conn);
+          removed = 1;
         }
 
-        printf("[Client %d] Switched to station %d.\n", sockfd, new_station);
+        log_info("[Client %d] Switched to station %d.", sockfd, new_station);
       }
+      uint64_t switch_ns = get_time_ns() - args->ready_ns;
+      metric_time(TIMER_SET_STATION, switch_ns);
+      probe4(station__switch, sockfd, new_station, res, switch_ns);
     } else {
       // invalid command; indicate as such
       sprintf(buf, "got command of type %d, but must be within [%s].", type,
               "MESSAGE_SET_STATION");
-      send_reply_msg(sockfd, REPLY_INVALID, strlen(buf), buf);
+      queue_reply(conn, REPLY_INVALID, strlen(buf), buf);
+      metric_add(METRIC_INVALID_COMMANDS, 1);
 
-      // remove client from server
-      fprintf(stderr, "[Client %d] %s\n", sockfd, buf);
-      remove_client_from_server(&client_control, &station_control, sockfd);
+      // remove client from server, once the reply is out
+      log_warn("[Client %d] %s", sockfd, buf);
+      reject_client(&client_control, &station_control, conn);
+      removed = 1;
     }
-    // free message when done
-    free(msg);
   }
 
-  // decrement and potentially signal to cv
-  lock_client_control(&client_control);
-  if (--client_control.num_pending == 0)
-    pthread_cond_signal(&client_control.pending_cond);
-  unlock_client_control(&client_control);
+  // ready for the client's next request
+  if (!removed)
+    rearm_client(&client_control, sockfd, conn);
 }
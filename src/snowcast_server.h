@@ -2,16 +2,33 @@
 #define __SNOWCAST_SERVER__
 
 #include "util/client_vector.h"
+#include "util/lock_profile.h"
+#include "util/log.h"
+#include "util/probes.h"
 #include "util/protocol.h"
 #include "util/station.h"
+#include "util/stats_shm.h"
 #include "util/thread_pool.h"
 
 #define INIT_MAX_CLIENTS 4
-#define INIT_NUM_THREADS 8
+#define MIN_NUM_THREADS 2  // threads kept in the pool, even when idle
+#define MAX_NUM_THREADS 16 // most threads the pool grows to under load
+#define REQUEST_BATCH 64 // requests handed to the thread pool at once
+
+#define DEFAULT_BACKLOG 1024      // listen backlog, unless -b says otherwise
+#define ACCEPT_BATCH 64           // most clients accepted per listener event
+#define HANDSHAKE_TIMEOUT_MS 1000 // time a new client has to send a Hello
+#define HANDSHAKE_SWEEP_MS 100    // how often to check for expired handshakes
+#define CLOSE_LINGER_MS 1000      // time a rejected client has to take its reply
 
 #define MAXADDRLEN 64
 #define MAXSONGLEN (MAXBUFSIZ / 2)
 
+#define DUMP_BUF_SIZE (1 << 16) // bytes of a station dump formatted per write
+
+#define METRICS_BACKLOG 16           // metrics readers waiting to be served
+#define METRICS_SEND_TIMEOUT_MS 1000 // longest a metrics reader may stall us
+
 /*
  *  ____                                   _     ____
  * / ___| _ __   _____      _____ __ _ ___| |_  / ___|  ___ _ ____   _____ _ __
@@ -31,12 +48,20 @@
  *  - server_mtx synchronizes access to the server. Only necessary for stopped.
  *  - server_cond allows the server to wait until cleanup is done.
  *  - stopped indicates when the server is stopped; 0 -> running, 1 -> stopped.
+ *  - metrics_fd, if not -1, is a UNIX socket that metrics_thread serves the
+ *  server's metrics on.
+ *  - stats, if not NULL, is a shared memory segment that stats_thread
+ *  publishes the server's counters to.
  */
 typedef struct {
   thread_pool_t *t_pool;      // thread pool for polling work!
   pthread_mutex_t server_mtx; // synchronize access to server
   pthread_cond_t server_cond; // condition variable for cleanup
   uint8_t stopped;            // flag for server condition
+  int metrics_fd;             // UNIX socket serving metrics, or -1
+  pthread_t metrics_thread;   // serves metrics_fd
+  stats_segment_t *stats;     // shared memory stats segment, or NULL
+  pthread_t stats_thread;     // publishes to stats
 } server_control_t;
 
 /**
@@ -47,38 +72,55 @@ typedef struct {
  *   - TODO: implement station_vector_t
  *   - TODO: implement add_station, remove_station
  *
- * - Each station has an associated mutex; this synchronizes access to the
- * stations list, allowing for the server to swap two clients in a thread-safe
- * manner.
- *   - Note that each station's clients are already stored in a synchronized
- *   doubly-linked list; why do we need another mutex?
- *      - TODO: good question do I actually need two lol
- *
- * - So I think `station_mtx` is necessary only for the number of stations
- * (`stations` already has synchronization primitives, until we implement adding
- * stations.)
+ * - `stations`, `num_stations` and each station's number and song name never
+ * change between init and destroy, so they are read without any locks. The
+ * only thing that changes is who listens to each station, and that's
+ * synchronized by each station's own client list lock; a switch only locks the
+ * two stations involved.
+ * - When a song loops, the station's announcement is delivered by `t_pool`
+ * rather than by the streamer.
+ * - `egress` is the budget the stations' streams share (see egress.h).
  */
 typedef struct {
-  station_t **stations;        // available stations
-  size_t num_stations;         // keeps track of the number of stations
-  pthread_mutex_t station_mtx; // mutex for station control access
+  station_t **stations;  // available stations
+  size_t num_stations;   // keeps track of the number of stations
+  thread_pool_t *t_pool; // delivers the stations' announcements
+  egress_t egress;       // host-wide egress budget
 } station_control_t;
 
 /**
  * Structure to control and modify access to client connections. Provides a
  * lightweight synchronization wrapper.
- * - Note that unless we want potentially messy signal handling, we need some
- * way of ensuring that the `pfds` in `client_vec` are not tampered with in the
- * middle of a `poll` call. To that end, we lock the client control struct until
- * poll returns. This, of course, may pose problems if we wish to modify the
- * client control struct in a timely manner; thus, we wait until all
- * modifications to the client control struct is done.
+ * - Readiness of the listener and every client is tracked by `epoll_fd`.
+ * Clients are registered with EPOLLONESHOT: once a client's request is handed
+ * to the thread pool, epoll reports nothing more for it until the handler
+ * re-arms it. Thus, each client's requests are handled one at a time and in
+ * order, while different clients are handled in parallel; and since epoll
+ * doesn't care about `client_vec`, the poller never has to wait for handlers
+ * to finish modifying it.
+ * - Each client's epoll data is its connection (NULL for the listener), so
+ * requests find their client without searching `client_vec`. `clients_mtx`
+ * only guards `client_vec` itself, i.e. adding and removing clients; handling
+ * a request never touches it.
+ * - New clients are accepted in batches and wait on `handshakes` (also under
+ * `clients_mtx`), oldest first, until they send a Hello; the poller expires
+ * the ones that take longer than HANDSHAKE_TIMEOUT_MS.
+ * - Clients sent an InvalidCommand wait on `closing` (also under
+ * `clients_mtx`), oldest first, while the reply drains; the poller shuts down
+ * the ones still draining after CLOSE_LINGER_MS.
+ * - Removed clients wait on `graveyard` (also under `clients_mtx`) until the
+ * poller destroys them: an event it already collected may still point to
+ * one, but once it's done with a batch and about to wait again, no event can.
  */
 typedef struct {
   client_vector_t client_vec;  // vector of currently connected clients
-  size_t num_pending;          // record number of ops that change client_vec
-  pthread_mutex_t clients_mtx; // synchronize access to client control
-  pthread_cond_t pending_cond; // wait until no more pending
+  int epoll_fd;                // readiness of the listener and all clients
+  pthread_mutex_t clients_mtx; // synchronize adding/removing clients
+  atomic_size_t num_clients;   // number of connected clients
+  atomic_ulong num_switches;   // number of successful station switches
+  list_t handshakes;           // clients that have yet to send a Hello
+  list_t closing;              // rejected clients, draining their last reply
+  list_t graveyard;            // removed clients, waiting to be destroyed
   // TODO: implement a signal handler
 } client_control_t;
 
@@ -88,17 +130,19 @@ typedef struct {
  */
 
 /**
- * Initializes a server control struct with the specified number of threads in
- * the thread pool.
+ * Initializes a server control struct, with a thread pool that sizes itself
+ * between the specified bounds.
  *
  * Inputs:
  * - server_control_t *server_control: the server control struct to initialize
- * - size_t num_threads: the number of threads in the thread pool
+ * - size_t min_threads: the fewest threads in the thread pool
+ * - size_t max_threads: the most threads in the thread pool
  *
  * Returns:
  * - 0 on success, -1 on failure
  */
-int init_server_control(server_control_t *server_control, size_t num_threads);
+int init_server_control(server_control_t *server_control, size_t min_threads,
+                        size_t max_threads);
 
 /**
  * Cleans up a server control struct.
@@ -117,15 +161,22 @@ void destroy_server_control(server_control_t *server_control);
  * initialize
  * - size_t num_stations: the number of stations
  * - char *songs[]: the songs corresponding to each station
+ * - station_config_t *config: settings for every station; its egress is set to
+ * the station control's budget
+ * - uint64_t egress_rate: the egress budget, in bytes per second (0: unlimited)
+ * - uint64_t *weights: each station's weight in the egress budget
  *
  * Returns:
  * - 0 on success, -1 on failure
  */
 int init_station_control(station_control_t *station_control,
-                         size_t num_stations, char *songs[]);
+                         size_t num_stations, char *songs[],
+                         station_config_t *config, uint64_t egress_rate,
+                         uint64_t *weights);
 
 /**
- * Cleans up a station control struct.
+ * Cleans up a station control struct, stopping every station first and waiting
+ * for their last announcements.
  *
  * Inputs:
  * - station_control_t *station_control: the station control struct to clean up
@@ -163,37 +214,124 @@ void lock_server_control(server_control_t *server_control);
 void unlock_server_control(server_control_t *server_control);
 
 /**
- * Locks a station control structure.
+ * Locks a client control structure.
  */
-void lock_station_control(station_control_t *station_control);
+void lock_client_control(client_control_t *client_control);
 
 /**
- * Unlocks a station control structure.
+ * Unlocks a client control structure.
  */
-void unlock_station_control(station_control_t *station_control);
+void unlock_client_control(client_control_t *client_control);
 
 /**
- * Locks a client control structure.
+ * Prints every station, along with the listeners connected to it, from a
+ * snapshot of each station (see snapshot_station); no station is locked while
+ * its listeners are formatted, and output goes out DUMP_BUF_SIZE bytes at a
+ * time.
+ * - The default format has one line per station: its number, its song and the
+ * address of every listener, separated by commas.
+ * - The compact format has one tab-separated record per line: "S", the station
+ * number, its listener count and its song for each station, followed by "L",
+ * the station number, IP and port for each of its listeners.
+ *
+ * Inputs:
+ * - FILE *out: where to print
+ * - int compact: 1 for the compact format, 0 for the default
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
  */
-void lock_client_control(client_control_t *client_control);
+int dump_stations(FILE *out, int compact);
 
 /**
- * Unlocks a client control structure.
+ * Dumps every station's trace ring (see trace.h) as CSV, with a header line.
+ * Each row is one tick: station, tick number, when it was scheduled and when
+ * the streamer woke up (get_time_ns), how long the read and the fan-out took
+ * (in ns), and the station's listeners and datagrams sent. Rows are grouped by
+ * station, oldest first.
+ *
+ * Inputs:
+ * - FILE *out: where to print
  */
-void unlock_client_control(client_control_t *client_control);
+void dump_traces(FILE *out);
+
+/**
+ * Prints every metric the server keeps (see metrics.h): the control plane's,
+ * every station's, the egress budget's and the thread pool's.
+ *
+ * Inputs:
+ * - FILE *out: where to print
+ */
+void report_metrics(FILE *out);
+
+/**
+ * Creates a UNIX stream socket to serve metrics on. A stale socket left at the
+ * path (e.g. by a server that crashed) is replaced; anything else there (like
+ * a socket some other server still listens on) is left alone, and is an error.
+ *
+ * Inputs:
+ * - const char *path: where to create the socket
+ *
+ * Returns:
+ * - the listening socket, or -1 on failure
+ */
+int open_metrics_socket(const char *path);
+
+/**
+ * Serves metrics on a UNIX socket until cancelled: everyone who connects gets
+ * a report_metrics dump, and is then disconnected. A reader that doesn't keep
+ * up gets cut off after METRICS_SEND_TIMEOUT_MS. Only cancelled while waiting
+ * for a reader.
+ *
+ * Inputs:
+ * - int *metrics_fd: the socket from open_metrics_socket
+ *
+ * Returns:
+ * - NULL
+ */
+void *serve_metrics(void *arg);
+
+/**
+ * Gathers the server's counters into a private copy of the stats segment, to be
+ * published with publish_stats_segment.
+ *
+ * Inputs:
+ * - stats_segment_t *staged: where to gather the counters; must have room for
+ * every station
+ */
+void collect_stats(stats_segment_t *staged);
+
+/**
+ * Publishes the server's counters to its stats segment every STATS_PUBLISH_MS
+ * until cancelled. Only cancelled while sleeping between publishes.
+ *
+ * Inputs:
+ * - stats_segment_t *seg: the segment from create_stats_segment
+ *
+ * Returns:
+ * - NULL
+ */
+void *publish_stats(void *arg);
 
 /**
  * Handles user input from stdin.
  * - On 'p', prints a list of stations, along with all clients connected to
- * them.
+ * them (to a file instead, if one is named after the 'p'). 'P' does the same
+ * in a compact format meant for scripts.
+ * - On 'a', prints allocation counters for every slab.
+ * - On 'm', prints every metric (see report_metrics).
+ * - On 't', dumps the stations' tick traces as CSV (see dump_traces), to a
+ * file if one is named after the 't'.
+ * - On 's', prints client counters, the egress budget's commitments and the
+ * thread pool's size and resizes, along with its queue depth and queue wait
+ * per priority class.
  * - On 'q', marks the server as stopped, which commences server cleanup and
  * termination.
  *
  * Inputs:
  * - char *msg: the user message
- * - size_t size: the max size of the buffer
  */
-void process_input(char *msg, size_t size);
+void process_input(char *msg);
 
 /**
  * Atomic check if stopped.
@@ -207,45 +345,102 @@ void process_input(char *msg, size_t size);
 int check_stopped(server_control_t *server_control);
 
 /**
- * Synchronously get the number of stations.
+ * Re-arms a client (or the listener) with epoll, so its next request can be
+ * handled (and, for a client, its queued replies flushed).
+ *
+ * Inputs:
+ * - client_control_t *cc: the client control structure
+ * - int sockfd: the client's socket
+ * - client_connection_t *conn: the client's connection, or NULL for the
+ * listener
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+int rearm_client(client_control_t *cc, int sockfd, client_connection_t *conn);
+
+/**
+ * Completes a new client's handshake: records its UDP port and sends a
+ * Welcome.
+ *
+ * Inputs:
+ * - client_control_t *cc: the client control structure
+ * - client_connection_t *conn: the new client
+ * - hello_t *hello: the client's Hello
+ *
+ * Returns:
+ * - 0 on success, -1 if the handshake already expired or Welcome failed (the
+ * caller should remove the client)
+ */
+int welcome_client(client_control_t *cc, client_connection_t *conn,
+                   hello_t *hello);
+
+/**
+ * Expires new clients that haven't sent a Hello within HANDSHAKE_TIMEOUT_MS.
+ * They're shut down rather than removed, so their handler removes them the
+ * same way as any client that disconnects.
+ *
+ * Inputs:
+ * - client_control_t *cc: the client control structure
+ * - uint64_t now: the current time, from get_time_ns
  */
-size_t get_num_stations(station_control_t *station_control);
+void expire_handshakes(client_control_t *cc, uint64_t now);
 
 /**
- * Atomically increments a size_t.
+ * Shuts down rejected clients that haven't taken their last reply within
+ * CLOSE_LINGER_MS, so their handler removes them.
  *
  * Inputs:
- * - size_t *val: pointer to an size_t
- * - pthread_mutex_t *mtx: pointer to a mutex to synchronize
+ * - client_control_t *cc: the client control structure
+ * - uint64_t now: the current time, from get_time_ns
  */
-void atomic_incr(size_t *val, pthread_mutex_t *mtx);
+void expire_closing(client_control_t *cc, uint64_t now);
 
 /**
  * Swaps the stations of a client; removes client from old station (if
- * applicable), and adds to new station.
+ * applicable), and adds to new station. Only the stations involved are locked;
+ * the caller must hold the connection's lock.
  *
  * Inputs:
  * - station_control_t *sc: station control struct
  * - client_connection_t *conn: connection to swap
  * - int new_station: destination station
+ * - uint64_t ready_ns: when the SetStation was ready, for timing how long the
+ * listener waits for the new station's first datagram
  *
  * Returns:
- * - 0 on success, -1 if invalid station
+ * - 0 on success, -1 if invalid station, -2 if the egress budget has no room
+ * for another listener on new_station (the client stays where it was)
  */
 int swap_stations(station_control_t *sc, client_connection_t *conn,
-                  int new_station, int num_stations);
+                  int new_station, int num_stations, uint64_t ready_ns);
 
 /**
- * Removes a client at index i from the server (i.e. from both the client vector
- * and the station vector).
+ * Removes a client from the server (i.e. from both its station and the client
+ * vector), then leaves it for the poller to destroy. The station and the client
+ * vector are locked one after the other, never together.
  *
  * Inputs:
  * - client_control_t *cc: the client control structure
  * - station_control_t *sc: the station control structure
- * - int index: the index in the client vector of the client to remove
+ * - client_connection_t *conn: the client to remove
  */
 void remove_client_from_server(client_control_t *cc, station_control_t *sc,
-                               int index);
+                               client_connection_t *conn);
+
+/**
+ * Removes a client that was just sent an InvalidCommand, once the reply is out.
+ * If the socket doesn't take it right away, the client stops being read from
+ * and waits on `closing` for EPOLLOUT; its handler then removes it once the
+ * reply has drained, or the poller shuts it down after CLOSE_LINGER_MS.
+ *
+ * Inputs:
+ * - client_control_t *cc: the client control structure
+ * - station_control_t *sc: the station control structure
+ * - client_connection_t *conn: the client to reject; must be its handler
+ */
+void reject_client(client_control_t *cc, station_control_t *sc,
+                   client_connection_t *conn);
 
 /*
  * ===============================================================================
@@ -263,17 +458,52 @@ void remove_client_from_server(client_control_t *cc, station_control_t *sc,
  */
 
 /**
- * Handles connections from TCP clients.
+ * Handles connections from TCP clients. Runs in the thread pool as a
+ * JOB_PRIO_HANDSHAKE job, so a burst of new connections can't delay requests
+ * from clients that are already connected. The (non-blocking) listener is
+ * drained of up to ACCEPT_BATCH connections, which are added and registered
+ * with epoll together; their Hellos are handled later by handle_request. The
+ * listener is one-shot too, and is re-armed once the batch is dealt with.
  *
  * Inputs:
- * - int listener: the listener socket
+ * - int sockfd: the listener socket (in a handle_request_t)
  */
 void process_connection(void *arg);
 
 /**
- * Polls client connections for requests. Note that whenever this appends a work
- * request to the thread pool, it must increment `client_control.num_pending`;
- * every work request is also responsible for decrementing it when done.
+ * Adds a batch of newly connected clients to the client vector and the list
+ * of pending handshakes, and starts watching them for their Hello. Clients
+ * that can't be added are closed. The client control lock is taken once per
+ * ACCEPT_BATCH clients, so a bigger batch is split into chunks of that size.
+ *
+ * Inputs:
+ * - client_control_t *cc: the client control structure
+ * - int fds[]: the clients' (non-blocking) sockets
+ * - struct sockaddr_storage addrs[]: their addresses
+ * - socklen_t addr_lens[]: the lengths of their addresses
+ * - size_t num: the number of clients
+ */
+void register_clients(client_control_t *cc, int fds[],
+                      struct sockaddr_storage addrs[], socklen_t addr_lens[],
+                      size_t num);
+
+/**
+ * Destroys the clients that were removed since the last call. Only the poller
+ * calls this, between batches of events (and on cleanup). Clients an
+ * announcement still holds (see client_connection_t's refs) wait until the next
+ * call.
+ *
+ * Inputs:
+ * - client_control_t *cc: the client control structure
+ */
+void reap_clients(client_control_t *cc);
+
+/**
+ * Polls client connections for requests, handing each ready client (as a
+ * JOB_PRIO_SWITCH job) or the listener (as a JOB_PRIO_HANDSHAKE job) to the
+ * thread pool. Both are one-shot, so neither is handed out again until its
+ * current handler re-arms it. A client is also ready once it can take more of
+ * its queued replies.
  *
  * Inputs:
  * - int listener: the listener socket
@@ -281,20 +511,34 @@ void process_connection(void *arg);
 void *poll_connections(void *arg);
 
 typedef struct {
-  int sockfd;
+  int sockfd;                // socket with something to read
+  client_connection_t *conn; // its connection, or NULL for the listener
+  uint64_t ready_ns;         // when the poller saw it was ready
 } handle_request_t;
 
 /**
- * Handles a request from a client. Currently, only SET_STATION is supported,
- * but ideally more could be in the future.
+ * Hands a batch of requests to the thread pool. Any requests the pool refuses
+ * (i.e. it's stopping) are freed.
+ *
+ * Inputs:
+ * - void **batch: array of handle_request_t, allocated from a slab
+ * - size_t batch_size: number of requests in the batch
+ */
+void dispatch_requests(void **batch, size_t batch_size);
+
+/**
+ * Handles a request from a client: a Hello from a new client, or SET_STATION
+ * afterwards. Commands may arrive a few bytes at a time; whatever has arrived
+ * is kept with the connection until the rest does. Queued replies are flushed
+ * first, and replies are queued rather than sent, so a client that doesn't
+ * read can't hold up the worker.
  *
- * Note that whenever this appends a work request to the thread pool, it must
- * increment `client_control.num_pending`; every work request is also
- * responsible for decrementing it when done.
+ * Note that the client is disarmed while this runs; unless the client is
+ * removed, this is responsible for re-arming it once the request is done.
  *
  * Inputs:
  * - int sockfd: the socket of the client connection
- * - int index: index of the client connection
+ * - client_connection_t *conn: the client connection
  */
 void handle_request(void *arg);
 
@@ -0,0 +1,99 @@
+#include "snowcast_stats.h"
+
+/**
+ * Rate of a counter between two samples, per second.
+ */
+static double rate(uint64_t cur, uint64_t prev, double secs) {
+  return secs > 0 ? (cur - prev) / secs : 0;
+}
+
+/**
+ * Prints the percentiles of what a latency histogram recorded between two
+ * samples.
+ */
+static void print_latency(const char *name, const hist_snapshot_t *cur,
+                          const hist_snapshot_t *prev) {
+  hist_snapshot_t c = *cur, p = *prev, delta;
+  hist_diff(&delta, &c, &p);
+  printf("  %-36s n=%-8lu p50=%10.1fus p99=%10.1fus\n", name, delta.count,
+         hist_percentile(&delta, 50) / 1000.0,
+         hist_percentile(&delta, 99) / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: ./snowcast_stats <SHM> [<INTERVAL_MS>]\n");
+    exit(1);
+  }
+  long interval_ms = argc == 3 ? atol(argv[2]) : DEFAULT_INTERVAL_MS;
+  if (interval_ms <= 0) {
+    fprintf(stderr, "Usage: ./snowcast_stats <SHM> [<INTERVAL_MS>]\n");
+    exit(1);
+  }
+
+  // map the server's segment; from here on, reading it never involves the
+  // server (or the kernel)
+  size_t size;
+  const stats_segment_t *seg = open_stats_segment(argv[1], &size);
+  if (seg == NULL)
+    exit(1);
+  stats_segment_t *cur = malloc(size), *prev = malloc(size);
+  if (cur == NULL || prev == NULL) {
+    fprintf(stderr, "[main] Failed to malloc samples.\n");
+    exit(1);
+  }
+  if (read_stats_segment(seg, prev, size)) {
+    fprintf(stderr, "[main] Could not get a consistent sample.\n");
+    exit(1);
+  }
+
+  while (1) {
+    usleep(interval_ms * 1000);
+    if (read_stats_segment(seg, cur, size)) {
+      fprintf(stderr, "[main] Could not get a consistent sample; skipping.\n");
+      continue;
+    }
+
+    // rates are over the server's own publish times, not ours
+    double secs = (cur->publish_ns - prev->publish_ns) / 1e9;
+    uint64_t age_ms = (get_time_ns() - cur->publish_ns) / 1000000;
+    printf("clients %lu, pool threads %lu, queued %lu/%lu/%lu%s\n",
+           cur->clients, cur->pool_threads, cur->pool_queued[JOB_PRIO_SWITCH],
+           cur->pool_queued[JOB_PRIO_HANDSHAKE],
+           cur->pool_queued[JOB_PRIO_BULK],
+           age_ms > STALE_MS ? " (stale: server not publishing)" : "");
+    for (int i = 0; i < cur->num_metrics && i < NUM_METRICS; i++)
+      printf("  %-36s %10.1f/s\n", metric_name(i),
+             rate(cur->counters[i], prev->counters[i], secs));
+    for (int i = 0; i < NUM_TIMERS; i++)
+      print_latency(timer_name(i), &cur->timers[i], &prev->timers[i]);
+    char name[MAXBUFSIZ];
+    for (int c = 0; c < NUM_JOB_PRIOS; c++) {
+      snprintf(name, sizeof(name), "pool wait[%s]", job_prio_name(c));
+      print_latency(name, &cur->pool_wait[c], &prev->pool_wait[c]);
+    }
+    print_latency("lock wait", &cur->lock_wait, &prev->lock_wait);
+    printf("  egress: %lu listeners committed, %.1f ticks shed/s, %.1f "
+           "refused/s\n",
+           cur->egress_committed,
+           rate(cur->egress_shed_ticks, prev->egress_shed_ticks, secs),
+           rate(cur->egress_refused, prev->egress_refused, secs));
+    for (size_t i = 0; i < cur->num_stations; i++) {
+      const stats_station_t *c = stats_station(cur, i),
+                            *p = stats_station(prev, i);
+      printf("  station %zu: %lu listeners, %.1f datagrams/s, %.1f KiB/s, "
+             "%.1f errors/s, %.1f overruns/s\n",
+             i, c->listeners, rate(c->datagrams, p->datagrams, secs),
+             rate(c->bytes, p->bytes, secs) / 1024,
+             rate(c->send_errors, p->send_errors, secs),
+             rate(c->overruns, p->overruns, secs));
+    }
+    fflush(stdout);
+
+    stats_segment_t *tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef __SNOWCAST_STATS__
+#define __SNOWCAST_STATS__
+
+#include "./util/stats_shm.h"
+
+#define DEFAULT_INTERVAL_MS 1000 // time between samples, unless told otherwise
+#define STALE_MS 1000            // report a segment this old as stale
+
+#endif
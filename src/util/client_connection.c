@@ -1,9 +1,17 @@
 #include "client_connection.h"
 
+// connections come and go constantly during connect storms
+static slab_t connection_slab =
+    SLAB_INITIALIZER("client_connection_t", sizeof(client_connection_t));
+
+// replies that a client's socket couldn't take right away
+static slab_t out_chunk_slab =
+    SLAB_INITIALIZER("out_chunk_t", sizeof(out_chunk_t) + OUT_CHUNK_SIZE);
+
 client_connection_t *init_connection(int client_fd, uint16_t udp_port,
                                      struct sockaddr *sa, socklen_t sa_len) {
   // attempt to allocate space for the client connection
-  client_connection_t *conn = malloc(sizeof(client_connection_t));
+  client_connection_t *conn = slab_alloc(&connection_slab);
   if (conn == NULL) {
     fprintf(stderr,
             "[init_connection] Failed to malloc space for connection %d.\n",
@@ -24,12 +32,248 @@ client_connection_t *init_connection(int client_fd, uint16_t udp_port,
   // same length for both addresses
   conn->addr_len = sa_len;
   conn->current_station = -1;
+  conn->index = -1;
+  atomic_init(&conn->state, CONN_HANDSHAKE);
+  atomic_init(&conn->refs, 0);
+  conn->accepted_ns = get_time_ns();
+  conn->rejected_ns = 0;
+  conn->in.len = 0;
+  conn->epoll_fd = -1;
+  list_init(&conn->out_queue);
+  conn->out_bytes = 0;
+  conn->armed = 0;
+  conn->closed = 0;
+  conn->send_failures = 0;
+  conn->last_failure_ns = 0;
+  conn->parked_until_ns = 0;
+  conn->park_ns = 0;
+  conn->last_heard_ns = 0;
+  conn->switched_ns = 0;
+  conn->pruned = 0;
+
+  int ret;
+  if ((ret = pthread_mutex_init(&conn->mtx, NULL))) {
+    errno = ret;
+    perror("init_connection: pthread_mutex_init");
+    slab_free(conn);
+    return NULL;
+  }
+  if ((ret = pthread_mutex_init(&conn->out_mtx, NULL))) {
+    errno = ret;
+    perror("init_connection: pthread_mutex_init");
+    pthread_mutex_destroy(&conn->mtx);
+    slab_free(conn);
+    return NULL;
+  }
 
   return conn;
 }
 
 void destroy_connection(client_connection_t *conn) {
-  fprintf(stderr, "Closing client fd [%d].\n", conn->client_fd);
+  log_info("Closing client fd [%d].", conn->client_fd);
   close(conn->client_fd);
-  free(conn);
+
+  // drop whatever never made it out
+  out_chunk_t *chunk;
+  list_iterate_begin(&conn->out_queue, chunk, out_chunk_t, link) {
+    slab_free(chunk);
+  }
+  list_iterate_end();
+
+  pthread_mutex_destroy(&conn->mtx);
+  pthread_mutex_destroy(&conn->out_mtx);
+  slab_free(conn);
+}
+
+void lock_connection(client_connection_t *conn) {
+  pthread_mutex_lock(&conn->mtx);
+}
+
+void unlock_connection(client_connection_t *conn) {
+  pthread_mutex_unlock(&conn->mtx);
+}
+
+/**
+ * Shuts a client down so that its handler removes it. Must hold out_mtx.
+ */
+static void shut_connection(client_connection_t *conn) {
+  conn->closed = 1;
+  shutdown(conn->client_fd, SHUT_RDWR);
+}
+
+/**
+ * Registers a client with epoll for the given events. Must hold out_mtx.
+ */
+static int register_connection(client_connection_t *conn, uint32_t events) {
+  struct epoll_event ev = {.events = events, .data.ptr = conn};
+  if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->client_fd, &ev) == -1) {
+    log_error("[register_connection] epoll_ctl: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int conn_send(client_connection_t *conn, const void *data, size_t len) {
+  const char *bytes = data;
+  pthread_mutex_lock(&conn->out_mtx);
+  if (conn->closed) {
+    pthread_mutex_unlock(&conn->out_mtx);
+    return -1;
+  }
+
+  // if nothing is waiting ahead of us, try the socket first
+  int was_empty = conn->out_bytes == 0;
+  while (was_empty && len > 0) {
+    ssize_t n =
+        send(conn->client_fd, bytes, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      log_warn("[conn_send] send: %s", strerror(errno));
+      shut_connection(conn);
+      pthread_mutex_unlock(&conn->out_mtx);
+      return -1;
+    }
+    bytes += n;
+    len -= n;
+  }
+
+  // a client that doesn't read its replies doesn't get to hold on to memory
+  if (conn->out_bytes + len > OUT_HIGH_WATERMARK) {
+    log_warn("[Client %d] Stopped reading replies (%zu bytes queued). "
+             "Closing...",
+             conn->client_fd, conn->out_bytes + len);
+    shut_connection(conn);
+    pthread_mutex_unlock(&conn->out_mtx);
+    return -1;
+  }
+
+  // queue the rest, topping up the last chunk first
+  while (len > 0) {
+    out_chunk_t *chunk = list_empty(&conn->out_queue)
+                             ? NULL
+                             : list_tail(&conn->out_queue, out_chunk_t, link);
+    if (chunk == NULL || chunk->end == OUT_CHUNK_SIZE) {
+      chunk = slab_alloc(&out_chunk_slab);
+      if (chunk == NULL) {
+        // part of a reply may be queued already, so the stream is broken
+        log_error("[conn_send] Failed to queue reply for client %d.",
+                  conn->client_fd);
+        shut_connection(conn);
+        pthread_mutex_unlock(&conn->out_mtx);
+        return -1;
+      }
+      chunk->start = chunk->end = 0;
+      list_link_init(&chunk->link);
+      list_insert_tail(&conn->out_queue, &chunk->link);
+    }
+    size_t n = OUT_CHUNK_SIZE - chunk->end < len ? OUT_CHUNK_SIZE - chunk->end
+                                                 : len;
+    memcpy(chunk->data + chunk->end, bytes, n);
+    chunk->end += n;
+    conn->out_bytes += n;
+    bytes += n;
+    len -= n;
+  }
+
+  // find out when the client is writable again. If somebody is handling the
+  // client, it isn't registered; they'll ask for EPOLLOUT when re-arming it.
+  int ret = 0;
+  if (was_empty && conn->out_bytes > 0 && conn->armed)
+    ret = register_connection(conn, CLIENT_EVENTS | EPOLLOUT);
+  pthread_mutex_unlock(&conn->out_mtx);
+  return ret;
+}
+
+int queue_reply(client_connection_t *conn, uint8_t cmd, uint16_t val,
+                const char *msg) {
+  uint8_t buf[MAXREPLYSIZE];
+  int size = pack_reply_msg(buf, cmd, val, msg);
+  if (size == -1)
+    return -1;
+  return conn_send(conn, buf, size);
+}
+
+int flush_connection(client_connection_t *conn) {
+  pthread_mutex_lock(&conn->out_mtx);
+  while (conn->out_bytes > 0) {
+    // gather the oldest chunks into one sendmsg (i.e. writev, minus SIGPIPE)
+    struct iovec iov[OUT_IOV_MAX];
+    size_t iovcnt = 0;
+    out_chunk_t *chunk;
+    list_iterate_begin(&conn->out_queue, chunk, out_chunk_t, link) {
+      if (iovcnt == OUT_IOV_MAX)
+        break;
+      iov[iovcnt].iov_base = chunk->data + chunk->start;
+      iov[iovcnt].iov_len = chunk->end - chunk->start;
+      iovcnt++;
+    }
+    list_iterate_end();
+
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t n = sendmsg(conn->client_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      // the client still isn't reading; try again once it's writable
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      log_warn("[flush_connection] sendmsg: %s", strerror(errno));
+      shut_connection(conn);
+      pthread_mutex_unlock(&conn->out_mtx);
+      return -1;
+    }
+
+    // release whatever was sent in full
+    conn->out_bytes -= n;
+    list_iterate_begin(&conn->out_queue, chunk, out_chunk_t, link) {
+      size_t left = chunk->end - chunk->start;
+      if ((size_t)n < left) {
+        chunk->start += n;
+        break;
+      }
+      n -= left;
+      list_remove(&chunk->link);
+      slab_free(chunk);
+    }
+    list_iterate_end();
+  }
+  pthread_mutex_unlock(&conn->out_mtx);
+  return 0;
+}
+
+int conn_pending(client_connection_t *conn) {
+  pthread_mutex_lock(&conn->out_mtx);
+  int pending = conn->out_bytes > 0;
+  pthread_mutex_unlock(&conn->out_mtx);
+  return pending;
+}
+
+int arm_connection(client_connection_t *conn) {
+  pthread_mutex_lock(&conn->out_mtx);
+  uint32_t events = conn->out_bytes > 0 ? CLIENT_EVENTS | EPOLLOUT
+                                        : CLIENT_EVENTS;
+  // a closing client isn't read from anymore
+  if (atomic_load(&conn->state) == CONN_CLOSING)
+    events = CLOSING_EVENTS;
+  int ret = register_connection(conn, events);
+  conn->armed = ret == 0;
+  pthread_mutex_unlock(&conn->out_mtx);
+  return ret;
+}
+
+int disarm_connection(client_connection_t *conn) {
+  pthread_mutex_lock(&conn->out_mtx);
+  int was_armed = conn->armed;
+  conn->armed = 0;
+  pthread_mutex_unlock(&conn->out_mtx);
+  return was_armed;
+}
+
+void close_connection(client_connection_t *conn) {
+  pthread_mutex_lock(&conn->out_mtx);
+  conn->closed = 1;
+  pthread_mutex_unlock(&conn->out_mtx);
 }
@@ -2,22 +2,102 @@
 #define __CLIENT_CONNECTION_H__
 
 #include "list.h"
+#include "log.h"
+#include "protocol.h"
+#include "slab.h"
 #include "util.h"
 
+/**
+ * Where a connection is in its life. A client starts in CONN_HANDSHAKE until it
+ * sends a Hello; if it takes too long, it's CONN_EXPIRED and gets removed. A
+ * client sent an InvalidCommand is CONN_CLOSING until the reply has gone out.
+ */
+typedef enum {
+  CONN_HANDSHAKE, // accepted, waiting for a Hello
+  CONN_ACTIVE,    // welcomed; may switch stations
+  CONN_EXPIRED,   // never said Hello; waiting to be removed
+  CONN_CLOSING,   // rejected; only its last replies are left to send
+} conn_state_t;
+
+// how a client is registered with epoll: one request at a time
+#define CLIENT_EVENTS (EPOLLIN | EPOLLONESHOT)
+// ...and once it's closing, when there's room for the rest of its replies
+#define CLOSING_EVENTS (EPOLLOUT | EPOLLONESHOT)
+
+#define OUT_CHUNK_SIZE 512       // bytes per chunk of an outbound queue
+#define OUT_HIGH_WATERMARK 65536 // queued bytes before a client is dropped
+#define OUT_IOV_MAX 16           // chunks flushed per sendmsg
+
+/**
+ * A piece of a connection's outbound queue: the bytes in [start, end) of data
+ * are still waiting to be sent.
+ */
+typedef struct {
+  list_link_t link; // for the connection's outbound queue
+  size_t start;     // first byte not yet sent
+  size_t end;       // end of the bytes queued so far
+  char data[];      // OUT_CHUNK_SIZE bytes
+} out_chunk_t;
+
 /**
  * Struct representing a single client connection.
  * - client_fd is the TCP socket of the client connection. tcp_addr and udp_addr
  * are used to print information about the IP/port address of each connection,
  * if necessary; in addition, udp_addr is needed for the station sock_fd to send
  * information to.
+ * - mtx guards the connection's changing state (i.e. current_station), so
+ * clients never wait on each other; the addresses never change, and index
+ * belongs to whoever holds the client vector's lock.
+ * - Until a client is welcomed, `link` sits on the server's list of pending
+ * handshakes (rather than a station's list), and the UDP port is unknown.
+ * - Replies never block on the client's TCP window. Whatever the socket won't
+ * take right away waits on `out_queue` (under `out_mtx`, which is never held
+ * while taking another lock), and the client is registered for EPOLLOUT until
+ * its handler has flushed it. A client that lets more than OUT_HIGH_WATERMARK
+ * bytes pile up is shut down, so its handler removes it.
+ * - `armed` tracks whether the client is registered with epoll, i.e. whether
+ * nobody is handling it. Only while it's armed may a reply re-register it (to
+ * add EPOLLOUT); the poller hands out an event only if it's the one to disarm
+ * the client, so there's never more than one handler per client.
+ * - While listening, the client is also in its station's table of listeners
+ * by UDP address, chained through `hash_next`/`hash_pprev` (also under the
+ * station's client list lock).
+ * - `refs` counts announcements still sending to the client, which pin it
+ * without holding its station's lock; it isn't destroyed until they're done.
+ * - The UDP listener's health (failed sends, whether it's parked, and when it
+ * last sent a keepalive) belongs to the station streaming to it, under the
+ * station's client list lock, as does `switched_ns`.
  */
-typedef struct {
+typedef struct client_connection {
   list_link_t link;                 // for the doubly linked lists
   int client_fd;                    // TCP connection socket
   struct sockaddr_storage tcp_addr; // TCP address
   struct sockaddr_storage udp_addr; // UDP address
-  socklen_t addr_len;  // address length; only difference is type + port
-  int current_station; // currently connected station
+  socklen_t addr_len;       // address length; only difference is type + port
+  int current_station;      // currently connected station
+  int index;                // position in the client vector
+  pthread_mutex_t mtx;      // synchronize changes to this connection
+  atomic_int state;         // a conn_state_t
+  uint64_t accepted_ns;     // when the connection was accepted
+  uint64_t rejected_ns;     // when it started closing (CONN_CLOSING)
+  command_buf_t in;         // partially received command
+  int epoll_fd;             // epoll instance the client is registered with
+  pthread_mutex_t out_mtx;  // synchronize the outbound queue
+  list_t out_queue;         // replies waiting to be sent, as out_chunk_t
+  size_t out_bytes;         // bytes waiting on out_queue
+  int armed;                // registered with epoll, i.e. nobody handling it
+  int closed;               // shut down; nothing more is queued
+  int send_failures;        // recent failed sends to the UDP listener
+  uint64_t last_failure_ns; // when the last failure was reported
+  uint64_t parked_until_ns; // don't stream to the listener until then
+  uint64_t park_ns;         // how long it's parked next time (0: default)
+  uint64_t last_heard_ns;   // last keepalive from the listener
+  int pruned;               // shut down for missing keepalives
+  uint64_t switched_ns;     // when a switch to this station was ready, until
+                            // the listener's first datagram (0: none pending)
+  atomic_int refs;          // announcements still sending to it
+  struct client_connection *hash_next;   // next in its station's bucket
+  struct client_connection **hash_pprev; // what points to it there
 } client_connection_t;
 
 /**
@@ -45,4 +125,98 @@ client_connection_t *init_connection(int client_fd, uint16_t udp_port,
  */
 void destroy_connection(client_connection_t *conn);
 
+/**
+ * Locks a client connection.
+ */
+void lock_connection(client_connection_t *conn);
+
+/**
+ * Unlocks a client connection.
+ */
+void unlock_connection(client_connection_t *conn);
+
+/**
+ * Sends bytes to a client without blocking: whatever the socket doesn't take
+ * right away is queued, to be flushed once the client is writable. If the
+ * queue grows past OUT_HIGH_WATERMARK, the client is shut down instead.
+ *
+ * Inputs:
+ * - client_connection_t *conn: the client
+ * - const void *data: the bytes to send
+ * - size_t len: the number of bytes
+ *
+ * Returns:
+ * - 0 if sent or queued, -1 if the client is (now) shut down or on error
+ */
+int conn_send(client_connection_t *conn, const void *data, size_t len);
+
+/**
+ * Sends a reply message to a client without blocking (see conn_send).
+ *
+ * Inputs:
+ * - client_connection_t *conn: the client
+ * - uint8_t cmd: the type of the reply
+ * - uint16_t val: the value of the reply, IN HOST BYTE ORDER
+ * - char *msg: the reply message if applicable, or NULL / empty string
+ *
+ * Returns:
+ * - 0 if sent or queued, -1 if the client is (now) shut down or on error
+ */
+int queue_reply(client_connection_t *conn, uint8_t cmd, uint16_t val,
+                const char *msg);
+
+/**
+ * Sends as much of a client's outbound queue as the socket takes.
+ *
+ * Inputs:
+ * - client_connection_t *conn: the client
+ *
+ * Returns:
+ * - 0 on success (even if some is still queued), -1 on error
+ */
+int flush_connection(client_connection_t *conn);
+
+/**
+ * Checks whether any of a client's replies are still waiting to be sent.
+ *
+ * Inputs:
+ * - client_connection_t *conn: the client
+ *
+ * Returns:
+ * - 1 if some are queued, 0 if the queue is empty
+ */
+int conn_pending(client_connection_t *conn);
+
+/**
+ * Registers a client with its epoll instance again, for EPOLLIN, plus EPOLLOUT
+ * if replies are still queued; a closing client only for EPOLLOUT.
+ *
+ * Inputs:
+ * - client_connection_t *conn: the client
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+int arm_connection(client_connection_t *conn);
+
+/**
+ * Marks a client as being handled, once epoll reported it.
+ *
+ * Inputs:
+ * - client_connection_t *conn: the client
+ *
+ * Returns:
+ * - 1 if the client was armed (the caller now handles it), 0 if somebody else
+ * already is (the event is stale)
+ */
+int disarm_connection(client_connection_t *conn);
+
+/**
+ * Marks a client as closed, so nothing more is queued for it.
+ *
+ * Inputs:
+ * - client_connection_t *conn: the client
+ */
+void close_connection(client_connection_t *conn);
+
 #endif
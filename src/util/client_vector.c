@@ -11,18 +11,6 @@ int init_client_vector(client_vector_t *client_vec, size_t max, int listener) {
     return -1;
   }
 
-  // attempt to malloc an initial `max + 1` spaces for pollfds
-  client_vec->pfds = malloc((max + 1) * sizeof(struct pollfd));
-  if (client_vec->pfds == NULL) {
-    fprintf(stderr, "[init_client_vector] Failed to malloc pollfds.\n");
-    // clean up
-    free(client_vec->conns);
-    return -1;
-  }
-
-  // set first pfd to the listener socket
-  client_vec->pfds[0] = POLLFD(listener);
-
   client_vec->size = 0;
   client_vec->max = max;
   client_vec->listener = listener;
@@ -35,9 +23,8 @@ void destroy_client_vector(client_vector_t *client_vec) {
   for (size_t i = 0; i < client_vec->size; i++)
     destroy_connection(client_vec->conns[i]);
 
-  // free vectors for conns and pfds
+  // free vector of conns
   free(client_vec->conns);
-  free(client_vec->pfds);
   close(client_vec->listener);
 }
 
@@ -61,24 +48,27 @@ int add_client(client_vector_t *client_vec, int client_fd, uint16_t udp_port,
     return -1;
   }
 
-  // create pollfd for TCP client
-  client_vec->pfds[i + 1] = POLLFD(client_fd);
-
   // update size
+  client_vec->conns[i]->index = i;
   client_vec->size += 1;
   return i;
 }
 
 void remove_client(client_vector_t *client_vec, int index) {
+  // destroy connection
+  destroy_connection(detach_client(client_vec, index));
+}
+
+client_connection_t *detach_client(client_vector_t *client_vec, int index) {
   client_connection_t *old_conn = client_vec->conns[index];
   // override current client with last client, then reduce count
   int size = client_vec->size;
   client_vec->conns[index] = client_vec->conns[size - 1];
-  client_vec->pfds[index + 1] = client_vec->pfds[size];
+  client_vec->conns[index]->index = index;
   client_vec->size -= 1;
+  old_conn->index = -1;
 
-  // destroy connection
-  destroy_connection(old_conn);
+  return old_conn;
 }
 
 client_connection_t *get_client(client_vector_t *client_vec, int index) {
@@ -121,21 +111,17 @@ int resize_client_vector(client_vector_t *client_vec, int new_max) {
 
   // only resize if possible (i.e. resize != 0)
   if (resize) {
-    // attempt to reallocate space for connections and pfds
+    // attempt to reallocate space for connections
     client_connection_t **new_conns =
         realloc(client_vec->conns, resize * sizeof(client_connection_t *));
-    struct pollfd *new_pfds =
-        realloc(client_vec->pfds, (resize + 1) * sizeof(*client_vec->pfds));
 
-    // if either fails, don't update; otherwise, set new values
-    if ((new_conns == NULL) || (new_pfds == NULL)) {
-      fprintf(stderr,
-              "[resize_client_vector] Failed to realloc client conns/pfds.\n");
+    // if it fails, don't update; otherwise, set new values
+    if (new_conns == NULL) {
+      fprintf(stderr, "[resize_client_vector] Failed to realloc conns.\n");
       return -1;
     } else {
       client_vec->max = resize;
       client_vec->conns = new_conns;
-      client_vec->pfds = new_pfds;
     }
   }
 
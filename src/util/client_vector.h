@@ -3,29 +3,16 @@
 
 #include "client_connection.h"
 
-// helper for easy definitions of pollfds from fds
-#define POLLFD(new_fd)                                                         \
-  (struct pollfd) { .fd = new_fd, .events = POLLIN }
-
 /**
  * Struct representing a vector of clients.
- *  - Client connections and pollfds are each stored in a dynamically sized
- * array; vector operations may be assumed for insertion/deletion from the
- * vector.
- *
- *  NOTE: `conns` AND `pfds` MUST BE EXACTLY SYNCHRONIZED, **OFFSET BY 1**:
- * INDEX `i` IN `conns` MUST CORRESPOND TO THE APPROPRIATE SFD AT `pfds[i + 1]`.
- *    - this separation is necessary to support the poll(2) system call;
- *    otherwise, I'd really like to encapsulate this into one connection :/
+ *  - Client connections are stored in a dynamically sized array; vector
+ * operations may be assumed for insertion/deletion from the vector.
  *
- * Unfortunately, there's no good way to synchronize access to the pollfds
- * struct while a thread is blocking `poll` on it; thus, we have to include
- * listening for incoming connections within this pollfd structure. This causes
- * an offset by 1 in the array.
+ * Readiness is tracked by the server's epoll instance rather than an array of
+ * pollfds, so the vector is free to change (and resize) while the poller waits.
  */
 typedef struct {
   client_connection_t **conns; // array of connections
-  struct pollfd *pfds;         // array of struct pollfds
   size_t size;                 // current size of a vector array
   size_t max;                  // current max size of a vector array
   int listener;                // listener socket
@@ -69,9 +56,9 @@ int add_client(client_vector_t *client_vec, int client_fd, uint16_t udp_port,
                struct sockaddr *sa, socklen_t sa_len);
 
 /**
- * Removes a client connection from a vector of client connections. DOES NOT
- * RESIZE TO ALLOW REMOVAL IN ITERATIONS! EXPLICITLY CALL resize_client_vector()
- * IF YOU WANT TO RESIZE.
+ * Removes a client connection from a vector of client connections; the last
+ * client takes its place (and its index). DOES NOT RESIZE TO ALLOW REMOVAL IN
+ * ITERATIONS! EXPLICITLY CALL resize_client_vector() IF YOU WANT TO RESIZE.
  *
  * Inputs:
  * - client_vector_t *client_vec: pointer to a vector of client connections
@@ -79,6 +66,19 @@ int add_client(client_vector_t *client_vec, int client_fd, uint16_t udp_port,
  */
 void remove_client(client_vector_t *client_vec, int index);
 
+/**
+ * Like remove_client, but hands the connection back instead of destroying it,
+ * for when somebody else might still be looking at it.
+ *
+ * Inputs:
+ * - client_vector_t *client_vec: pointer to a vector of client connections
+ * - int index: index of client to detach
+ *
+ * Returns:
+ * - the detached connection; the caller must destroy it eventually
+ */
+client_connection_t *detach_client(client_vector_t *client_vec, int index);
+
 /**
  * Gets the client at index i.
  *
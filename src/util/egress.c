@@ -0,0 +1,117 @@
+#include "egress.h"
+
+/**
+ * Most tokens a bucket filling at the given rate can hold.
+ */
+static double egress_burst(uint64_t rate) {
+  return (double)rate * EGRESS_BURST_MS / 1000;
+}
+
+int init_egress(egress_t *egress, uint64_t rate, uint64_t total_weight) {
+  int ret;
+  if ((ret = pthread_mutex_init(&egress->mtx, NULL))) {
+    errno = ret;
+    perror("init_egress: pthread_mutex_init");
+    return -1;
+  }
+  egress->rate = rate;
+  egress->total_weight = total_weight ? total_weight : 1;
+  egress->spare = 0;
+  atomic_init(&egress->committed, 0);
+  atomic_init(&egress->shed_ticks, 0);
+  atomic_init(&egress->refused, 0);
+  return 0;
+}
+
+void destroy_egress(egress_t *egress) { pthread_mutex_destroy(&egress->mtx); }
+
+void init_egress_share(egress_share_t *share, egress_t *egress,
+                       uint64_t weight) {
+  share->egress = egress;
+  share->rate = egress->rate * weight / egress->total_weight;
+  share->tokens = egress_burst(share->rate);
+  share->last_ns = get_time_ns();
+}
+
+int egress_admit(egress_share_t *share, size_t listeners,
+                 uint64_t stream_rate) {
+  egress_t *egress = share->egress;
+  if (egress->rate == 0)
+    return 1;
+
+  // a station can always fill its own share, and borrow whatever is left over
+  if ((listeners + 1) * stream_rate <= share->rate ||
+      (atomic_load(&egress->committed) + 1) * stream_rate <= egress->rate)
+    return 1;
+
+  atomic_fetch_add_explicit(&egress->refused, 1, memory_order_relaxed);
+  return 0;
+}
+
+void egress_commit(egress_share_t *share, int delta) {
+  atomic_fetch_add_explicit(&share->egress->committed, delta,
+                            memory_order_relaxed);
+}
+
+int egress_unlimited(egress_share_t *share) {
+  return share->egress->rate == 0;
+}
+
+int egress_consume(egress_share_t *share, uint64_t bytes, uint64_t now) {
+  egress_t *egress = share->egress;
+  if (egress->rate == 0)
+    return 1;
+
+  // top up the share; whatever doesn't fit goes to the spare bucket
+  share->tokens += (double)share->rate * (now - share->last_ns) / 1e9;
+  share->last_ns = now;
+  double burst = egress_burst(share->rate), overflow = 0;
+  if (share->tokens > burst) {
+    overflow = share->tokens - burst;
+    share->tokens = burst;
+  }
+
+  int ok = 1;
+  profiled_lock(&egress->mtx, "egress");
+  egress->spare += overflow;
+  if (egress->spare > egress_burst(egress->rate))
+    egress->spare = egress_burst(egress->rate);
+  if (share->tokens >= bytes) {
+    share->tokens -= bytes;
+  } else if (share->tokens + egress->spare >= bytes) {
+    // borrow the rest
+    egress->spare -= bytes - share->tokens;
+    share->tokens = 0;
+  } else {
+    // can't afford it; keep saving up rather than spending part of it
+    ok = 0;
+  }
+  profiled_unlock(&egress->mtx);
+
+  if (!ok)
+    atomic_fetch_add_explicit(&egress->shed_ticks, 1, memory_order_relaxed);
+  return ok;
+}
+
+void print_egress_stats(egress_t *egress, uint64_t stream_rate, FILE *out) {
+  if (egress->rate == 0) {
+    fprintf(out, "egress: unlimited\n");
+    return;
+  }
+  size_t committed = atomic_load(&egress->committed);
+  fprintf(out,
+          "egress: %lu/%lu KiB/s committed (%zu listeners), %lu ticks shed, "
+          "%lu joins refused\n",
+          committed * stream_rate / 1024, egress->rate / 1024, committed,
+          atomic_load(&egress->shed_ticks), atomic_load(&egress->refused));
+}
+
+void print_egress_metrics(egress_t *egress, FILE *out) {
+  fprintf(out, "snowcast_egress_rate_bytes %lu\n", egress->rate);
+  fprintf(out, "snowcast_egress_committed_listeners %zu\n",
+          atomic_load(&egress->committed));
+  fprintf(out, "snowcast_egress_shed_ticks_total %lu\n",
+          atomic_load(&egress->shed_ticks));
+  fprintf(out, "snowcast_egress_refused_total %lu\n",
+          atomic_load(&egress->refused));
+}
@@ -0,0 +1,137 @@
+#ifndef __EGRESS_H__
+#define __EGRESS_H__
+
+#include <stdatomic.h>
+
+#include "lock_profile.h"
+#include "util.h"
+
+/**
+ * Host-wide egress budget, split between stations in proportion to their
+ * weights. There are two levels of token buckets:
+ * - each station has a bucket for its own share of the budget, which it can
+ * always use;
+ * - tokens a station doesn't use spill over into the budget's `spare` bucket,
+ * which any station may borrow from once its own share runs out.
+ *
+ * Joins are admitted if the station stays within its share, or if the budget
+ * as a whole has room (i.e. the station borrows); otherwise they're refused.
+ * Since joins within a share are always admitted, the budget can end up over
+ * committed by stations that borrowed earlier. Those are the ones that run out
+ * of tokens, and a station that can't afford a tick sheds it as a whole (i.e.
+ * nobody hears that chunk) rather than dropping datagrams at random.
+ */
+
+#define EGRESS_BURST_MS 125 // tokens a bucket can save up, in time at its rate
+
+typedef struct {
+  pthread_mutex_t mtx;     // synchronize the spare bucket
+  uint64_t rate;           // bytes per second; 0 means unlimited
+  uint64_t total_weight;   // sum of every station's weight
+  double spare;            // unused tokens any station may borrow
+  atomic_size_t committed; // listeners admitted across all stations
+  atomic_ulong shed_ticks; // ticks shed for lack of tokens
+  atomic_ulong refused;    // joins refused for lack of budget
+} egress_t;
+
+/**
+ * A station's share of an egress budget. Only used by that station (under its
+ * client list lock, or by its streamer).
+ */
+typedef struct {
+  egress_t *egress; // the budget this is a share of
+  uint64_t rate;    // bytes per second
+  double tokens;    // tokens saved up
+  uint64_t last_ns; // when tokens were last added
+} egress_share_t;
+
+/**
+ * Initializes an egress budget.
+ *
+ * Inputs:
+ * - egress_t *egress: the budget to initialize
+ * - uint64_t rate: the budget, in bytes per second, or 0 for unlimited
+ * - uint64_t total_weight: the sum of the weights of every share
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+int init_egress(egress_t *egress, uint64_t rate, uint64_t total_weight);
+
+/**
+ * Cleans up an egress budget.
+ */
+void destroy_egress(egress_t *egress);
+
+/**
+ * Initializes a share of an egress budget, with a full bucket.
+ *
+ * Inputs:
+ * - egress_share_t *share: the share to initialize
+ * - egress_t *egress: the budget
+ * - uint64_t weight: the share's weight
+ */
+void init_egress_share(egress_share_t *share, egress_t *egress,
+                       uint64_t weight);
+
+/**
+ * Decides whether a share can take on one more listener.
+ *
+ * Inputs:
+ * - egress_share_t *share: the share of the station being joined
+ * - size_t listeners: the station's listeners so far
+ * - uint64_t stream_rate: bytes per second each listener costs
+ *
+ * Returns:
+ * - 1 if admitted, 0 if refused
+ */
+int egress_admit(egress_share_t *share, size_t listeners, uint64_t stream_rate);
+
+/**
+ * Counts a listener joining (delta = 1) or leaving (delta = -1) a share.
+ */
+void egress_commit(egress_share_t *share, int delta);
+
+/**
+ * Checks whether a share's budget is unlimited, i.e. egress_consume never
+ * sheds anything.
+ *
+ * Returns:
+ * - 1 if unlimited, 0 otherwise
+ */
+int egress_unlimited(egress_share_t *share);
+
+/**
+ * Takes the tokens for sending some bytes now: from the share first, then from
+ * the spare bucket.
+ *
+ * Inputs:
+ * - egress_share_t *share: the share sending
+ * - uint64_t bytes: the bytes about to be sent
+ * - uint64_t now: the current time, from get_time_ns
+ *
+ * Returns:
+ * - 1 if the bytes may be sent, 0 if they must be shed
+ */
+int egress_consume(egress_share_t *share, uint64_t bytes, uint64_t now);
+
+/**
+ * Prints an egress budget's commitments and how often it had to say no.
+ *
+ * Inputs:
+ * - egress_t *egress: the budget
+ * - uint64_t stream_rate: bytes per second each listener costs
+ * - FILE *out: where to print
+ */
+void print_egress_stats(egress_t *egress, uint64_t stream_rate, FILE *out);
+
+/**
+ * Prints an egress budget's metrics (see metrics.h).
+ *
+ * Inputs:
+ * - egress_t *egress: the budget
+ * - FILE *out: where to print
+ */
+void print_egress_metrics(egress_t *egress, FILE *out);
+
+#endif
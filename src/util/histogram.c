@@ -0,0 +1,97 @@
+#include "histogram.h"
+
+/**
+ * Maps a value to its bucket: the number of bits needed to represent it.
+ */
+static int hist_bucket(uint64_t value) {
+  return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+void hist_init(histogram_t *hist) {
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    atomic_init(&hist->buckets[i], 0);
+  atomic_init(&hist->count, 0);
+  atomic_init(&hist->sum, 0);
+  atomic_init(&hist->max, 0);
+}
+
+void hist_record(histogram_t *hist, uint64_t value) {
+  atomic_fetch_add_explicit(&hist->buckets[hist_bucket(value)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+
+  // only bother with a CAS when we actually have a new max
+  uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+  while (value > max &&
+         !atomic_compare_exchange_weak_explicit(&hist->max, &max, value,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+    ;
+}
+
+void hist_merge(hist_snapshot_t *snap, histogram_t *hist) {
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    snap->buckets[i] +=
+        atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+  snap->count += atomic_load_explicit(&hist->count, memory_order_relaxed);
+  snap->sum += atomic_load_explicit(&hist->sum, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+  if (max > snap->max)
+    snap->max = max;
+}
+
+void hist_diff(hist_snapshot_t *delta, hist_snapshot_t *cur,
+               hist_snapshot_t *prev) {
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    delta->buckets[i] = cur->buckets[i] - prev->buckets[i];
+  delta->count = cur->count - prev->count;
+  delta->sum = cur->sum - prev->sum;
+  delta->max = cur->max;
+}
+
+uint64_t hist_percentile(hist_snapshot_t *snap, double pct) {
+  // the bucket counts are read one by one while others may be recording, so
+  // don't trust `count` to match their sum exactly
+  uint64_t total = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    total += snap->buckets[i];
+  if (total == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(pct / 100.0 * total);
+  if (rank >= total)
+    rank = total - 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += snap->buckets[i];
+    if (seen > rank) {
+      // upper bound of the bucket, but never more than we've actually seen
+      uint64_t upper = i == 0 ? 0 : i == 64 ? UINT64_MAX : (1ULL << i) - 1;
+      return upper < snap->max ? upper : snap->max;
+    }
+  }
+  return snap->max;
+}
+
+void hist_print_ns(FILE *out, const char *name, hist_snapshot_t *snap) {
+  double mean = snap->count ? (double)snap->sum / snap->count : 0;
+  fprintf(out, "%-24s n=%-10lu mean=%10.1fus p50=%10.1fus p99=%10.1fus "
+          "max=%10.1fus\n",
+          name, snap->count, mean / 1000.0,
+          hist_percentile(snap, 50) / 1000.0,
+          hist_percentile(snap, 99) / 1000.0, snap->max / 1000.0);
+}
+
+void hist_print_metric(FILE *out, const char *name, const char *labels,
+                       hist_snapshot_t *snap) {
+  const char *sep = *labels ? "," : "";
+  fprintf(out, "%s_count{%s} %lu\n", name, labels, snap->count);
+  fprintf(out, "%s_sum{%s} %lu\n", name, labels, snap->sum);
+  fprintf(out, "%s{%s%squantile=\"0.5\"} %lu\n", name, labels, sep,
+          hist_percentile(snap, 50));
+  fprintf(out, "%s{%s%squantile=\"0.99\"} %lu\n", name, labels, sep,
+          hist_percentile(snap, 99));
+  fprintf(out, "%s_max{%s} %lu\n", name, labels, snap->max);
+}
@@ -0,0 +1,111 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdatomic.h>
+
+#include "util.h"
+
+/**
+ * Log2-bucketed histogram for latencies (or any other non-negative values).
+ * Bucket 0 counts zeros; bucket i > 0 counts values in [2^(i - 1), 2^i). That
+ * is coarse, but recording is a couple of relaxed atomic adds, cheap enough for
+ * every job and every tick. Percentiles are reported as the upper bound of the
+ * bucket they fall in (capped at the largest value recorded).
+ */
+
+#define HIST_BUCKETS 65
+
+/**
+ * A live histogram; safe to record into from any number of threads, although
+ * it's cheapest when each histogram mostly has one writer.
+ */
+typedef struct {
+  atomic_ulong buckets[HIST_BUCKETS]; // counts per bucket
+  atomic_ulong count;                 // number of values recorded
+  atomic_ulong sum;                   // sum of values recorded
+  atomic_ulong max;                   // largest value recorded
+} histogram_t;
+
+/**
+ * A plain copy of one (or a sum of several) histograms, for reporting.
+ */
+typedef struct {
+  uint64_t buckets[HIST_BUCKETS]; // counts per bucket
+  uint64_t count;                 // number of values recorded
+  uint64_t sum;                   // sum of values recorded
+  uint64_t max;                   // largest value recorded
+} hist_snapshot_t;
+
+/**
+ * Zeroes a histogram.
+ */
+void hist_init(histogram_t *hist);
+
+/**
+ * Records a value into a histogram.
+ *
+ * Inputs:
+ * - histogram_t *hist: the histogram
+ * - uint64_t value: the value to record
+ */
+void hist_record(histogram_t *hist, uint64_t value);
+
+/**
+ * Adds a live histogram's counts into a snapshot. Zero the snapshot first (e.g.
+ * with memset) to copy a single histogram.
+ *
+ * Inputs:
+ * - hist_snapshot_t *snap: the snapshot to add to
+ * - histogram_t *hist: the histogram to read
+ */
+void hist_merge(hist_snapshot_t *snap, histogram_t *hist);
+
+/**
+ * Computes what was recorded between two snapshots of the same histogram(s).
+ * The max can't be un-merged, so the later snapshot's max is kept.
+ *
+ * Inputs:
+ * - hist_snapshot_t *delta: where to store the difference
+ * - hist_snapshot_t *cur: the later snapshot
+ * - hist_snapshot_t *prev: the earlier snapshot
+ */
+void hist_diff(hist_snapshot_t *delta, hist_snapshot_t *cur,
+               hist_snapshot_t *prev);
+
+/**
+ * Estimates a percentile of a snapshot.
+ *
+ * Inputs:
+ * - hist_snapshot_t *snap: the snapshot
+ * - double pct: the desired percentile, in [0, 100]
+ *
+ * Returns:
+ * - the estimated value, or 0 if the snapshot is empty
+ */
+uint64_t hist_percentile(hist_snapshot_t *snap, double pct);
+
+/**
+ * Prints a one-line summary (count, mean, p50, p99, max) of a snapshot of
+ * nanosecond values, in microseconds.
+ *
+ * Inputs:
+ * - FILE *out: where to print
+ * - const char *name: label for the line
+ * - hist_snapshot_t *snap: the snapshot
+ */
+void hist_print_ns(FILE *out, const char *name, hist_snapshot_t *snap);
+
+/**
+ * Prints a snapshot as metric lines (see metrics.h): its count, sum, p50, p99
+ * and max, each on its own line.
+ *
+ * Inputs:
+ * - FILE *out: where to print
+ * - const char *name: the metric's name
+ * - const char *labels: the metric's labels (e.g. `station="0"`), or ""
+ * - hist_snapshot_t *snap: the snapshot
+ */
+void hist_print_metric(FILE *out, const char *name, const char *labels,
+                       hist_snapshot_t *snap);
+
+#endif
@@ -0,0 +1,124 @@
+#include "lock_profile.h"
+
+/**
+ * A lock the calling thread holds.
+ */
+typedef struct {
+  pthread_mutex_t *mtx; // the mutex
+  lock_site_t *site;    // where it was taken
+  uint64_t acquired_ns; // when it was taken (or last woken up with)
+} held_lock_t;
+
+static _Atomic(lock_site_t *) sites = NULL; // every site used so far
+
+static __thread held_lock_t held[LOCK_PROFILE_DEPTH];
+static __thread int num_held = 0;
+
+/**
+ * Puts a site on the list of sites, unless it's already there.
+ */
+static void register_site(lock_site_t *site) {
+  if (atomic_load_explicit(&site->registered, memory_order_relaxed))
+    return;
+  int expected = 0;
+  if (!atomic_compare_exchange_strong(&site->registered, &expected, 1))
+    return; // someone else got there first
+
+  site->next = atomic_load(&sites);
+  while (!atomic_compare_exchange_weak(&sites, &site->next, site))
+    ;
+}
+
+/**
+ * Finds a mutex among the calling thread's held locks.
+ *
+ * Returns:
+ * - its index in `held`, or -1 if it isn't being tracked
+ */
+static int find_held(pthread_mutex_t *mtx) {
+  // locks are mostly released in reverse order, so start at the top
+  for (int i = num_held - 1; i >= 0; i--)
+    if (held[i].mtx == mtx)
+      return i;
+  return -1;
+}
+
+void lock_site_acquire(lock_site_t *site, pthread_mutex_t *mtx) {
+  register_site(site);
+
+  // only time the wait when there is one; the uncontended path is a trylock
+  // and a single clock read
+  uint64_t acquired_ns;
+  if (pthread_mutex_trylock(mtx) == 0) {
+    acquired_ns = get_time_ns();
+    hist_record(&site->wait_ns, 0);
+  } else {
+    uint64_t start = get_time_ns();
+    pthread_mutex_lock(mtx);
+    acquired_ns = get_time_ns();
+    atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+    hist_record(&site->wait_ns, acquired_ns - start);
+  }
+  atomic_fetch_add_explicit(&site->acquisitions, 1, memory_order_relaxed);
+
+  // if we're holding too many to track, the hold just goes unrecorded
+  if (num_held < LOCK_PROFILE_DEPTH)
+    held[num_held++] =
+        (held_lock_t){.mtx = mtx, .site = site, .acquired_ns = acquired_ns};
+}
+
+void lock_site_release(pthread_mutex_t *mtx) {
+  int i = find_held(mtx);
+  if (i >= 0) {
+    hist_record(&held[i].site->hold_ns, get_time_ns() - held[i].acquired_ns);
+    memmove(&held[i], &held[i + 1], (num_held - i - 1) * sizeof(held_lock_t));
+    num_held--;
+  }
+  pthread_mutex_unlock(mtx);
+}
+
+int lock_site_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx,
+                        const struct timespec *abstime) {
+  int i = find_held(mtx);
+  if (i >= 0)
+    hist_record(&held[i].site->hold_ns, get_time_ns() - held[i].acquired_ns);
+
+  int ret = abstime == NULL ? pthread_cond_wait(cond, mtx)
+                            : pthread_cond_timedwait(cond, mtx, abstime);
+
+  // this thread took no other locks while asleep, so `i` still stands
+  if (i >= 0)
+    held[i].acquired_ns = get_time_ns();
+  return ret;
+}
+
+void get_lock_waits(hist_snapshot_t *snap) {
+  for (lock_site_t *site = atomic_load(&sites); site != NULL;
+       site = site->next)
+    hist_merge(snap, &site->wait_ns);
+}
+
+void print_lock_profile(FILE *out) {
+  if (!LOCK_PROFILE_ENABLED) {
+    fprintf(out, "lock profiling is not built in (build with `make "
+                 "LOCK_PROFILE=1`)\n");
+    return;
+  }
+
+  for (lock_site_t *site = atomic_load(&sites); site != NULL;
+       site = site->next) {
+    uint64_t acquisitions = atomic_load(&site->acquisitions);
+    uint64_t contended = atomic_load(&site->contended);
+    fprintf(out, "%s: %lu acquisitions, %lu contended (%.2f%%)\n", site->name,
+            acquisitions, contended,
+            acquisitions ? contended * 100.0 / acquisitions : 0);
+
+    hist_snapshot_t snap;
+    memset(&snap, 0, sizeof(snap));
+    hist_merge(&snap, &site->wait_ns);
+    hist_print_ns(out, "  wait", &snap);
+    memset(&snap, 0, sizeof(snap));
+    hist_merge(&snap, &site->hold_ns);
+    hist_print_ns(out, "  hold", &snap);
+  }
+}
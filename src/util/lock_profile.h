@@ -0,0 +1,126 @@
+#ifndef __LOCK_PROFILE_H__
+#define __LOCK_PROFILE_H__
+
+#include <stdatomic.h>
+
+#include "histogram.h"
+#include "util.h"
+
+/**
+ * Lock contention profiling, for finding out which of the server's mutexes are
+ * worth splitting (or getting rid of).
+ *
+ * It's only built in with `make LOCK_PROFILE=1` (i.e. -DLOCK_PROFILE); in a
+ * normal build, the profiled_* macros are plain pthread calls and cost nothing.
+ * In a profiling build, each place that takes a lock names a site, and every
+ * acquisition there records whether it had to wait, how long it waited, and
+ * how long the lock was then held. Sites are static, and put themselves on a
+ * global list the first time they're used, so there's nothing to set up.
+ *
+ * Hold times are tracked per thread: each thread remembers the locks it holds
+ * (up to LOCK_PROFILE_DEPTH at once), and when each was acquired. Waiting on a
+ * condition variable ends a hold, and reacquiring the mutex on wakeup starts a
+ * new one (whose wait isn't measured; it can't be told apart from the sleep).
+ */
+
+#define LOCK_PROFILE_DEPTH 8 // locks a thread can hold at once and still time
+
+/**
+ * A place that takes a lock. Every field but `name` starts zeroed.
+ */
+typedef struct lock_site {
+  const char *name;          // what to report the site as
+  struct lock_site *next;    // next site on the list of sites used so far
+  atomic_int registered;     // whether it's on the list yet
+  atomic_ulong acquisitions; // times the lock was taken here
+  atomic_ulong contended;    // ...of which it was already held
+  histogram_t wait_ns;       // time spent waiting for the lock
+  histogram_t hold_ns;       // time the lock was then held for
+} lock_site_t;
+
+#ifdef LOCK_PROFILE
+
+#define LOCK_PROFILE_ENABLED 1
+
+#define profiled_lock(mtx, site_name)                                          \
+  do {                                                                         \
+    static lock_site_t site_ = {.name = (site_name)};                          \
+    lock_site_acquire(&site_, (mtx));                                          \
+  } while (0)
+
+#define profiled_unlock(mtx) lock_site_release((mtx))
+
+#define profiled_cond_wait(cond, mtx) lock_site_cond_wait((cond), (mtx), NULL)
+
+#define profiled_cond_timedwait(cond, mtx, abstime)                            \
+  lock_site_cond_wait((cond), (mtx), (abstime))
+
+#else
+
+#define LOCK_PROFILE_ENABLED 0
+
+#define profiled_lock(mtx, site_name) pthread_mutex_lock((mtx))
+
+#define profiled_unlock(mtx) pthread_mutex_unlock((mtx))
+
+#define profiled_cond_wait(cond, mtx) pthread_cond_wait((cond), (mtx))
+
+#define profiled_cond_timedwait(cond, mtx, abstime)                            \
+  pthread_cond_timedwait((cond), (mtx), (abstime))
+
+#endif
+
+/**
+ * Locks a mutex, recording the acquisition against a site. Use profiled_lock
+ * rather than calling this directly.
+ *
+ * Inputs:
+ * - lock_site_t *site: the site taking the lock
+ * - pthread_mutex_t *mtx: the mutex
+ */
+void lock_site_acquire(lock_site_t *site, pthread_mutex_t *mtx);
+
+/**
+ * Unlocks a mutex, recording how long it was held if it was locked through
+ * lock_site_acquire. Use profiled_unlock rather than calling this directly.
+ *
+ * Inputs:
+ * - pthread_mutex_t *mtx: the mutex
+ */
+void lock_site_release(pthread_mutex_t *mtx);
+
+/**
+ * Waits on a condition variable, ending the mutex's current hold and starting
+ * a new one on wakeup. Use profiled_cond_wait or profiled_cond_timedwait
+ * rather than calling this directly.
+ *
+ * Inputs:
+ * - pthread_cond_t *cond: the condition variable
+ * - pthread_mutex_t *mtx: the mutex, locked by the caller
+ * - const struct timespec *abstime: when to give up, or NULL to wait forever
+ *
+ * Returns:
+ * - whatever pthread_cond_wait or pthread_cond_timedwait returned
+ */
+int lock_site_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx,
+                        const struct timespec *abstime);
+
+/**
+ * Adds up the wait times of every site used so far. Without LOCK_PROFILE,
+ * there are no sites, so nothing is added.
+ *
+ * Inputs:
+ * - hist_snapshot_t *snap: the snapshot to add to
+ */
+void get_lock_waits(hist_snapshot_t *snap);
+
+/**
+ * Prints every site used so far: its acquisitions, how many were contended,
+ * and its wait and hold times.
+ *
+ * Inputs:
+ * - FILE *out: where to print
+ */
+void print_lock_profile(FILE *out);
+
+#endif
@@ -0,0 +1,269 @@
+#include "log.h"
+
+/**
+ * A buffered line.
+ */
+typedef struct {
+  log_level_t level;       // the line's severity
+  char text[LOG_LINE_MAX]; // the line, without a newline
+} log_entry_t;
+
+/**
+ * A thread's lines. Only the owner writes entries and `head`; only the flusher
+ * moves `tail`.
+ */
+typedef struct {
+  list_link_t link;                   // for the list of rings
+  atomic_ulong head;                  // lines logged so far
+  atomic_ulong tail;                  // lines written out so far
+  atomic_ulong dropped;               // lines dropped for lack of room
+  atomic_int orphaned;                // its thread exited; free once drained
+  log_entry_t entries[LOG_RING_SIZE]; // the lines not yet written out
+} log_ring_t;
+
+static const char *level_names[NUM_LOG_LEVELS] = {
+    [LOG_LEVEL_DEBUG] = "debug",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_WARN] = "warn",
+    [LOG_LEVEL_ERROR] = "error",
+};
+
+static atomic_int min_level = LOG_LEVEL_INFO;
+static atomic_int running = 0; // whether lines go through the rings
+
+// every thread's ring, guarded by rings_mtx (only taken to add a ring, and by
+// the flusher)
+static pthread_mutex_t rings_mtx = PTHREAD_MUTEX_INITIALIZER;
+static list_t rings;
+static pthread_key_t ring_key;
+static pthread_once_t rings_once = PTHREAD_ONCE_INIT;
+static int rings_ready = 0;
+
+// the flusher, and how to stop it
+static pthread_t flusher;
+static pthread_mutex_t flush_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static int flush_stopped = 0;
+
+/**
+ * Destructor for a thread's ring; runs when the thread exits. The flusher
+ * frees it once it's written out what's left.
+ */
+static void orphan_ring(void *arg) {
+  atomic_store(&((log_ring_t *)arg)->orphaned, 1);
+}
+
+static void init_rings(void) {
+  list_init(&rings);
+  int ret = pthread_key_create(&ring_key, orphan_ring);
+  if (ret) {
+    errno = ret;
+    perror("init_rings: pthread_key_create");
+    return;
+  }
+  rings_ready = 1;
+}
+
+/**
+ * Gets (or creates) the calling thread's ring.
+ *
+ * Returns:
+ * - the ring, or NULL on failure
+ */
+static log_ring_t *get_ring(void) {
+  pthread_once(&rings_once, init_rings);
+  if (!rings_ready)
+    return NULL;
+
+  log_ring_t *ring = pthread_getspecific(ring_key);
+  if (ring != NULL)
+    return ring;
+
+  ring = malloc(sizeof(log_ring_t));
+  if (ring == NULL)
+    return NULL; // the caller logs synchronously instead
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->dropped, 0);
+  atomic_init(&ring->orphaned, 0);
+  if (pthread_setspecific(ring_key, ring)) {
+    free(ring);
+    return NULL;
+  }
+  pthread_mutex_lock(&rings_mtx);
+  list_insert_tail(&rings, &ring->link);
+  pthread_mutex_unlock(&rings_mtx);
+  return ring;
+}
+
+/**
+ * Applies a call site's rate limit.
+ *
+ * Returns:
+ * - 1 if the line may be logged (with the number of lines the site dropped
+ * before it in `suppressed`), 0 if it's dropped
+ */
+static int site_allow(log_site_t *site, unsigned long *suppressed) {
+  uint64_t now = get_time_ns();
+  uint64_t window =
+      atomic_load_explicit(&site->window_ns, memory_order_relaxed);
+  // whoever starts the new interval resets the count; racing with another
+  // thread here only lets a line or two more through
+  if (now - window >= LOG_SITE_INTERVAL_MS * 1000000ULL &&
+      atomic_compare_exchange_strong(&site->window_ns, &window, now))
+    atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+
+  if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >=
+      LOG_SITE_BURST) {
+    atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+    return 0;
+  }
+  *suppressed = atomic_exchange_explicit(&site->suppressed, 0,
+                                         memory_order_relaxed);
+  return 1;
+}
+
+/**
+ * Formats a line into a buffer, noting how many lines it stands in for.
+ */
+static void format_line(char *buf, size_t size, unsigned long suppressed,
+                        const char *fmt, va_list args) {
+  int n = vsnprintf(buf, size, fmt, args);
+  if (suppressed > 0 && n >= 0 && (size_t)n < size)
+    snprintf(buf + n, size - n, " (%lu similar messages suppressed)",
+             suppressed);
+}
+
+void log_write(log_site_t *site, log_level_t level, const char *fmt, ...) {
+  if (level < atomic_load_explicit(&min_level, memory_order_relaxed))
+    return;
+  unsigned long suppressed;
+  if (!site_allow(site, &suppressed))
+    return;
+
+  va_list args;
+  va_start(args, fmt);
+  log_ring_t *ring = atomic_load(&running) ? get_ring() : NULL;
+  if (ring == NULL) {
+    // nobody's flushing, so write it out ourselves
+    char line[LOG_LINE_MAX];
+    format_line(line, sizeof(line), suppressed, fmt, args);
+    fprintf(level >= LOG_LEVEL_WARN ? stderr : stdout, "%s\n", line);
+    va_end(args);
+    return;
+  }
+
+  // only we move head, and the flusher only moves tail forward
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail == LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    va_end(args);
+    return;
+  }
+  log_entry_t *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+  entry->level = level;
+  format_line(entry->text, sizeof(entry->text), suppressed, fmt, args);
+  va_end(args);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void set_log_level(log_level_t level) { atomic_store(&min_level, level); }
+
+int parse_log_level(const char *name) {
+  for (int i = 0; i < NUM_LOG_LEVELS; i++)
+    if (strcmp(name, level_names[i]) == 0)
+      return i;
+  return -1;
+}
+
+/**
+ * Writes out every ring, freeing those whose threads have exited. Only the
+ * flusher (or stop_logging, once the flusher is gone) may call this.
+ */
+static void flush_rings(void) {
+  pthread_mutex_lock(&rings_mtx);
+  log_ring_t *ring;
+  list_iterate_begin(&rings, ring, log_ring_t, link) {
+    // check before draining, so lines logged just before exiting aren't lost
+    int orphaned = atomic_load(&ring->orphaned);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (; tail < head; tail++) {
+      log_entry_t *entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+      fprintf(entry->level >= LOG_LEVEL_WARN ? stderr : stdout, "%s\n",
+              entry->text);
+    }
+    // the entries must be written out before the owner may reuse them
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    unsigned long dropped = atomic_exchange(&ring->dropped, 0);
+    if (dropped > 0)
+      fprintf(stderr, "[log] Dropped %lu lines; the log couldn't keep up.\n",
+              dropped);
+    if (orphaned) {
+      list_remove(&ring->link);
+      free(ring);
+    }
+  }
+  list_iterate_end();
+  pthread_mutex_unlock(&rings_mtx);
+  fflush(stdout);
+  fflush(stderr);
+}
+
+/**
+ * The flusher: writes out every ring each LOG_FLUSH_MS, until stopped.
+ */
+static void *flush_loop(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&flush_mtx);
+  while (!flush_stopped) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&flush_cond, &flush_mtx, &deadline);
+
+    pthread_mutex_unlock(&flush_mtx);
+    flush_rings();
+    pthread_mutex_lock(&flush_mtx);
+  }
+  pthread_mutex_unlock(&flush_mtx);
+  return NULL;
+}
+
+int start_logging(void) {
+  pthread_once(&rings_once, init_rings);
+  if (!rings_ready)
+    return -1;
+
+  flush_stopped = 0;
+  int ret = pthread_create(&flusher, NULL, flush_loop, NULL);
+  if (ret) {
+    errno = ret;
+    perror("start_logging: pthread_create");
+    return -1;
+  }
+  atomic_store(&running, 1);
+  return 0;
+}
+
+void stop_logging(void) {
+  if (!atomic_exchange(&running, 0))
+    return;
+
+  pthread_mutex_lock(&flush_mtx);
+  flush_stopped = 1;
+  pthread_cond_signal(&flush_cond);
+  pthread_mutex_unlock(&flush_mtx);
+  int ret = pthread_join(flusher, NULL);
+  if (ret)
+    handle_error_en(ret, "stop_logging: pthread_join");
+
+  // whatever came in while the flusher was finishing up
+  flush_rings();
+}
@@ -0,0 +1,110 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdatomic.h>
+
+#include "util.h"
+
+/**
+ * Asynchronous, rate-limited logging, so that a storm (of connections, bad
+ * commands, or failing listeners) doesn't turn into threads queueing up on
+ * stdio's locks.
+ *
+ * Each thread formats its lines into a ring of its own, which only it writes
+ * and only the flusher thread reads: logging is a vsnprintf and a release
+ * store, never a lock. The flusher drains every ring each LOG_FLUSH_MS, and
+ * writes warnings and errors to stderr, everything else to stdout. If a ring
+ * fills up faster than that, further lines are dropped (and counted) rather
+ * than waited on. Lines from different threads may come out of order within a
+ * flush.
+ *
+ * Every call site is also rate limited on its own: beyond LOG_SITE_BURST lines
+ * per LOG_SITE_INTERVAL_MS, lines are dropped, and the next line the site gets
+ * to log says how many were.
+ *
+ * Until start_logging (or after stop_logging), lines are written right away,
+ * as before; programs that never start it just log synchronously.
+ */
+
+#define LOG_RING_SIZE 256         // lines buffered per thread; a power of 2
+#define LOG_LINE_MAX 512          // longest line; longer ones are truncated
+#define LOG_FLUSH_MS 50           // how often the flusher drains the rings
+#define LOG_SITE_BURST 20         // lines a call site may log per interval...
+#define LOG_SITE_INTERVAL_MS 1000 // ...of this long
+
+typedef enum {
+  LOG_LEVEL_DEBUG,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_ERROR,
+  NUM_LOG_LEVELS
+} log_level_t;
+
+/**
+ * A call site's rate limit. Starts zeroed; log_debug and friends make one per
+ * call site.
+ */
+typedef struct {
+  atomic_ulong window_ns;  // when the current interval started
+  atomic_uint count;       // lines logged (or tried) in the interval
+  atomic_ulong suppressed; // lines dropped since the site last logged
+} log_site_t;
+
+#define log_at(level, ...)                                                     \
+  do {                                                                         \
+    static log_site_t log_site_;                                               \
+    log_write(&log_site_, (level), __VA_ARGS__);                               \
+  } while (0)
+
+// a line (without the trailing newline) at each level
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/**
+ * Logs a line from a call site. Use log_debug and friends rather than calling
+ * this directly.
+ *
+ * Inputs:
+ * - log_site_t *site: the call site
+ * - log_level_t level: the line's severity
+ * - const char *fmt, ...: the line, printf-style, without a newline
+ */
+void log_write(log_site_t *site, log_level_t level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * Sets the least severe level that gets logged (LOG_LEVEL_INFO by default).
+ *
+ * Inputs:
+ * - log_level_t level: the level
+ */
+void set_log_level(log_level_t level);
+
+/**
+ * Parses a level's name ("debug", "info", "warn" or "error").
+ *
+ * Inputs:
+ * - const char *name: the name
+ *
+ * Returns:
+ * - the level, or -1 if there's no such level
+ */
+int parse_log_level(const char *name);
+
+/**
+ * Starts the flusher thread; from then on, lines are logged asynchronously.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure (in which case logging stays synchronous)
+ */
+int start_logging(void);
+
+/**
+ * Stops the flusher thread, after it's written out everything logged so far.
+ * Lines logged after this are written right away.
+ */
+void stop_logging(void);
+
+#endif
@@ -0,0 +1,147 @@
+#include "metrics.h"
+
+static const char *metric_names[NUM_METRICS] = {
+    [METRIC_ACCEPTS] = "snowcast_accepts_total",
+    [METRIC_HANDSHAKES] = "snowcast_handshakes_total",
+    [METRIC_HANDSHAKE_TIMEOUTS] = "snowcast_handshake_timeouts_total",
+    [METRIC_SET_STATIONS] = "snowcast_set_stations_total",
+    [METRIC_STATIONS_FULL] = "snowcast_stations_full_total",
+    [METRIC_INVALID_COMMANDS] = "snowcast_invalid_commands_total",
+    [METRIC_DISCONNECTS] = "snowcast_disconnects_total",
+};
+
+static const char *timer_names[NUM_TIMERS] = {
+    [TIMER_HANDSHAKE] = "snowcast_handshake_ns",
+    [TIMER_SET_STATION] = "snowcast_set_station_ns",
+    [TIMER_FIRST_DATAGRAM] = "snowcast_first_datagram_ns",
+};
+
+// live shards, and the totals of shards whose threads exited
+static pthread_mutex_t shards_mtx = PTHREAD_MUTEX_INITIALIZER;
+static list_t shards;
+static metrics_snapshot_t retired;
+static pthread_key_t shard_key;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static int shards_ready = 0;
+
+// counters are only ever written by their owning thread, so a relaxed
+// load/store pair is enough; readers may just see a slightly stale value
+static inline void counter_add(atomic_ulong *counter, uint64_t n) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+/**
+ * Adds a shard's counters and timers to a snapshot.
+ */
+static void merge_shard(metrics_snapshot_t *snap, metrics_shard_t *shard) {
+  for (int i = 0; i < NUM_METRICS; i++)
+    snap->counters[i] +=
+        atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+  for (int i = 0; i < NUM_TIMERS; i++)
+    hist_merge(&snap->timers[i], &shard->timers[i]);
+}
+
+/**
+ * Destructor for a thread's shard; runs when the thread exits. Folds the
+ * shard into the totals.
+ */
+static void destroy_shard(void *arg) {
+  metrics_shard_t *shard = (metrics_shard_t *)arg;
+
+  pthread_mutex_lock(&shards_mtx);
+  list_remove(&shard->link);
+  merge_shard(&retired, shard);
+  pthread_mutex_unlock(&shards_mtx);
+
+  free(shard);
+}
+
+static void init_shards(void) {
+  list_init(&shards);
+  int ret = pthread_key_create(&shard_key, destroy_shard);
+  if (ret) {
+    errno = ret;
+    perror("init_shards: pthread_key_create");
+    return;
+  }
+  shards_ready = 1;
+}
+
+/**
+ * Gets (or creates) the calling thread's shard.
+ *
+ * Returns:
+ * - the shard, or NULL on failure
+ */
+static metrics_shard_t *get_shard(void) {
+  pthread_once(&shards_once, init_shards);
+  if (!shards_ready)
+    return NULL;
+
+  metrics_shard_t *shard = pthread_getspecific(shard_key);
+  if (shard != NULL)
+    return shard;
+
+  shard = calloc(1, sizeof(metrics_shard_t));
+  if (shard == NULL) {
+    fprintf(stderr, "[get_shard] Failed to malloc metrics shard.\n");
+    return NULL;
+  }
+  for (int i = 0; i < NUM_TIMERS; i++)
+    hist_init(&shard->timers[i]);
+
+  pthread_mutex_lock(&shards_mtx);
+  list_insert_tail(&shards, &shard->link);
+  pthread_mutex_unlock(&shards_mtx);
+
+  if (pthread_setspecific(shard_key, shard)) {
+    fprintf(stderr, "[get_shard] Failed to set metrics shard.\n");
+    pthread_mutex_lock(&shards_mtx);
+    list_remove(&shard->link);
+    pthread_mutex_unlock(&shards_mtx);
+    free(shard);
+    return NULL;
+  }
+  return shard;
+}
+
+void metric_add(metric_t metric, uint64_t n) {
+  metrics_shard_t *shard = get_shard();
+  if (shard != NULL)
+    counter_add(&shard->counters[metric], n);
+}
+
+void metric_time(metric_timer_t timer, uint64_t ns) {
+  metrics_shard_t *shard = get_shard();
+  if (shard != NULL)
+    hist_record(&shard->timers[timer], ns);
+}
+
+void get_metrics(metrics_snapshot_t *snap) {
+  pthread_once(&shards_once, init_shards);
+
+  pthread_mutex_lock(&shards_mtx);
+  *snap = retired;
+  metrics_shard_t *shard;
+  list_iterate_begin(&shards, shard, metrics_shard_t, link) {
+    merge_shard(snap, shard);
+  }
+  list_iterate_end();
+  pthread_mutex_unlock(&shards_mtx);
+}
+
+const char *metric_name(metric_t metric) { return metric_names[metric]; }
+
+const char *timer_name(metric_timer_t timer) { return timer_names[timer]; }
+
+void print_metrics(FILE *out) {
+  metrics_snapshot_t snap;
+  get_metrics(&snap);
+
+  for (int i = 0; i < NUM_METRICS; i++)
+    fprintf(out, "%s %lu\n", metric_names[i], snap.counters[i]);
+  for (int i = 0; i < NUM_TIMERS; i++)
+    hist_print_metric(out, timer_names[i], "", &snap.timers[i]);
+}
@@ -0,0 +1,117 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdatomic.h>
+
+#include "histogram.h"
+#include "util.h"
+
+/**
+ * Control-plane counters and timers (accepts, handshakes, station switches).
+ * These are recorded by whichever thread happens to handle a client, so each
+ * thread records into its own shard: recording is a relaxed load/store on a
+ * cache line nobody else writes, never a contended atomic. When a thread exits,
+ * its shard is folded into the totals, like slab caches are.
+ *
+ * Everything is reported in a simple text format, one metric per line:
+ * `name{labels} value`. Counters end in `_total`; timers are in nanoseconds,
+ * and are reported as their count, sum, p50, p99 and max (see
+ * hist_print_metric). Stations, the egress budget and the thread pool report
+ * their own metrics in the same format.
+ */
+
+typedef enum {
+  METRIC_ACCEPTS,            // connections accepted
+  METRIC_HANDSHAKES,         // Hellos answered with a Welcome
+  METRIC_HANDSHAKE_TIMEOUTS, // connections that never said Hello
+  METRIC_SET_STATIONS,       // SetStation commands that switched stations
+  METRIC_STATIONS_FULL,      // SetStation commands refused by the budget
+  METRIC_INVALID_COMMANDS,   // commands answered with an InvalidCommand
+  METRIC_DISCONNECTS,        // clients removed, for whatever reason
+  NUM_METRICS
+} metric_t;
+
+typedef enum {
+  TIMER_HANDSHAKE,      // from accepting a connection to its Welcome
+  TIMER_SET_STATION,    // from a SetStation being ready to its reply
+  TIMER_FIRST_DATAGRAM, // ...and to the listener's first datagram from the
+                        // new station
+  NUM_TIMERS
+} metric_timer_t;
+
+/**
+ * A thread's counters and timers. Only written by the owning thread.
+ */
+typedef struct {
+  list_link_t link;                   // for the list of live shards
+  atomic_ulong counters[NUM_METRICS]; // counted by this thread
+  histogram_t timers[NUM_TIMERS];     // timed by this thread
+} metrics_shard_t;
+
+/**
+ * Sum of every shard, live or folded in.
+ */
+typedef struct {
+  uint64_t counters[NUM_METRICS];     // total counts
+  hist_snapshot_t timers[NUM_TIMERS]; // total timings
+} metrics_snapshot_t;
+
+/**
+ * Adds to a counter. If the calling thread's shard can't be allocated, the
+ * count is dropped.
+ *
+ * Inputs:
+ * - metric_t metric: the counter
+ * - uint64_t n: how much to add
+ */
+void metric_add(metric_t metric, uint64_t n);
+
+/**
+ * Records a timing.
+ *
+ * Inputs:
+ * - metric_timer_t timer: the timer
+ * - uint64_t ns: the time taken, in nanoseconds
+ */
+void metric_time(metric_timer_t timer, uint64_t ns);
+
+/**
+ * Sums every shard. Live shards are read without stopping their threads, so
+ * the snapshot is only approximately consistent.
+ *
+ * Inputs:
+ * - metrics_snapshot_t *snap: where to store the totals
+ */
+void get_metrics(metrics_snapshot_t *snap);
+
+/**
+ * Gets the name a counter is reported under.
+ *
+ * Inputs:
+ * - metric_t metric: the counter
+ *
+ * Returns:
+ * - its name, e.g. "snowcast_accepts_total"
+ */
+const char *metric_name(metric_t metric);
+
+/**
+ * Gets the name a timer is reported under.
+ *
+ * Inputs:
+ * - metric_timer_t timer: the timer
+ *
+ * Returns:
+ * - its name, e.g. "snowcast_handshake_ns"
+ */
+const char *timer_name(metric_timer_t timer);
+
+/**
+ * Prints the control-plane metrics.
+ *
+ * Inputs:
+ * - FILE *out: where to print
+ */
+void print_metrics(FILE *out);
+
+#endif
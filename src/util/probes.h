@@ -0,0 +1,71 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/**
+ * USDT (statically defined tracing) probes, for tracing a live server with
+ * bpftrace, perf or SystemTap without rebuilding or restarting it, e.g.
+ *
+ *   bpftrace -e 'usdt:./snowcast_server:snowcast:tick__end { @[arg0] =
+ *                hist(arg3); }'
+ *
+ * A probe is a single nop in the code, plus a note in the binary telling
+ * tracers where it is and where its arguments live; attaching a tracer turns
+ * the nop into a breakpoint. So probes cost nothing when nobody's tracing, as
+ * long as their arguments are values we have at hand anyway (they're computed
+ * either way).
+ *
+ * Probes need <sys/sdt.h> (systemtap-sdt-dev on Debian, systemtap-sdt-devel
+ * on Fedora). Without it, or with -DSNOWCAST_NO_PROBES, they compile to
+ * nothing, and their arguments aren't evaluated at all.
+ *
+ * Every probe is in the `snowcast` provider:
+ * - tick__start(station, scheduled_ns, wake_ns)
+ * - tick__end(station, listeners, sent, tick_ns)
+ * - fanout__batch(station, fd, batch, sent): one sendmmsg batch
+ * - conn__accept(count): a batch of accepted connections
+ * - conn__handshake(fd, handshake_ns): a Hello answered with a Welcome
+ * - command__receive(fd, type): a complete command from a client
+ * - station__switch(fd, station, result, ns): a SetStation answered; result
+ *   is swap_stations's
+ * - job__enqueue(prio, job): job is only an id; it may already have run
+ * - job__dequeue(prio, job, wait_ns): a worker starting a job
+ */
+
+#if defined(__has_include) && !defined(SNOWCAST_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#define SNOWCAST_PROBES 1
+#endif
+#endif
+
+#ifdef SNOWCAST_PROBES
+
+#include <sys/sdt.h>
+
+#define probe1(name, a) DTRACE_PROBE1(snowcast, name, a)
+#define probe2(name, a, b) DTRACE_PROBE2(snowcast, name, a, b)
+#define probe3(name, a, b, c) DTRACE_PROBE3(snowcast, name, a, b, c)
+#define probe4(name, a, b, c, d) DTRACE_PROBE4(snowcast, name, a, b, c, d)
+
+#else
+
+// sizeof keeps arguments "used" without evaluating them
+#define probe1(name, a)                                                        \
+  do {                                                                         \
+    (void)sizeof(a);                                                           \
+  } while (0)
+#define probe2(name, a, b)                                                     \
+  do {                                                                         \
+    (void)sizeof(a), (void)sizeof(b);                                          \
+  } while (0)
+#define probe3(name, a, b, c)                                                  \
+  do {                                                                         \
+    (void)sizeof(a), (void)sizeof(b), (void)sizeof(c);                         \
+  } while (0)
+#define probe4(name, a, b, c, d)                                               \
+  do {                                                                         \
+    (void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d);        \
+  } while (0)
+
+#endif
+
+#endif
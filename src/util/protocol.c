@@ -77,38 +77,69 @@ void *recv_command_msg(int sockfd, uint8_t *reply, int *res) {
   }
 }
 
-int send_reply_msg(int sockfd, uint8_t cmd, uint16_t val, const char *msg) {
+int recv_command_msg_nb(int sockfd, command_buf_t *in, command_t *cmd) {
+  // only read what's missing, so we never eat into the next command
+  while (in->len < COMMAND_SIZE) {
+    ssize_t n = recv(sockfd, in->buf + in->len, COMMAND_SIZE - in->len, 0);
+    if (n == 0) {
+      log_info("[Socket %d] closed the connection.", sockfd);
+      return 1;
+    }
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      log_warn("[recv_command_msg_nb] recv: %s", strerror(errno));
+      return -2;
+    }
+    in->len += n;
+  }
+
+  // don't wait for the rest of an invalid command
+  cmd->command_type = in->buf[0];
+  if (in->len > 0 && cmd->command_type != MESSAGE_HELLO &&
+      cmd->command_type != MESSAGE_SET_STATION)
+    return -1;
+  if (in->len < COMMAND_SIZE)
+    return 2;
+
+  // complete! Both commands have the same layout, so this sets either's value
+  uint16_t val;
+  memcpy(&val, in->buf + 1, sizeof(val));
+  in->len = 0;
+  cmd->hello.udp_port = ntohs(val);
+  return 0;
+}
+
+int pack_reply_msg(uint8_t *buf, uint8_t cmd, uint16_t val, const char *msg) {
   if (cmd == REPLY_WELCOME) {
     welcome_t welcome = {cmd, htons(val)};
-    int len = sizeof(welcome);
-    if (sendall(sockfd, &welcome, len)) {
-      /* fprintf(stderr, "[send_reply_msg] Refer to error messages above.\n");
-       */
-      return -1;
-    }
+    memcpy(buf, &welcome, sizeof(welcome));
+    return sizeof(welcome);
   } else if (cmd == REPLY_ANNOUNCE || cmd == REPLY_INVALID) {
     // since they're the same structure, we follow the same procedures for both.
     // TODO: change if we want to adjust spec
     uint8_t str_size = (uint8_t)val;
-    size_t size = sizeof(announce_t) + str_size * sizeof(char);
-    announce_t *announce = malloc(size);
-    if (announce == NULL) {
-      /* fprintf(stderr, "[send_reply_msg] Could not malloc command %d.\n",
-       * cmd); */
-      return -1;
-    }
+    announce_t *announce = (announce_t *)buf;
     announce->reply_type = cmd;
     announce->songname_size = str_size;
     memcpy(announce->songname, msg, str_size);
-    if (sendall(sockfd, announce, size)) {
-      /* fprintf(stderr, "[send_reply_msg] Refer to error messages above.\n");
-       */
-      free(announce);
-      return -1;
-    }
-    free(announce);
-  } else {
-    fprintf(stderr, "[send_reply_msg] Invalid command type %d.\n", cmd);
+    return sizeof(announce_t) + str_size * sizeof(char);
+  }
+  fprintf(stderr, "[pack_reply_msg] Invalid command type %d.\n", cmd);
+  return -1;
+}
+
+int send_reply_msg(int sockfd, uint8_t cmd, uint16_t val, const char *msg) {
+  // replies are small, so they're built on the stack
+  uint8_t buf[MAXREPLYSIZE];
+  int size = pack_reply_msg(buf, cmd, val, msg);
+  if (size == -1)
+    return -1;
+  if (sendall(sockfd, buf, size)) {
+    /* fprintf(stderr, "[send_reply_msg] Refer to error messages above.\n");
+     */
     return -1;
   }
   return 0;
@@ -1,6 +1,8 @@
 #ifndef __PROTOCOL_H__
 #define __PROTOCOL_H__
 
+#include "log.h"
+#include "slab.h"
 #include "util.h"
 
 /*
@@ -19,6 +21,27 @@ typedef struct __attribute__((packed)) {
   uint16_t station_number;
 } set_station_t;
 
+// every command is a type followed by a 2-byte value
+#define COMMAND_SIZE sizeof(hello_t)
+
+/**
+ * A decoded command of either type; they share a layout, so the type can be
+ * read before deciding which member to use.
+ */
+typedef union {
+  uint8_t command_type;      // MESSAGE_HELLO or MESSAGE_SET_STATION
+  hello_t hello;             // if a Hello
+  set_station_t set_station; // if a SetStation
+} command_t;
+
+/**
+ * Bytes of a command received so far from a non-blocking socket.
+ */
+typedef struct {
+  uint8_t buf[COMMAND_SIZE]; // the partial command
+  size_t len;                // number of bytes in buf
+} command_buf_t;
+
 /*
  * REPLIES
  */
@@ -43,6 +66,20 @@ typedef struct __attribute__((packed)) {
   char reply_string[];
 } invalid_command_t;
 
+/*
+ * LISTENER KEEPALIVES
+ *
+ * A listener sends one of these back to wherever its stream comes from every
+ * KEEPALIVE_INTERVAL_MS, so the server can tell listeners that died (or whose
+ * control client vanished without closing) from ones that are still there.
+ */
+#define MESSAGE_KEEPALIVE 3
+#define KEEPALIVE_INTERVAL_MS 1000
+
+typedef struct __attribute__((packed)) {
+  uint8_t keepalive_type;
+} keepalive_t;
+
 /**
  * Sends a command message.
  *
@@ -71,6 +108,24 @@ int send_command_msg(int sockfd, uint8_t cmd, uint16_t val);
  */
 void *recv_command_msg(int sockfd, uint8_t *reply, int *res);
 
+/**
+ * Receives a command message from a non-blocking socket, without waiting for
+ * the rest of it: whatever is available is kept in `in` until the command is
+ * complete. Nothing is allocated; the command is decoded into `cmd`.
+ *
+ * Inputs:
+ * - int sockfd: the connection socket (non-blocking)
+ * - command_buf_t *in: the bytes received so far; reset once complete
+ * - command_t *cmd: where to store the command (values IN HOST BYTE ORDER).
+ * Its type is set whenever one was received, even for an invalid command.
+ *
+ * Returns:
+ * - 0 on success, 1 if the client disconnected, 2 if the command isn't
+ * complete yet (try again once the socket is readable), -1 if the command type
+ * is invalid, or -2 if the socket failed (e.g. the client reset it)
+ */
+int recv_command_msg_nb(int sockfd, command_buf_t *in, command_t *cmd);
+
 /**
  * Sends a reply message.
  *
@@ -85,6 +140,23 @@ void *recv_command_msg(int sockfd, uint8_t *reply, int *res);
  */
 int send_reply_msg(int sockfd, uint8_t cmd, uint16_t val, const char *msg);
 
+// largest reply on the wire: an Announce/Invalid with a 255 byte string
+#define MAXREPLYSIZE (sizeof(announce_t) + UINT8_MAX)
+
+/**
+ * Serializes a reply message, exactly as send_reply_msg would send it.
+ *
+ * Inputs:
+ * - uint8_t *buf: where to store the reply; must hold MAXREPLYSIZE bytes
+ * - uint8_t cmd: the type of the reply
+ * - uint16_t val: the value of the reply, IN HOST BYTE ORDER
+ * - char *msg: the reply message if applicable, or NULL / empty string
+ *
+ * Returns:
+ * - the size of the reply in bytes, or -1 if the reply type is invalid
+ */
+int pack_reply_msg(uint8_t *buf, uint8_t cmd, uint16_t val, const char *msg);
+
 /**
  * Receives a reply message. YOU MUST FREE THE POINTER WHEN DONE!
  *
@@ -0,0 +1,266 @@
+#include "slab.h"
+
+// registry of every slab in use, for reporting statistics
+static slab_t *slabs = NULL;
+static pthread_mutex_t slabs_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// counters are only ever written by their owning thread, so a relaxed
+// load/store pair is enough; readers may just see a slightly stale value
+#define counter_bump(counter)                                                  \
+  atomic_store_explicit(                                                       \
+      &(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + 1,  \
+      memory_order_relaxed)
+
+#define counter_read(counter)                                                  \
+  atomic_load_explicit(&(counter), memory_order_relaxed)
+
+/**
+ * Moves `n` objects from a cache back into the depot. Depot must be locked!
+ */
+static void flush_cache_locked(slab_t *slab, slab_cache_t *cache, size_t n) {
+  for (size_t i = 0; i < n && cache->count > 0; i++) {
+    slab_hdr_t *hdr = cache->objs[--cache->count];
+    hdr->next = slab->depot;
+    slab->depot = hdr;
+    slab->depot_count += 1;
+  }
+}
+
+/**
+ * Destructor for a thread's cache; runs when the thread exits. Returns all
+ * cached objects to the depot, and folds the thread's counters into the slab.
+ */
+static void destroy_slab_cache(void *arg) {
+  slab_cache_t *cache = (slab_cache_t *)arg;
+  slab_t *slab = cache->slab;
+
+  pthread_mutex_lock(&slab->depot_mtx);
+  flush_cache_locked(slab, cache, cache->count);
+  list_remove(&cache->link);
+  atomic_fetch_add(&slab->allocs, counter_read(cache->allocs));
+  atomic_fetch_add(&slab->frees, counter_read(cache->frees));
+  pthread_mutex_unlock(&slab->depot_mtx);
+
+  free(cache);
+}
+
+/**
+ * Finishes initializing a slab on its first use, and registers it.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int init_slab(slab_t *slab) {
+  pthread_mutex_lock(&slab->depot_mtx);
+  // someone may have beaten us to it
+  if (atomic_load(&slab->ready)) {
+    pthread_mutex_unlock(&slab->depot_mtx);
+    return 0;
+  }
+
+  int ret = pthread_key_create(&slab->cache_key, destroy_slab_cache);
+  if (ret) {
+    pthread_mutex_unlock(&slab->depot_mtx);
+    errno = ret;
+    perror("init_slab: pthread_key_create");
+    return -1;
+  }
+
+  // objects (and their headers) must stay aligned for any type
+  size_t align = sizeof(slab_hdr_t);
+  slab->stride =
+      (sizeof(slab_hdr_t) + slab->obj_size + align - 1) / align * align;
+  slab->depot = NULL;
+  slab->depot_count = 0;
+  slab->chunks = NULL;
+  list_init(&slab->caches);
+
+  // add to registry
+  pthread_mutex_lock(&slabs_mtx);
+  slab->next = slabs;
+  slabs = slab;
+  pthread_mutex_unlock(&slabs_mtx);
+
+  atomic_store(&slab->ready, 1);
+  pthread_mutex_unlock(&slab->depot_mtx);
+  return 0;
+}
+
+/**
+ * Gets (or creates) the calling thread's cache for a slab.
+ *
+ * Returns:
+ * - the cache, or NULL on failure
+ */
+static slab_cache_t *get_slab_cache(slab_t *slab) {
+  if (!atomic_load_explicit(&slab->ready, memory_order_acquire) &&
+      init_slab(slab))
+    return NULL;
+
+  slab_cache_t *cache = pthread_getspecific(slab->cache_key);
+  if (cache != NULL)
+    return cache;
+
+  cache = calloc(1, sizeof(slab_cache_t));
+  if (cache == NULL) {
+    fprintf(stderr, "[get_slab_cache] Failed to malloc cache for slab %s.\n",
+            slab->name);
+    return NULL;
+  }
+  cache->slab = slab;
+  list_link_init(&cache->link);
+
+  pthread_mutex_lock(&slab->depot_mtx);
+  list_insert_tail(&slab->caches, &cache->link);
+  pthread_mutex_unlock(&slab->depot_mtx);
+
+  if (pthread_setspecific(slab->cache_key, cache)) {
+    fprintf(stderr, "[get_slab_cache] Failed to set cache for slab %s.\n",
+            slab->name);
+    pthread_mutex_lock(&slab->depot_mtx);
+    list_remove(&cache->link);
+    pthread_mutex_unlock(&slab->depot_mtx);
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/**
+ * Carves a freshly malloc'd chunk into objects, and adds them to the depot.
+ * Depot must be locked!
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int grow_depot_locked(slab_t *slab) {
+  // the first header-sized slot links the chunk into slab->chunks
+  char *chunk = malloc(sizeof(slab_hdr_t) + SLAB_CHUNK_OBJS * slab->stride);
+  if (chunk == NULL) {
+    fprintf(stderr, "[grow_depot] Failed to malloc chunk for slab %s.\n",
+            slab->name);
+    return -1;
+  }
+  *(void **)chunk = slab->chunks;
+  slab->chunks = chunk;
+
+  for (size_t i = 0; i < SLAB_CHUNK_OBJS; i++) {
+    slab_hdr_t *hdr =
+        (slab_hdr_t *)(chunk + sizeof(slab_hdr_t) + i * slab->stride);
+    hdr->next = slab->depot;
+    slab->depot = hdr;
+  }
+  slab->depot_count += SLAB_CHUNK_OBJS;
+  atomic_fetch_add(&slab->num_chunks, 1);
+  return 0;
+}
+
+/**
+ * Refills an empty cache with a batch of objects from the depot.
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+static int refill_cache(slab_t *slab, slab_cache_t *cache) {
+  pthread_mutex_lock(&slab->depot_mtx);
+  if (slab->depot_count == 0 && grow_depot_locked(slab)) {
+    pthread_mutex_unlock(&slab->depot_mtx);
+    return -1;
+  }
+
+  while (cache->count < SLAB_BATCH && slab->depot != NULL) {
+    cache->objs[cache->count++] = slab->depot;
+    slab->depot = slab->depot->next;
+    slab->depot_count -= 1;
+  }
+  pthread_mutex_unlock(&slab->depot_mtx);
+
+  atomic_fetch_add_explicit(&slab->refills, 1, memory_order_relaxed);
+  return 0;
+}
+
+void *slab_alloc(slab_t *slab) {
+  slab_cache_t *cache = get_slab_cache(slab);
+  if (cache == NULL)
+    return NULL;
+
+  if (cache->count == 0 && refill_cache(slab, cache))
+    return NULL;
+
+  slab_hdr_t *hdr = cache->objs[--cache->count];
+  hdr->slab = slab;
+  counter_bump(cache->allocs);
+
+  return hdr + 1;
+}
+
+void slab_free(void *obj) {
+  if (obj == NULL)
+    return;
+
+  slab_hdr_t *hdr = (slab_hdr_t *)obj - 1;
+  slab_t *slab = hdr->slab;
+  slab_cache_t *cache = get_slab_cache(slab);
+
+  // if we can't get a cache, hand the object straight back to the depot
+  if (cache == NULL) {
+    pthread_mutex_lock(&slab->depot_mtx);
+    hdr->next = slab->depot;
+    slab->depot = hdr;
+    slab->depot_count += 1;
+    atomic_fetch_add(&slab->frees, 1);
+    pthread_mutex_unlock(&slab->depot_mtx);
+    return;
+  }
+
+  // if full, give half the cache back to the depot
+  if (cache->count == SLAB_CACHE_SIZE) {
+    pthread_mutex_lock(&slab->depot_mtx);
+    flush_cache_locked(slab, cache, SLAB_BATCH);
+    pthread_mutex_unlock(&slab->depot_mtx);
+    atomic_fetch_add_explicit(&slab->flushes, 1, memory_order_relaxed);
+  }
+
+  cache->objs[cache->count++] = hdr;
+  counter_bump(cache->frees);
+}
+
+void get_slab_stats(slab_t *slab, slab_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!atomic_load(&slab->ready))
+    return;
+
+  pthread_mutex_lock(&slab->depot_mtx);
+  stats->allocs = atomic_load(&slab->allocs);
+  stats->frees = atomic_load(&slab->frees);
+  slab_cache_t *cache;
+  list_iterate_begin(&slab->caches, cache, slab_cache_t, link) {
+    stats->allocs += counter_read(cache->allocs);
+    stats->frees += counter_read(cache->frees);
+  }
+  list_iterate_end();
+  pthread_mutex_unlock(&slab->depot_mtx);
+
+  // frees may be counted on a different thread than their alloc, so the two
+  // sums can briefly disagree; don't underflow
+  stats->in_use =
+      stats->allocs > stats->frees ? stats->allocs - stats->frees : 0;
+  stats->refills = atomic_load(&slab->refills);
+  stats->flushes = atomic_load(&slab->flushes);
+  stats->num_chunks = atomic_load(&slab->num_chunks);
+  stats->reserved = stats->num_chunks * SLAB_CHUNK_OBJS * slab->stride;
+}
+
+void print_slab_stats(FILE *out) {
+  slab_stats_t stats;
+  fprintf(out, "%-20s %10s %10s %8s %8s %8s %10s\n", "slab", "allocs", "frees",
+          "in_use", "refills", "flushes", "reserved");
+  pthread_mutex_lock(&slabs_mtx);
+  for (slab_t *slab = slabs; slab != NULL; slab = slab->next) {
+    get_slab_stats(slab, &stats);
+    fprintf(out, "%-20s %10zu %10zu %8zu %8zu %8zu %9zuB\n", slab->name,
+            stats.allocs, stats.frees, stats.in_use, stats.refills,
+            stats.flushes, stats.reserved);
+  }
+  pthread_mutex_unlock(&slabs_mtx);
+}
@@ -0,0 +1,131 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "util.h"
+
+/**
+ * Fixed-size object pools for the structures the control path churns through
+ * (connections, jobs, request arguments, reply buffers).
+ *
+ * Each thread keeps a small cache of free objects per slab, so the common
+ * alloc/free pair never takes a lock. When a cache runs dry (or overflows), it
+ * exchanges a batch of objects with the slab's shared depot, which is the only
+ * part protected by a mutex. The depot grows by carving malloc'd chunks into
+ * objects; memory is never handed back to malloc, since these pools only ever
+ * hold a few thousand small objects at most.
+ *
+ * Every object is prefixed by a header recording its slab, so slab_free does
+ * not need to be told where an object came from.
+ */
+
+#define SLAB_CACHE_SIZE 32                // free objects per thread cache
+#define SLAB_BATCH (SLAB_CACHE_SIZE / 2) // objects moved to/from the depot
+#define SLAB_CHUNK_OBJS 64               // objects carved from each chunk
+
+struct slab;
+
+/**
+ * Prepended to every object. While allocated, it records the owning slab; while
+ * free, it links the object into the depot.
+ */
+typedef union slab_hdr {
+  struct slab *slab;     // owning slab (allocated)
+  union slab_hdr *next;  // next free object in the depot (free)
+  max_align_t alignment; // keep objects suitably aligned
+} slab_hdr_t;
+
+/**
+ * Per-thread cache of free objects. Counters are only written by the owning
+ * thread, and summed up by get_slab_stats.
+ */
+typedef struct {
+  list_link_t link;                  // for the slab's list of caches
+  struct slab *slab;                 // slab this cache belongs to
+  size_t count;                      // number of cached objects
+  atomic_size_t allocs;              // objects allocated by this thread
+  atomic_size_t frees;               // objects freed by this thread
+  slab_hdr_t *objs[SLAB_CACHE_SIZE]; // cached objects (LIFO)
+} slab_cache_t;
+
+typedef struct slab {
+  const char *name;          // name to report statistics under
+  size_t obj_size;           // size of each object
+  size_t stride;             // size of each object, including its header
+  pthread_mutex_t depot_mtx; // synchronizes the depot, chunks, and caches
+  slab_hdr_t *depot;         // free objects shared between threads
+  size_t depot_count;        // number of objects in the depot
+  void *chunks;              // malloc'd chunks, linked through the first word
+  list_t caches;             // live per-thread caches
+  pthread_key_t cache_key;   // per-thread cache of this slab
+  atomic_int ready;          // whether the slab has been lazily initialized
+  struct slab *next;         // next slab in the global registry
+  // counters, folded in from exited threads and depot operations
+  atomic_size_t allocs;     // objects allocated by exited threads
+  atomic_size_t frees;      // objects freed by exited threads
+  atomic_size_t refills;    // cache refills from the depot
+  atomic_size_t flushes;    // cache flushes to the depot
+  atomic_size_t num_chunks; // chunks malloc'd
+} slab_t;
+
+/**
+ * Snapshot of a slab's allocation counters.
+ */
+typedef struct {
+  size_t allocs;     // total objects allocated
+  size_t frees;      // total objects freed
+  size_t in_use;     // objects currently allocated
+  size_t refills;    // cache refills from the depot
+  size_t flushes;    // cache flushes to the depot
+  size_t num_chunks; // chunks malloc'd
+  size_t reserved;   // bytes malloc'd for objects
+} slab_stats_t;
+
+/**
+ * Statically initializes a slab for objects of the given size; the rest of the
+ * slab is set up on first use, so slabs can live as file-scope statics.
+ */
+#define SLAB_INITIALIZER(slab_name, size)                                      \
+  { .name = (slab_name), .obj_size = (size),                                   \
+    .depot_mtx = PTHREAD_MUTEX_INITIALIZER }
+
+/**
+ * Allocates an object from a slab. The object's contents are uninitialized.
+ *
+ * Inputs:
+ * - slab_t *slab: the slab to allocate from
+ *
+ * Returns:
+ * - a pointer to the object, or NULL on failure
+ */
+void *slab_alloc(slab_t *slab);
+
+/**
+ * Returns an object to the slab it was allocated from. Does nothing on NULL.
+ *
+ * Inputs:
+ * - void *obj: an object returned by slab_alloc
+ */
+void slab_free(void *obj);
+
+/**
+ * Collects a slab's allocation counters. Counters from running threads are read
+ * without stopping them, so the snapshot is only approximately consistent.
+ *
+ * Inputs:
+ * - slab_t *slab: the slab of interest
+ * - slab_stats_t *stats: where to store the counters
+ */
+void get_slab_stats(slab_t *slab, slab_stats_t *stats);
+
+/**
+ * Prints the counters of every slab that has been used so far.
+ *
+ * Inputs:
+ * - FILE *out: where to print
+ */
+void print_slab_stats(FILE *out);
+
+#endif
@@ -1,6 +1,11 @@
 #include "station.h"
 
-station_t *init_station(int station_number, char *song_name) {
+// one per song loop, at most one per station at a time
+static slab_t announce_args_slab =
+    SLAB_INITIALIZER("announce_args_t", sizeof(announce_args_t));
+
+station_t *init_station(int station_number, char *song_name,
+                        const station_config_t *config, uint64_t weight) {
   // attempt to make UDP streaming socket for the server
   int ipv4_fd = socket(PF_INET, SOCK_DGRAM, 0);
   if (ipv4_fd == -1) {
@@ -50,6 +55,20 @@ station_t *init_station(int station_number, char *song_name) {
     free(station);
     return NULL;
   }
+  station->listener_table =
+      calloc(LISTENER_TABLE_MIN, sizeof(client_connection_t *));
+  if (station->listener_table == NULL) {
+    fprintf(stderr, "[init_station] Failed to allocate station %d's listener "
+                    "table.\n",
+            station_number);
+    close(ipv4_fd);
+    close(ipv6_fd);
+    fclose(song_file);
+    free(station->song_name);
+    free(station);
+    return NULL;
+  }
+  station->table_size = LISTENER_TABLE_MIN;
   station->song_file = song_file;
   // initialize buffer
   memset(station->buf, 0, sizeof(station->buf));
@@ -57,31 +76,94 @@ station_t *init_station(int station_number, char *song_name) {
   station->ipv4_stream_fd = ipv4_fd;
   station->ipv6_stream_fd = ipv6_fd;
 
-  // start running streaming thread
+  // the announcement never changes, so serialize it once; the string is capped
+  // at the longest a reply can carry
+  char msg[UINT8_MAX + 1];
+  snprintf(msg, sizeof(msg), "\"%s\" [Station %d]", song_name, station_number);
+  station->announce_len =
+      pack_reply_msg(station->announce, REPLY_ANNOUNCE, strlen(msg), msg);
+  station->t_pool = config->t_pool;
+  atomic_init(&station->announce_pending, 0);
+  memset(&station->send_log, 0, sizeof(station->send_log));
+  memset(&station->park_log, 0, sizeof(station->park_log));
+  station->keepalive_timeout_ns = config->keepalive_timeout_ns;
+  init_egress_share(&station->egress, config->egress, weight);
+  station->num_listeners = 0;
+  atomic_init(&station->metrics.datagrams, 0);
+  atomic_init(&station->metrics.bytes, 0);
+  atomic_init(&station->metrics.send_errors, 0);
+  atomic_init(&station->metrics.overruns, 0);
+  hist_init(&station->metrics.tick_ns);
+  hist_init(&station->metrics.send_jitter_ns);
+  hist_init(&station->metrics.depart_jitter_ns);
+  hist_init(&station->metrics.tx_stack_ns);
+  hist_init(&station->metrics.tx_queue_ns);
+  init_trace_ring(&station->trace);
+  memset(station->tx_stamps, 0, sizeof(station->tx_stamps));
+
+  // have ICMP errors (e.g. port unreachable) reported on the error queue,
+  // along with who they're for; without this, they'd only fail a later send
+  // to somebody else
+  int on = 1;
+  if (setsockopt(ipv4_fd, SOL_IP, IP_RECVERR, &on, sizeof(on)) == -1 ||
+      setsockopt(ipv6_fd, SOL_IPV6, IPV6_RECVERR, &on, sizeof(on)) == -1)
+    perror("init_station: setsockopt");
+
+  // have software timestamps reported too (only for datagrams that ask for
+  // them, see flush_fanout), numbered, and without a copy of the datagram
+  station->tx_timestamps = config->tx_timestamps;
+  int stamp_flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                    SOF_TIMESTAMPING_OPT_TSONLY;
+  if (station->tx_timestamps &&
+      (setsockopt(ipv4_fd, SOL_SOCKET, SO_TIMESTAMPING, &stamp_flags,
+                  sizeof(stamp_flags)) == -1 ||
+       setsockopt(ipv6_fd, SOL_SOCKET, SO_TIMESTAMPING, &stamp_flags,
+                  sizeof(stamp_flags)) == -1)) {
+    perror("init_station: setsockopt");
+    station->tx_timestamps = 0;
+  }
+
+  // with keepalives on, every listener sends one each KEEPALIVE_INTERVAL_MS;
+  // make room for a tick's worth of them, or the kernel drops some and live
+  // listeners get pruned (the kernel caps this at net.core.rmem_max)
+  int rcvbuf = KEEPALIVE_RCVBUF;
+  if (station->keepalive_timeout_ns &&
+      (setsockopt(ipv4_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) ||
+       setsockopt(ipv6_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))))
+    perror("init_station: setsockopt");
+
+  // start running streaming thread; it's joined when the station is stopped
   int ret;
   if ((ret = pthread_create(&station->streamer, NULL,
-                            (void *(*)(void *))stream_music_loop, station)) ||
-      pthread_detach(station->streamer)) {
+                            (void *(*)(void *))stream_music_loop, station))) {
     // clean up allocations
     fclose(song_file);
+    free(station->listener_table);
     free(station->song_name);
     free(station);
     close(ipv4_fd);
     close(ipv6_fd);
-    handle_error_en(ret, "init_station: pthread_{create, detach}");
+    handle_error_en(ret, "init_station: pthread_create");
   }
 
   return station;
 }
 
-void destroy_station(station_t *station) {
+void stop_station(station_t *station) {
   assert(station != NULL);
 
-  // cancel thread [TODO: implement cleanup handler for cancels]; do this before
-  // closing, to prevent use after free/close
+  // the streamer only acts on this while it sleeps, so wait for it to do so;
+  // after that, nothing can use the sockets or song file
   int ret = pthread_cancel(station->streamer);
   if (ret)
-    handle_error_en(ret, "destroy_station: pthread_cancel");
+    handle_error_en(ret, "stop_station: pthread_cancel");
+  ret = pthread_join(station->streamer, NULL);
+  if (ret)
+    handle_error_en(ret, "stop_station: pthread_join");
+}
+
+void destroy_station(station_t *station) {
+  assert(station != NULL);
 
   // don't need to destroy every client; client_control handles that
   // this is just a mutex destroy; check if valid
@@ -95,6 +177,7 @@ void destroy_station(station_t *station) {
 
   // free information that was allocated by making a string duplicate
   free(station->song_name);
+  free(station->listener_table);
   if (fclose(station->song_file) != 0)
     perror("destroy_station: fclose");
 
@@ -102,11 +185,214 @@ void destroy_station(station_t *station) {
   free(station);
 }
 
+int can_accept_connection(station_t *station) {
+  return egress_admit(&station->egress, station->num_listeners, STREAM_RATE);
+}
+
+/**
+ * Hashes a listener's UDP address, the same way for either family.
+ */
+static size_t hash_address(struct sockaddr_storage *addr) {
+  uint64_t h;
+  if (addr->ss_family == AF_INET) {
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    h = (uint64_t)in->sin_addr.s_addr << 16 | in->sin_port;
+  } else {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    uint64_t words[2];
+    memcpy(words, &in6->sin6_addr, sizeof(words));
+    h = words[0] ^ words[1] ^ in6->sin6_port;
+  }
+  // Fibonacci hashing; the high bits are the well-mixed ones
+  return (h * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+/**
+ * Adds a listener to a listener table with `size` buckets.
+ */
+static void table_insert(client_connection_t **table, size_t size,
+                         client_connection_t *conn) {
+  client_connection_t **bucket =
+      &table[hash_address(&conn->udp_addr) & (size - 1)];
+  conn->hash_next = *bucket;
+  conn->hash_pprev = bucket;
+  if (*bucket != NULL)
+    (*bucket)->hash_pprev = &conn->hash_next;
+  *bucket = conn;
+}
+
+/**
+ * Takes a listener out of whichever listener table it's in.
+ */
+static void table_remove(client_connection_t *conn) {
+  *conn->hash_pprev = conn->hash_next;
+  if (conn->hash_next != NULL)
+    conn->hash_next->hash_pprev = conn->hash_pprev;
+}
+
+/**
+ * Doubles a station's listener table, rehashing every listener. Must hold the
+ * station's client list lock. If there's no memory, the old table stays; its
+ * chains just get longer.
+ */
+static void grow_table(station_t *station) {
+  size_t size = station->table_size * 2;
+  client_connection_t **table = calloc(size, sizeof(client_connection_t *));
+  if (table == NULL) {
+    log_warn("[Station %d] Could not grow the listener table to %zu buckets.",
+             station->station_number, size);
+    return;
+  }
+  client_connection_t *it;
+  list_iterate_begin(&station->client_list.sync_list, it, client_connection_t,
+                     link) {
+    table_insert(table, size, it);
+  }
+  list_iterate_end();
+  free(station->listener_table);
+  station->listener_table = table;
+  station->table_size = size;
+}
+
+/**
+ * Finds the listener a UDP address belongs to. Must hold the station's client
+ * list lock.
+ *
+ * Returns:
+ * - the listener, or NULL if none of the station's listeners has the address
+ */
+static client_connection_t *find_listener(station_t *station,
+                                          struct sockaddr_storage *addr) {
+  client_connection_t *conn =
+      station->listener_table[hash_address(addr) & (station->table_size - 1)];
+  for (; conn != NULL; conn = conn->hash_next)
+    if (same_address((struct sockaddr *)&conn->udp_addr,
+                     (struct sockaddr *)addr))
+      return conn;
+  return NULL;
+}
+
 void accept_connection(station_t *station, client_connection_t *conn) {
+  // the listener's first keepalive is due once it starts getting a stream
+  if (conn->last_heard_ns == 0)
+    conn->last_heard_ns = get_time_ns();
+  if (station->num_listeners >= station->table_size * 2)
+    grow_table(station);
+  table_insert(station->listener_table, station->table_size, conn);
   list_insert_tail(&station->client_list.sync_list, &conn->link);
+  station->num_listeners++;
+  egress_commit(&station->egress, 1);
+}
+
+void remove_connection(station_t *station, client_connection_t *conn) {
+  table_remove(conn);
+  list_remove(&conn->link);
+  station->num_listeners--;
+  egress_commit(&station->egress, -1);
 }
 
-void remove_connection(client_connection_t *conn) { list_remove(&conn->link); }
+int snapshot_station(station_t *station, station_snapshot_t *snap) {
+  snap->station_number = station->station_number;
+  snap->song_name = station->song_name;
+
+  lock_station_clients(station);
+  // never allocate under the lock; if listeners joined since we made room,
+  // make more and try again
+  while (station->num_listeners > snap->capacity) {
+    size_t capacity = station->num_listeners * 2;
+    unlock_station_clients(station);
+    listener_addr_t *addrs =
+        realloc(snap->addrs, capacity * sizeof(listener_addr_t));
+    if (addrs == NULL) {
+      fprintf(stderr, "[snapshot_station] Could not realloc %zu addresses.\n",
+              capacity);
+      return -1;
+    }
+    snap->addrs = addrs;
+    snap->capacity = capacity;
+    lock_station_clients(station);
+  }
+
+  size_t n = 0;
+  client_connection_t *it;
+  list_iterate_begin(&station->client_list.sync_list, it, client_connection_t,
+                     link) {
+    memcpy(&snap->addrs[n++], &it->udp_addr, sizeof(listener_addr_t));
+  }
+  list_iterate_end();
+  unlock_station_clients(station);
+
+  snap->num_listeners = n;
+  return 0;
+}
+
+/**
+ * Hands the station's announcement to the thread pool, unless one is already
+ * waiting there (a short song may loop several times in a single chunk).
+ */
+static void queue_announcement(station_t *station) {
+  if (atomic_exchange(&station->announce_pending, 1))
+    return;
+
+  announce_args_t *args = slab_alloc(&announce_args_slab);
+  if (args == NULL) {
+    log_error("[Station %d] Failed to allocate announcement.",
+              station->station_number);
+    atomic_store(&station->announce_pending, 0);
+    return;
+  }
+  args->station = station;
+  if (add_job(station->t_pool, JOB_PRIO_BULK, announce_song, args) != 1) {
+    slab_free(args);
+    atomic_store(&station->announce_pending, 0);
+  }
+}
+
+void announce_song(void *arg) {
+  station_t *station = ((announce_args_t *)arg)->station;
+
+  // loops from here on need an announcement of their own
+  atomic_store(&station->announce_pending, 0);
+
+  // only hold the list long enough to pin every listener; never allocate under
+  // the lock, so if listeners joined since we made room, make more and retry
+  client_connection_t **conns = NULL;
+  size_t capacity = 0, n = 0;
+  lock_station_clients(station);
+  while (station->num_listeners > capacity) {
+    capacity = station->num_listeners * 2;
+    unlock_station_clients(station);
+    client_connection_t **grown = realloc(conns, capacity * sizeof(*conns));
+    if (grown == NULL) {
+      log_error("[Station %d] Could not realloc %zu listeners to announce to.",
+                station->station_number, capacity);
+      free(conns);
+      return;
+    }
+    conns = grown;
+    lock_station_clients(station);
+  }
+  client_connection_t *it;
+  list_iterate_begin(&station->client_list.sync_list, it, client_connection_t,
+                     link) {
+    atomic_fetch_add(&it->refs, 1);
+    conns[n++] = it;
+  }
+  list_iterate_end();
+  unlock_station_clients(station);
+
+  // then queue the announcement without it, so the streamer isn't held up
+  for (size_t i = 0; i < n; i++) {
+    // skip listeners that switched away in the meantime
+    lock_connection(conns[i]);
+    int listening = conns[i]->current_station == station->station_number;
+    unlock_connection(conns[i]);
+    if (listening)
+      conn_send(conns[i], station->announce, station->announce_len);
+    atomic_fetch_sub(&conns[i]->refs, 1);
+  }
+  free(conns);
+}
 
 int read_chunk(station_t *station) {
   assert(station != NULL);
@@ -123,123 +409,546 @@ int read_chunk(station_t *station) {
     bytesleft -= ret;
     // if ferror, something went wrong
     if (ferror(station->song_file)) {
-      printf("nbytes: %d\tbytesleft: %d\tret: %d\n", nbytes, bytesleft, ret);
-      fprintf(stderr, "[Station %d] Failed to read from song %s.\n",
-              station->station_number, station->song_name);
+      log_error("[Station %d] Failed to read from song %s (read %d of %d "
+                "bytes).",
+                station->station_number, station->song_name, nbytes, total);
       return -1;
       // otherwise, if we've reached the end of a file, but need to read more,
       // restart to beginning of song
     } else if (feof(station->song_file) || nbytes < total) {
-      // TODO: send to every connected client
       /* printf("[Station %d] Finished song %s! Repeating...\n", */
       /* station->station_number, station->song_name); */
       if (fseek(station->song_file, 0, SEEK_SET) == -1) {
-        perror("read_chunk: fseek");
+        log_error("[read_chunk] fseek: %s", strerror(errno));
         return -1;
       }
-      // notify clients that we've restarted the song
-      client_connection_t *it;
-      // store response string
-      char msg[MAXBUFSIZ];
-      memset(msg, 0, sizeof(msg));
-      sync_list_iterate_begin(&station->client_list, it, client_connection_t,
-                              link) {
-        sprintf(msg, "\"%s\" [Station %d]", station->song_name,
-                station->station_number);
-        send_reply_msg(it->client_fd, REPLY_ANNOUNCE, strlen(msg), msg);
-      }
-      sync_list_iterate_end(&station->client_list);
+      // notify clients that we've restarted the song, without waiting on them
+      queue_announcement(station);
     }
   }
   return 0;
 }
 
-int send_to_connections(station_t *station) {
-  assert(station != NULL);
+/**
+ * Datagrams about to go out through one of a station's sockets.
+ */
+typedef struct {
+  int fd;                                   // socket to send through
+  size_t len;                               // datagrams in the batch
+  struct mmsghdr msgs[FANOUT_BATCH];        // one per listener
+  client_connection_t *conns[FANOUT_BATCH]; // whose each datagram is
+  tx_stamps_t *stamps; // timestamp the next datagram sent, or NULL
+} fanout_t;
+
+/**
+ * Counts a failed send against a listener, parking it if it keeps failing.
+ * Must hold the station's client list lock.
+ */
+static void listener_failed(station_t *station, client_connection_t *conn,
+                            int err, uint64_t now) {
+  // failures far apart (e.g. a blip on the network) don't add up, and a
+  // listener that's been fine for a while starts over
+  if (now - conn->last_failure_ns > LISTENER_FAILURE_WINDOW_MS * 1000000ULL) {
+    conn->send_failures = 0;
+    conn->park_ns = 0;
+  }
+  conn->last_failure_ns = now;
+  atomic_fetch_add_explicit(&station->metrics.send_errors, 1,
+                            memory_order_relaxed);
+
+  int parked = 0;
+  if (++conn->send_failures >= LISTENER_MAX_FAILURES) {
+    uint64_t park_ns =
+        conn->park_ns ? conn->park_ns : LISTENER_PARK_MS * 1000000ULL;
+    conn->parked_until_ns = now + park_ns;
+    conn->park_ns = park_ns * 2 < LISTENER_MAX_PARK_MS * 1000000ULL
+                        ? park_ns * 2
+                        : LISTENER_MAX_PARK_MS * 1000000ULL;
+    conn->send_failures = 0;
+    parked = park_ns / 1000000;
+  }
+
+  // parking is logged separately, so it isn't drowned out by failures
+  unsigned long suppressed;
+  if (!ratelimit_allow(parked ? &station->park_log : &station->send_log,
+                       SEND_LOG_INTERVAL_MS * 1000000ULL, &suppressed))
+    return;
+  char address[MAXBUFSIZ];
+  get_address(address, (struct sockaddr *)&conn->udp_addr);
+  if (parked)
+    log_warn("[Station %d] Listener %s keeps failing (%s); parked for %dms. "
+             "(%lu similar messages suppressed)",
+             station->station_number, address, strerror(err), parked,
+             suppressed);
+  else
+    log_warn("[Station %d] Failed to send to listener %s (%s). (%lu similar "
+             "messages suppressed)",
+             station->station_number, address, strerror(err), suppressed);
+}
+
+/**
+ * Gets the time on the clock the kernel's timestamps use.
+ */
+static uint64_t get_realtime_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Records how far two consecutive ticks' times were from being WAIT_TIME
+ * apart. Ticks further apart than that were shed, or had nobody to go to, and
+ * are skipped.
+ */
+static void record_jitter(histogram_t *hist, uint64_t prev_ns,
+                          uint64_t now_ns) {
+  uint64_t period_ns = WAIT_TIME * 1000ULL;
+  if (prev_ns == 0 || now_ns < prev_ns || now_ns - prev_ns >= 2 * period_ns)
+    return;
+  uint64_t gap = now_ns - prev_ns;
+  hist_record(hist, gap > period_ns ? gap - period_ns : period_ns - gap);
+}
 
-  int ret = 0;
-  int family_fd;
-  // concurrently iterate through each client connection
+/**
+ * Records a transmit timestamp from a socket's error queue (see tx_stamps_t).
+ * Must hold the station's client list lock.
+ */
+static void record_tx_stamp(station_t *station, tx_stamps_t *stamps,
+                            struct sock_extended_err *ee, uint64_t ts) {
+  station_metrics_t *m = &station->metrics;
+  if (ee->ee_info == SCM_TSTAMP_SCHED) {
+    stamps->sched_id = ee->ee_data;
+    stamps->sched_ns = ts;
+    if (ts >= stamps->sent_ns)
+      hist_record(&m->tx_stack_ns, ts - stamps->sent_ns);
+  } else if (ee->ee_info == SCM_TSTAMP_SND) {
+    if (stamps->sched_ns != 0 && stamps->sched_id == ee->ee_data &&
+        ts >= stamps->sched_ns)
+      hist_record(&m->tx_queue_ns, ts - stamps->sched_ns);
+    record_jitter(&m->depart_jitter_ns, stamps->departed_ns, ts);
+    stamps->departed_ns = ts;
+  }
+}
+
+/**
+ * Reads the errors reported on a station socket's error queue, and counts each
+ * against the listener it's for. Transmit timestamps come back the same way,
+ * and are recorded in `stamps`. Must hold the station's client list lock.
+ */
+static void drain_send_errors(station_t *station, int fd, tx_stamps_t *stamps,
+                              uint64_t now) {
+  struct sockaddr_storage addr;
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+               CMSG_SPACE(sizeof(struct sockaddr_in6)) +
+               CMSG_SPACE(sizeof(struct scm_timestamping))];
+  while (1) {
+    struct msghdr msg = {.msg_name = &addr,
+                         .msg_namelen = sizeof(addr),
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    // the rest of the datagram comes back too, but we don't need it
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EINTR)
+        continue;
+      break; // EAGAIN: nothing (left) to report
+    }
+
+    struct sock_extended_err *ee = NULL;
+    struct scm_timestamping *tss = NULL;
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+          (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      else if (cmsg->cmsg_level == SOL_SOCKET &&
+               cmsg->cmsg_type == SCM_TIMESTAMPING)
+        tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+    }
+    if (ee == NULL)
+      continue;
+    // a timestamp isn't an error; software timestamps are in ts[0]
+    if (ee->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+      if (tss != NULL)
+        record_tx_stamp(station, stamps, ee,
+                        (uint64_t)tss->ts[0].tv_sec * 1000000000ULL +
+                            tss->ts[0].tv_nsec);
+      continue;
+    }
+    int err = ee->ee_errno;
+    if (err == 0)
+      continue;
+
+    // msg_name is where the failed datagram was headed
+    client_connection_t *conn = find_listener(station, &addr);
+    if (conn != NULL)
+      listener_failed(station, conn, err, now);
+  }
+}
+
+/**
+ * Reads every keepalive listeners sent to one of a station's sockets, and
+ * notes when each listener was last heard from. Must hold the station's client
+ * list lock.
+ */
+static void drain_keepalives(station_t *station, int fd, uint64_t now) {
+  struct sockaddr_storage addr;
+  keepalive_t keepalive;
+  while (1) {
+    socklen_t addr_len = sizeof(addr);
+    ssize_t n = recvfrom(fd, &keepalive, sizeof(keepalive), MSG_DONTWAIT,
+                         (struct sockaddr *)&addr, &addr_len);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      // e.g. a pending ICMP error, reported here instead; the error queue
+      // says who it was for
+      continue;
+    }
+    if (n != sizeof(keepalive) ||
+        keepalive.keepalive_type != MESSAGE_KEEPALIVE)
+      continue;
+
+    client_connection_t *conn = find_listener(station, &addr);
+    if (conn != NULL)
+      conn->last_heard_ns = now;
+  }
+}
+
+/**
+ * Shuts down a client whose listener stopped sending keepalives, so its
+ * handler removes it. Must hold the station's client list lock.
+ */
+static void prune_listener(station_t *station, client_connection_t *conn,
+                           uint64_t now) {
+  conn->pruned = 1;
+  char address[MAXBUFSIZ];
+  get_address(address, (struct sockaddr *)&conn->udp_addr);
+  log_warn("[Station %d] Listener %s hasn't sent a keepalive in %lums. "
+           "Closing client %d...",
+           station->station_number, address,
+           (now - conn->last_heard_ns) / 1000000, conn->client_fd);
+  shutdown(conn->client_fd, SHUT_RDWR);
+}
+
+/**
+ * Checks whether a listener has gone without a keepalive for too long (never,
+ * without -k).
+ */
+static int listener_silent(station_t *station, client_connection_t *conn,
+                           uint64_t now) {
+  return station->keepalive_timeout_ns &&
+         now - conn->last_heard_ns > station->keepalive_timeout_ns;
+}
+
+/**
+ * Counts the listeners a tick would go to: everyone but those that are
+ * parked, pruned or about to be. Must hold the station's client list lock.
+ */
+static size_t count_sendable(station_t *station, uint64_t now) {
+  size_t sendable = 0;
   client_connection_t *it;
-  char ipstr[MAXBUFSIZ];
-  sync_list_iterate_begin(&station->client_list, it, client_connection_t,
-                          link) {
-    // get correct family type
-    family_fd = it->udp_addr.ss_family == PF_INET ? station->ipv4_stream_fd
-                                                  : station->ipv6_stream_fd;
-    // send to appropriate udp socket
-    if ((ret = sendtoall(family_fd, station->buf, sizeof(station->buf),
-                         (struct sockaddr *)&it->udp_addr, it->addr_len))) {
-      get_address(ipstr, (struct sockaddr *)&it->udp_addr);
-      fprintf(stderr,
-              "[send_to_connections] Error sending data to connection %s.\n",
-              ipstr);
+  list_iterate_begin(&station->client_list.sync_list, it, client_connection_t,
+                     link) {
+    if (!it->pruned && !listener_silent(station, it, now) &&
+        it->parked_until_ns <= now)
+      sendable++;
+  }
+  list_iterate_end();
+  return sendable;
+}
+
+/**
+ * Times how long listeners that just switched to the station waited for their
+ * first datagram, for those among the `n` datagrams sent from `start`. Must
+ * hold the station's client list lock.
+ */
+static void record_first_datagrams(fanout_t *f, size_t start, int n) {
+  uint64_t now = 0;
+  for (size_t i = start; i < start + n; i++) {
+    client_connection_t *conn = f->conns[i];
+    if (conn->switched_ns == 0)
+      continue;
+    if (now == 0)
+      now = get_time_ns();
+    metric_time(TIMER_FIRST_DATAGRAM, now - conn->switched_ns);
+    conn->switched_ns = 0;
+  }
+}
+
+/**
+ * Sends a batch of datagrams. Must hold the station's client list lock.
+ *
+ * Returns:
+ * - the number of datagrams sent
+ */
+static int flush_fanout(station_t *station, fanout_t *f, uint64_t now) {
+  int sent = 0, retried = 0;
+  size_t i = 0;
+
+  // with -T, the first datagram of the tick asks to be timestamped on its way
+  // out; the rest don't, so the error queue stays short
+  char control[CMSG_SPACE(sizeof(uint32_t))];
+  if (f->stamps != NULL && f->len > 0) {
+    struct msghdr *hdr = &f->msgs[0].msg_hdr;
+    memset(control, 0, sizeof(control));
+    hdr->msg_control = control;
+    hdr->msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SO_TIMESTAMPING;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+    *(uint32_t *)CMSG_DATA(cmsg) =
+        SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE;
+
+    uint64_t sent_ns = get_realtime_ns();
+    record_jitter(&station->metrics.send_jitter_ns, f->stamps->sent_ns,
+                  sent_ns);
+    f->stamps->sent_ns = sent_ns;
+    f->stamps = NULL;
+  }
+
+  while (i < f->len) {
+    int n = sendmmsg(f->fd, f->msgs + i, f->len - i, 0);
+    if (n > 0) {
+      record_first_datagrams(f, i, n);
+      i += n;
+      sent += n;
+      retried = 0;
+      continue;
     }
+    if (errno == EINTR)
+      continue;
+    // an ICMP error can arrive after its error queue was drained, in which
+    // case it fails whichever send comes next; that's the error queue's
+    // listener, not this one, so give this one another go
+    if (!retried) {
+      retried = 1;
+      continue;
+    }
+    // otherwise, it really is this listener that's failing; skip it
+    listener_failed(station, f->conns[i], errno, now);
+    i++;
+    retried = 0;
+  }
+  if (f->len > 0)
+    probe4(fanout__batch, station->station_number, f->fd, f->len, sent);
+  f->len = 0;
+  return sent;
+}
+
+int send_to_connections(station_t *station, size_t *listeners) {
+  assert(station != NULL);
+
+  uint64_t now = get_time_ns();
+  int sent = 0;
+  // every datagram is the same chunk; only the destination differs
+  struct iovec iov = {.iov_base = station->buf,
+                      .iov_len = sizeof(station->buf)};
+  int stamp = station->tx_timestamps;
+  fanout_t fanouts[2] = {
+      {.fd = station->ipv4_stream_fd,
+       .len = 0,
+       .stamps = stamp ? &station->tx_stamps[0] : NULL},
+      {.fd = station->ipv6_stream_fd,
+       .len = 0,
+       .stamps = stamp ? &station->tx_stamps[1] : NULL}};
+
+  lock_station_clients(station);
+  // first, find out who the last chunk didn't make it to, and who's alive
+  drain_send_errors(station, station->ipv4_stream_fd, &station->tx_stamps[0],
+                    now);
+  drain_send_errors(station, station->ipv6_stream_fd, &station->tx_stamps[1],
+                    now);
+  if (station->keepalive_timeout_ns) {
+    drain_keepalives(station, station->ipv4_stream_fd, now);
+    drain_keepalives(station, station->ipv6_stream_fd, now);
   }
-  sync_list_iterate_end(&station->client_list);
+  *listeners = station->num_listeners;
+
+  // if the budget can't afford this chunk for everyone it goes to, shed the
+  // tick as a whole
+  if (!egress_unlimited(&station->egress) &&
+      !egress_consume(&station->egress,
+                      (uint64_t)count_sendable(station, now) *
+                          sizeof(station->buf),
+                      now)) {
+    unlock_station_clients(station);
+    memset(station->buf, 0, sizeof(station->buf));
+    return 0;
+  }
+
+  client_connection_t *it;
+  list_iterate_begin(&station->client_list.sync_list, it, client_connection_t,
+                     link) {
+    // don't waste bandwidth on listeners that keep failing, or went silent
+    if (!it->pruned && listener_silent(station, it, now))
+      prune_listener(station, it, now);
+    if (it->pruned || it->parked_until_ns > now)
+      continue;
+
+    // batch by family, and send whenever a batch fills up
+    fanout_t *f = &fanouts[it->udp_addr.ss_family == PF_INET ? 0 : 1];
+    f->msgs[f->len].msg_hdr = (struct msghdr){.msg_name = &it->udp_addr,
+                                              .msg_namelen = it->addr_len,
+                                              .msg_iov = &iov,
+                                              .msg_iovlen = 1};
+    f->conns[f->len++] = it;
+    if (f->len == FANOUT_BATCH)
+      sent += flush_fanout(station, f, now);
+  }
+  list_iterate_end();
+  sent += flush_fanout(station, &fanouts[0], now);
+  sent += flush_fanout(station, &fanouts[1], now);
+  unlock_station_clients(station);
 
   // zero information once done
   memset(station->buf, 0, sizeof(station->buf));
 
-  return ret;
+  return sent;
+}
+
+/**
+ * Records a tick in the station's metrics.
+ */
+static void record_tick(station_t *station, int sent, uint64_t tick_ns) {
+  station_metrics_t *m = &station->metrics;
+  atomic_fetch_add_explicit(&m->datagrams, sent, memory_order_relaxed);
+  atomic_fetch_add_explicit(&m->bytes, (uint64_t)sent * CHUNK_SIZE,
+                            memory_order_relaxed);
+  if (tick_ns > WAIT_TIME * 1000ULL)
+    atomic_fetch_add_explicit(&m->overruns, 1, memory_order_relaxed);
+  hist_record(&m->tick_ns, tick_ns);
+}
+
+/**
+ * The histograms kept with -T, and what they're reported as.
+ */
+static const struct {
+  const char *metric; // name in metrics
+  const char *label;  // name in print_tx_stamps
+  size_t offset;      // where it is in station_metrics_t
+} tx_hists[] = {
+    {"snowcast_station_send_jitter_ns", "send jitter",
+     offsetof(station_metrics_t, send_jitter_ns)},
+    {"snowcast_station_depart_jitter_ns", "departure jitter",
+     offsetof(station_metrics_t, depart_jitter_ns)},
+    {"snowcast_station_tx_stack_ns", "sendmmsg -> qdisc",
+     offsetof(station_metrics_t, tx_stack_ns)},
+    {"snowcast_station_tx_queue_ns", "qdisc -> driver",
+     offsetof(station_metrics_t, tx_queue_ns)}};
+#define NUM_TX_HISTS (sizeof(tx_hists) / sizeof(tx_hists[0]))
+
+void print_station_metrics(station_t *station, FILE *out) {
+  station_metrics_t *m = &station->metrics;
+  lock_station_clients(station);
+  size_t listeners = station->num_listeners;
+  unlock_station_clients(station);
+
+  char labels[MAXBUFSIZ];
+  snprintf(labels, sizeof(labels), "station=\"%d\"", station->station_number);
+  fprintf(out, "snowcast_station_listeners{%s} %zu\n", labels, listeners);
+  fprintf(out, "snowcast_station_datagrams_total{%s} %lu\n", labels,
+          atomic_load_explicit(&m->datagrams, memory_order_relaxed));
+  fprintf(out, "snowcast_station_bytes_total{%s} %lu\n", labels,
+          atomic_load_explicit(&m->bytes, memory_order_relaxed));
+  fprintf(out, "snowcast_station_send_errors_total{%s} %lu\n", labels,
+          atomic_load_explicit(&m->send_errors, memory_order_relaxed));
+  fprintf(out, "snowcast_station_overruns_total{%s} %lu\n", labels,
+          atomic_load_explicit(&m->overruns, memory_order_relaxed));
+  hist_snapshot_t tick_ns = {0};
+  hist_merge(&tick_ns, &m->tick_ns);
+  hist_print_metric(out, "snowcast_station_tick_ns", labels, &tick_ns);
+  if (!station->tx_timestamps)
+    return;
+
+  for (size_t i = 0; i < NUM_TX_HISTS; i++) {
+    hist_snapshot_t snap = {0};
+    hist_merge(&snap, (histogram_t *)((char *)m + tx_hists[i].offset));
+    hist_print_metric(out, tx_hists[i].metric, labels, &snap);
+  }
+}
+
+void print_tx_stamps(station_t *station, FILE *out) {
+  if (!station->tx_timestamps)
+    return;
+
+  char name[MAXBUFSIZ];
+  for (size_t i = 0; i < NUM_TX_HISTS; i++) {
+    hist_snapshot_t snap = {0};
+    hist_merge(&snap, (histogram_t *)((char *)&station->metrics +
+                                      tx_hists[i].offset));
+    snprintf(name, sizeof(name), "[%d] %s", station->station_number,
+             tx_hists[i].label);
+    hist_print_ns(out, name, &snap);
+  }
 }
 
-// TODO: set up thread cancel signal handler for each station
 // TODO: potentially add to thread pool?
 void *stream_music_loop(void *arg) {
   station_t *station = (station_t *)arg;
 
-  // record start/end of sending
-  int ret;
-  struct timeval tv_start, tv_end;
-  suseconds_t elapsed, wait;
+  // only get cancelled while sleeping, never while holding the client list
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-  // until something stops us, read from song file, then send to every client
-  // note that each loop reads in 1/16 of 16 KiB, so we should try to finish
-  // 16 loops every second
+  // until something stops us, read from song file, then send to every client.
+  // Each loop sends 1/16 of 16 KiB, so ticks are due every WAIT_TIME, on a
+  // fixed timeline: time spent reading and sending (or oversleeping) doesn't
+  // push back every tick after it.
+  uint64_t period_ns = WAIT_TIME * 1000ULL;
+  uint64_t scheduled = get_time_ns();
   while (1) {
-    // note time of the start of operations
-    ret = gettimeofday(&tv_start, NULL);
-    if (ret == -1) {
-      perror("stream_music_loop: gettimeofday");
-      continue;
-    }
+    trace_entry_t entry = {.scheduled_ns = scheduled, .wake_ns = get_time_ns()};
+    probe3(tick__start, station->station_number, entry.scheduled_ns,
+           entry.wake_ns);
 
     // read from song file
     if (read_chunk(station) == -1) // an error occurred, so quit
       break;
+    uint64_t read_done = get_time_ns();
 
-    // send to connections
-    if (send_to_connections(station)) {
-      // quit on error
-      fprintf(stderr, "stream_music_loop: Refer to error messages above.\n");
-      break;
-    }
+    // send to connections; a listener that fails only affects itself
+    size_t listeners;
+    int sent = send_to_connections(station, &listeners);
+    uint64_t fanout_done = get_time_ns();
 
-    // note time of the end of operations
-    ret = gettimeofday(&tv_end, NULL);
-    if (ret == -1) {
-      perror("stream_music_loop: gettimeofday");
-      continue;
-    }
-    elapsed = tv_end.tv_usec - tv_start.tv_usec;
-    // 1 * 10^6 / 16 = 62500 microseconds initially, then subtract time
-    // elapsed between start and end of operations
-    wait = WAIT_TIME - elapsed;
-
-    // only sleep if elapsed time is less than initial wait time
-    if (wait > 0 && usleep(wait)) {
-      perror("stream_music_loop: usleep");
+    entry.read_ns = read_done - entry.wake_ns;
+    entry.fanout_ns = fanout_done - read_done;
+    entry.listeners = listeners;
+    entry.sent = sent;
+    trace_record(&station->trace, &entry);
+    record_tick(station, sent, fanout_done - entry.wake_ns);
+    probe4(tick__end, station->station_number, entry.listeners, entry.sent,
+           fanout_done - entry.wake_ns);
+
+    // a tick that's a little late is made up for by starting the next one
+    // early; but once we're a whole tick behind, a burst to catch up would
+    // only flood listeners, so start the timeline over instead
+    scheduled += period_ns;
+    if (fanout_done > scheduled + period_ns)
+      scheduled = fanout_done;
+
+    struct timespec ts = {.tv_sec = scheduled / 1000000000ULL,
+                          .tv_nsec = scheduled % 1000000000ULL};
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    int ret;
+    while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) ==
+           EINTR)
+      ;
+    if (ret) {
+      errno = ret;
+      perror("stream_music_loop: clock_nanosleep");
     }
+    pthread_testcancel();
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
   }
 
   return NULL;
 }
 
 void lock_station_clients(station_t *station) {
-  pthread_mutex_lock(&station->client_list.mtx);
+  profiled_lock(&station->client_list.mtx, "station_clients");
 }
 
 void unlock_station_clients(station_t *station) {
-  pthread_mutex_unlock(&station->client_list.mtx);
+  profiled_unlock(&station->client_list.mtx);
 }
@@ -7,15 +7,87 @@
  */
 
 #include "client_connection.h"
+#include "egress.h"
+#include "lock_profile.h"
+#include "log.h"
+#include "metrics.h"
+#include "probes.h"
 #include "protocol.h"
 #include "sync_list.h"
+#include "thread_pool.h"
+#include "trace.h"
 #include "util.h"
 
 #define CHUNK_SIZE 1024 // note 16384 / 16 = 1024
+#define STREAM_RATE (CHUNK_SIZE * 16) // bytes per second to each listener
 #define WAIT_TIME                                                              \
   62500 // microseconds! note 1000000 / 16 = 62500
-        // TODO: should I do less (e.g. 60000) to account for loop time?
 
+// fan-out: chunks go out with sendmmsg, a batch of listeners at a time. Sends
+// that fail (as reported by the sockets' error queues, e.g. an ICMP port
+// unreachable) count against their listener; a listener that keeps failing is
+// parked, i.e. skipped for a while, with the time doubling every time.
+#define FANOUT_BATCH 64                 // datagrams per sendmmsg
+#define LISTENER_MAX_FAILURES 3         // failures before a listener is parked
+#define LISTENER_FAILURE_WINDOW_MS 5000 // failures this far apart don't add up
+#define LISTENER_PARK_MS 1000           // first time a listener is parked
+#define LISTENER_MAX_PARK_MS 60000      // longest a listener is parked
+#define SEND_LOG_INTERVAL_MS 1000       // least time between send failure logs
+#define KEEPALIVE_RCVBUF (1 << 23)      // room for keepalives between ticks
+#define LISTENER_TABLE_MIN 64           // buckets a station starts with
+
+/**
+ * Settings shared by every station.
+ */
+typedef struct {
+  thread_pool_t *t_pool;         // delivers announcements
+  uint64_t keepalive_timeout_ns; // prune listeners silent this long (0: never)
+  egress_t *egress;              // host-wide egress budget
+  int tx_timestamps;             // have the kernel timestamp departures (-T)
+} station_config_t;
+
+/**
+ * A station's metrics (see metrics.h). Only written by its streamer, so they
+ * don't need sharding.
+ */
+typedef struct {
+  atomic_ulong datagrams;   // datagrams sent
+  atomic_ulong bytes;       // bytes sent
+  atomic_ulong send_errors; // sends that failed right away, or bounced later
+  atomic_ulong overruns;    // ticks that took longer than WAIT_TIME
+  histogram_t tick_ns;      // time to read and send each chunk
+  // with -T, from the first datagram of each tick through each socket:
+  histogram_t send_jitter_ns;   // how far apart sends were, off WAIT_TIME
+  histogram_t depart_jitter_ns; // how far apart departures were, off WAIT_TIME
+  histogram_t tx_stack_ns;      // from sendmmsg to the packet scheduler
+  histogram_t tx_queue_ns;      // from the packet scheduler to the driver
+} station_metrics_t;
+
+/**
+ * Kernel transmit timestamps for one of a station's sockets. With -T, the
+ * first datagram of each tick through the socket asks for a timestamp when it
+ * reaches the packet scheduler (SCM_TSTAMP_SCHED) and when the driver sends it
+ * (SCM_TSTAMP_SND); both come back on the error queue, which is drained at the
+ * start of the next tick. Times are CLOCK_REALTIME, like the timestamps.
+ */
+typedef struct {
+  uint64_t sent_ns;     // when the last stamped datagram went to sendmmsg
+  uint32_t sched_id;    // which stamped datagram sched_ns is for
+  uint64_t sched_ns;    // when it reached the packet scheduler (0: not yet)
+  uint64_t departed_ns; // when the last stamped datagram left (0: never)
+} tx_stamps_t;
+
+/**
+ * When the song loops, clients are sent an ANNOUNCE. It never changes, so it's
+ * serialized once in `announce`, and the streamer only hands it to the thread
+ * pool (as a JOB_PRIO_BULK job) rather than sending it itself, so song
+ * boundaries don't cost the streamer any time. While one announcement is
+ * waiting to be delivered, further loops don't queue another.
+ *
+ * Keepalives and send errors name a listener by its UDP address, so listeners
+ * are also kept in `listener_table`, a hash table of LISTENER_TABLE_MIN or more
+ * buckets that doubles whenever there are twice as many listeners as buckets.
+ */
 typedef struct {
   sync_list_t client_list; // list to store clients connected to this station
   uint16_t station_number; // unique number for a station
@@ -25,29 +97,96 @@ typedef struct {
   pthread_t streamer;      // streamer thread
   int ipv4_stream_fd;      // IPv4 streaming socket
   int ipv6_stream_fd;      // IPv6 streaming socket
+  thread_pool_t *t_pool;          // delivers announcements
+  uint8_t announce[MAXREPLYSIZE]; // the ANNOUNCE sent when the song loops
+  size_t announce_len;            // size of announce
+  atomic_int announce_pending;    // an announcement is yet to be delivered
+  ratelimit_t send_log;           // limits logging of failed sends
+  ratelimit_t park_log;           // limits logging of parked listeners
+  uint64_t keepalive_timeout_ns;  // prune listeners silent this long (0: never)
+  egress_share_t egress;          // this station's share of the egress budget
+  size_t num_listeners;           // clients in client_list
+  station_metrics_t metrics;      // recorded by the streamer
+  trace_ring_t trace;             // the streamer's last ticks
+  int tx_timestamps;              // whether departures are timestamped (-T)
+  tx_stamps_t tx_stamps[2];       // per socket: IPv4, then IPv6
+  client_connection_t **listener_table; // listeners by UDP address
+  size_t table_size;                    // listener_table buckets; a power of 2
 } station_t;
 
+typedef struct {
+  station_t *station; // station whose song looped
+} announce_args_t;
+
+/**
+ * A listener's UDP address, as small as it can be while holding either family.
+ */
+typedef union {
+  struct sockaddr sa;      // generic address
+  struct sockaddr_in in;   // IPv4 address
+  struct sockaddr_in6 in6; // IPv6 address
+} listener_addr_t;
+
+/**
+ * Who listened to a station at one point in time. Taking it holds the client
+ * list lock only long enough to copy each listener's address; formatting them
+ * (which is the slow part) happens on the copy.
+ */
+typedef struct {
+  uint16_t station_number; // station this is a snapshot of
+  char *song_name;         // the station's song
+  size_t num_listeners;    // listeners copied into addrs
+  size_t capacity;         // room in addrs; reused between snapshots
+  listener_addr_t *addrs;  // the listeners' addresses
+} station_snapshot_t;
+
 /**
  * Initializes a station given a station number and song name.
  *
  * Inputs:
  * - int station_number: the station number of this station
  * - char *song_name: the name of the song to play; must be a path!
+ * - const station_config_t *config: settings shared by every station
+ * - uint64_t weight: the station's weight in the egress budget
  *
  * Returns:
  * - A dynamically allocated station on success, NULL on failure
  */
-station_t *init_station(int station_number, char *song_name);
+station_t *init_station(int station_number, char *song_name,
+                        const station_config_t *config, uint64_t weight);
+
+/**
+ * Stops a station's streamer thread, waiting for it to exit. The streamer only
+ * exits while it sleeps between chunks, so it never leaves the client list
+ * locked; an announcement may still be waiting in the thread pool, though.
+ *
+ * Inputs:
+ * - station_t *station: station to stop
+ */
+void stop_station(station_t *station);
 
 /**
  * Destroys a dynamically initialized station, closing the song file and freeing
- * dynamically allocated data (song name, struct itself).
+ * dynamically allocated data (song name, struct itself). The station must be
+ * stopped, with none of its announcements left in the thread pool.
  *
  * Inputs:
  * - station_t *station: station to free
  */
 void destroy_station(station_t *station);
 
+/**
+ * Checks whether the egress budget allows the station one more listener. Not
+ * thread-safe!
+ *
+ * Inputs:
+ * - station_t *station: the station of interest
+ *
+ * Returns:
+ * - 1 if a connection may join, 0 if the station is full
+ */
+int can_accept_connection(station_t *station);
+
 /**
  * Accepts a connection to the station. Not thread-safe!
  *
@@ -61,14 +200,50 @@ void accept_connection(station_t *station, client_connection_t *conn);
 /**
  * Removes a connection to the station. Not thread-safe!
  *
+ * - station_t *station: the station the connection is on
  * - client_connection_t *conn: a dynamically allocated pointer to a
  * disconnecting connection
  */
-void remove_connection(client_connection_t *conn);
+void remove_connection(station_t *station, client_connection_t *conn);
+
+/**
+ * Takes a snapshot of a station's listeners. The snapshot's buffer is grown
+ * as needed (outside the lock), and can be reused for the next station; start
+ * with a zeroed snapshot, and free its addrs once done.
+ *
+ * Inputs:
+ * - station_t *station: the station of interest
+ * - station_snapshot_t *snap: where to store the snapshot
+ *
+ * Returns:
+ * - 0 on success, -1 on failure
+ */
+int snapshot_station(station_t *station, station_snapshot_t *snap);
+
+/**
+ * Prints a station's metrics, labelled with its number.
+ *
+ * Inputs:
+ * - station_t *station: the station of interest
+ * - FILE *out: where to print
+ */
+void print_station_metrics(station_t *station, FILE *out);
+
+/**
+ * Prints a summary of a station's transmit timing: how evenly its ticks were
+ * sent and left the host, and how long they spent in the kernel on the way.
+ * Prints nothing unless the station timestamps departures (-T).
+ *
+ * Inputs:
+ * - station_t *station: the station of interest
+ * - FILE *out: where to print
+ */
+void print_tx_stamps(station_t *station, FILE *out);
 
 /**
  * Reads a chunk from the station's song file, where CHUNK_SIZE = 16384 / 16 =
- * 1024B.
+ * 1024B. If the song loops, an announcement is queued for the station's
+ * clients.
  *
  * Inputs:
  * - station_t *station: station to read
@@ -79,20 +254,38 @@ void remove_connection(client_connection_t *conn);
 int read_chunk(station_t *station);
 
 /**
- * Sends the buffer to each client, zeroing the buffer once done.
+ * Delivers a station's announcement to each of its clients. Runs in the thread
+ * pool; replies are queued, so slow clients don't hold up the rest. The client
+ * list is only locked to pin the listeners (see client_connection_t's refs),
+ * not while sending to them, so the streamer never waits on the announcement.
+ *
+ * Inputs:
+ * - announce_args_t *args: the station to announce (allocated from a slab)
+ */
+void announce_song(void *arg);
+
+/**
+ * Sends the buffer to each client whose listener isn't parked, zeroing the
+ * buffer once done. If the egress budget can't afford the whole chunk, nobody
+ * gets it (the tick is shed). Failures are tracked per listener, and never
+ * stop the station. Keepalives from listeners are read too; if the station has
+ * a keepalive timeout, clients whose listener went silent are shut down (so
+ * their handler removes them) rather than streamed to.
  *
  * Inputs:
  * - station_t *station: station with data to send
+ * - size_t *listeners: where to store how many listeners the station had
  *
  * Returns:
- * - 0 on success, non-zero on failure
+ * - the number of listeners the buffer was sent to
  */
-int send_to_connections(station_t *station);
+int send_to_connections(station_t *station, size_t *listeners);
 
 /**
  * Threading utility function that infinitely sends chunks of data to all
- * clients, then waits a set amount of time to meet the 16KiB/s bandwidth
- * requirement.
+ * clients, one every WAIT_TIME to meet the 16KiB/s bandwidth requirement.
+ * Ticks are paced against absolute deadlines, and each one is recorded in the
+ * station's trace ring.
  *
  * Inputs (once we cast args to station_t *):
  * - station_t *station: the station to run on a thread
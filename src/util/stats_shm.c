@@ -0,0 +1,116 @@
+#include "stats_shm.h"
+
+size_t stats_segment_size(size_t num_stations) {
+  return sizeof(stats_segment_t) + num_stations * sizeof(stats_station_t);
+}
+
+stats_segment_t *create_stats_segment(const char *name, size_t num_stations) {
+  // start from scratch, in case a previous server left its segment behind
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    perror("create_stats_segment: shm_open");
+    return NULL;
+  }
+
+  size_t size = stats_segment_size(num_stations);
+  if (ftruncate(fd, size) == -1) {
+    perror("create_stats_segment: ftruncate");
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  stats_segment_t *seg =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the segment around
+  if (seg == MAP_FAILED) {
+    perror("create_stats_segment: mmap");
+    shm_unlink(name);
+    return NULL;
+  }
+
+  // the segment starts zeroed; readers ignore it until the magic shows up
+  seg->version = STATS_VERSION;
+  seg->num_stations = num_stations;
+  seg->station_size = sizeof(stats_station_t);
+  seg->num_metrics = NUM_METRICS;
+  atomic_init(&seg->seq, 0);
+  atomic_thread_fence(memory_order_release);
+  seg->magic = STATS_MAGIC;
+  return seg;
+}
+
+void destroy_stats_segment(stats_segment_t *seg, const char *name) {
+  munmap(seg, stats_segment_size(seg->num_stations));
+  shm_unlink(name);
+}
+
+const stats_segment_t *open_stats_segment(const char *name, size_t *size) {
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("open_stats_segment: shm_open");
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < sizeof(stats_segment_t)) {
+    fprintf(stderr, "[open_stats_segment] %s is not a stats segment.\n", name);
+    close(fd);
+    return NULL;
+  }
+  const stats_segment_t *seg =
+      mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg == MAP_FAILED) {
+    perror("open_stats_segment: mmap");
+    return NULL;
+  }
+
+  // only trust the layout if it's one we know, and it fits in the mapping
+  if (seg->magic != STATS_MAGIC || seg->version != STATS_VERSION ||
+      seg->station_size < sizeof(stats_station_t) ||
+      sizeof(stats_segment_t) + (size_t)seg->num_stations * seg->station_size >
+          st.st_size) {
+    fprintf(stderr,
+            "[open_stats_segment] %s has an unknown layout (version %u).\n",
+            name, seg->version);
+    munmap((void *)seg, st.st_size);
+    return NULL;
+  }
+  *size = st.st_size;
+  return seg;
+}
+
+void publish_stats_segment(stats_segment_t *seg,
+                           const stats_segment_t *staged) {
+  // there's only one writer, so nobody else changes seq under us
+  uint64_t seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+  atomic_store_explicit(&seg->seq, seq + 1, memory_order_relaxed);
+  // readers must see seq turn odd before any of the data changes
+  atomic_thread_fence(memory_order_release);
+
+  size_t start = offsetof(stats_segment_t, publish_ns);
+  memcpy((char *)seg + start, (const char *)staged + start,
+         stats_segment_size(seg->num_stations) - start);
+
+  atomic_store_explicit(&seg->seq, seq + 2, memory_order_release);
+}
+
+const stats_station_t *stats_station(const stats_segment_t *seg, size_t i) {
+  return (const stats_station_t *)((const char *)seg->stations +
+                                   i * seg->station_size);
+}
+
+int read_stats_segment(const stats_segment_t *seg, stats_segment_t *copy,
+                       size_t size) {
+  for (int i = 0; i < STATS_READ_TRIES; i++) {
+    uint64_t before = atomic_load_explicit(&seg->seq, memory_order_acquire);
+    if (before & 1)
+      continue; // mid-write
+    memcpy(copy, seg, size);
+    // the copy must be done before we look at seq again
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&seg->seq, memory_order_relaxed) == before)
+      return 0;
+  }
+  return -1;
+}
@@ -0,0 +1,155 @@
+#ifndef __STATS_SHM_H__
+#define __STATS_SHM_H__
+
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "metrics.h"
+#include "thread_pool.h"
+#include "util.h"
+
+/**
+ * Shared-memory stats segment, for monitoring a server without talking to it.
+ *
+ * The server copies its counters into a POSIX shared memory object every
+ * STATS_PUBLISH_MS, from a thread of its own; nothing on the hot paths ever
+ * touches the segment. Readers map it read-only and take consistent copies
+ * without any system calls, however often they like.
+ *
+ * Consistency comes from a seqlock: `seq` is odd while the server is writing.
+ * A reader copies the segment, and keeps the copy only if `seq` was even
+ * before and unchanged after. Readers can't hold up the writer; a writer
+ * publishing mid-copy only makes the reader try again.
+ *
+ * The layout is versioned: a reader must check `magic` and `version`. Any
+ * change to stats_segment_t's fixed fields (including a new control-plane
+ * counter) bumps STATS_VERSION. Stations are stepped through by
+ * `station_size` (see stats_station), so they can grow fields without
+ * breaking older readers.
+ *
+ * Latencies are published as whole histograms (hist_snapshot_t is plain data),
+ * so readers can diff two samples (hist_diff) and get percentiles for just the
+ * time in between.
+ */
+
+#define STATS_MAGIC 0x534e4f5753544154ULL // "SNOWSTAT"
+#define STATS_VERSION 2
+#define STATS_PUBLISH_MS 100 // how often the server publishes
+#define STATS_READ_TRIES 64  // copies attempted before a reader gives up
+
+/**
+ * A station's counters, as published.
+ */
+typedef struct {
+  uint64_t listeners;   // listeners right now
+  uint64_t datagrams;   // datagrams sent
+  uint64_t bytes;       // bytes sent
+  uint64_t send_errors; // sends that failed, or bounced
+  uint64_t ticks;       // chunks streamed
+  uint64_t overruns;    // ticks that took longer than WAIT_TIME
+} stats_station_t;
+
+/**
+ * The segment. Everything but `seq` is plain data, only ever written by
+ * publish_stats_segment.
+ */
+typedef struct {
+  uint64_t magic;                           // STATS_MAGIC, once set up
+  uint32_t version;                         // STATS_VERSION
+  uint32_t num_stations;                    // entries in stations
+  uint32_t station_size;                    // sizeof(stats_station_t)
+  uint32_t num_metrics;                     // entries in counters
+  atomic_ulong seq;                         // odd while being written
+  uint64_t publish_ns;                      // when last published
+  uint64_t clients;                         // connected clients
+  uint64_t counters[NUM_METRICS];           // control-plane counters
+  uint64_t egress_committed;                // listeners admitted by the budget
+  uint64_t egress_shed_ticks;               // ticks shed for lack of tokens
+  uint64_t egress_refused;                  // joins refused for lack of budget
+  uint64_t pool_threads;                    // running worker threads
+  uint64_t pool_queued[NUM_JOB_PRIOS];      // jobs waiting per priority class
+  hist_snapshot_t timers[NUM_TIMERS];       // control-plane timers
+  hist_snapshot_t pool_wait[NUM_JOB_PRIOS]; // queue wait per priority class
+  hist_snapshot_t lock_wait;                // lock waits (with LOCK_PROFILE)
+  stats_station_t stations[];               // one per station
+} stats_segment_t;
+
+/**
+ * Computes the size of a segment with the given number of stations.
+ */
+size_t stats_segment_size(size_t num_stations);
+
+/**
+ * Creates (or replaces) a shared memory segment, and maps it for writing.
+ *
+ * Inputs:
+ * - const char *name: the shared memory object's name, e.g. "/snowcast"
+ * - size_t num_stations: the number of stations to make room for
+ *
+ * Returns:
+ * - the mapped segment, or NULL on failure
+ */
+stats_segment_t *create_stats_segment(const char *name, size_t num_stations);
+
+/**
+ * Unmaps and removes a segment made by create_stats_segment.
+ *
+ * Inputs:
+ * - stats_segment_t *seg: the segment
+ * - const char *name: the name it was created with
+ */
+void destroy_stats_segment(stats_segment_t *seg, const char *name);
+
+/**
+ * Maps an existing segment for reading.
+ *
+ * Inputs:
+ * - const char *name: the shared memory object's name
+ * - size_t *size: where to store the size of the mapping
+ *
+ * Returns:
+ * - the mapped segment, or NULL on failure (including a layout this reader
+ * doesn't know)
+ */
+const stats_segment_t *open_stats_segment(const char *name, size_t *size);
+
+/**
+ * Publishes new counters. They're gathered into a private copy of the segment
+ * first, so the write itself is only a memcpy and readers rarely have to retry.
+ * Only the server's publisher thread may call this.
+ *
+ * Inputs:
+ * - stats_segment_t *seg: the mapped segment
+ * - const stats_segment_t *staged: the new counters, from publish_ns on; its
+ * header fields are ignored
+ */
+void publish_stats_segment(stats_segment_t *seg,
+                           const stats_segment_t *staged);
+
+/**
+ * Gets one of a segment's stations, stepping by the segment's station size.
+ *
+ * Inputs:
+ * - const stats_segment_t *seg: the segment (or a copy of it)
+ * - size_t i: the station's index
+ *
+ * Returns:
+ * - the station's counters
+ */
+const stats_station_t *stats_station(const stats_segment_t *seg, size_t i);
+
+/**
+ * Takes a consistent copy of a segment.
+ *
+ * Inputs:
+ * - const stats_segment_t *seg: the mapped segment
+ * - stats_segment_t *copy: where to copy it; must have room for size bytes
+ * - size_t size: the size of the segment
+ *
+ * Returns:
+ * - 0 on success, -1 if the writer kept getting in the way
+ */
+int read_stats_segment(const stats_segment_t *seg, stats_segment_t *copy,
+                       size_t size);
+
+#endif
@@ -1,44 +1,646 @@
 #include "thread_pool.h"
 
-thread_pool_t *init_thread_pool(size_t num_threads) {
+#include <sched.h>
+
+// every request becomes a job, so avoid hitting malloc for each one
+static slab_t job_slab = SLAB_INITIALIZER("job_t", sizeof(job_t));
+
+// worker (if any) that the current thread is running as
+static __thread worker_t *current_worker = NULL;
+
+// hint to the CPU that we're spinning
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+/* ===============================================================================
+ *                              WORK-STEALING DEQUE
+ * ===============================================================================
+ *
+ * Follows "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et
+ * al., PPoPP '13), minus the resizing: pushes onto a full deque fail instead.
+ */
+
+static void deque_init(work_deque_t *dq) {
+  atomic_init(&dq->top, 0);
+  atomic_init(&dq->bottom, 0);
+  for (size_t i = 0; i < DEQUE_SIZE; i++)
+    atomic_init(&dq->buf[i], NULL);
+}
+
+/**
+ * Pushes a job onto the bottom of a deque. Owner only!
+ *
+ * Returns:
+ * - 0 on success, -1 if the deque is full
+ */
+static int deque_push(work_deque_t *dq, job_t *job) {
+  long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+  if (b - t >= DEQUE_SIZE)
+    return -1;
+  atomic_store_explicit(&dq->buf[b & (DEQUE_SIZE - 1)], job,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+  return 0;
+}
+
+/**
+ * Pops a job from the bottom of a deque. Owner only!
+ *
+ * Returns:
+ * - the job, or NULL if empty
+ */
+static job_t *deque_pop(work_deque_t *dq) {
+  long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+
+  job_t *job = NULL;
+  if (t <= b) {
+    job = atomic_load_explicit(&dq->buf[b & (DEQUE_SIZE - 1)],
+                               memory_order_relaxed);
+    // last job: race against stealers for it
+    if (t == b) {
+      if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+                                                   memory_order_seq_cst,
+                                                   memory_order_relaxed))
+        job = NULL;
+      atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+    }
+  } else {
+    // empty; restore bottom
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+  }
+  return job;
+}
+
+/**
+ * Steals a job from the top of a deque. Safe to call from any thread.
+ *
+ * Returns:
+ * - the job, or NULL if empty (or we lost a race for it)
+ */
+static job_t *deque_steal(work_deque_t *dq) {
+  long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+  if (t >= b)
+    return NULL;
+
+  job_t *job =
+      atomic_load_explicit(&dq->buf[t & (DEQUE_SIZE - 1)], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(
+          &dq->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+    return NULL;
+  return job;
+}
+
+static int deque_empty(work_deque_t *dq) {
+  return atomic_load(&dq->top) >= atomic_load(&dq->bottom);
+}
+
+/* ===============================================================================
+ *                                INJECTION QUEUE
+ * ===============================================================================
+ *
+ * Vyukov's bounded MPMC queue: a cell is free for the producer at position `p`
+ * when its seq is `p`, and holds a job for the consumer at `p` when its seq is
+ * `p + 1`.
+ */
+
+static void inject_init(inject_queue_t *q) {
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  for (size_t i = 0; i < INJECT_SIZE; i++) {
+    atomic_init(&q->cells[i].seq, i);
+    q->cells[i].job = NULL;
+  }
+}
+
+/**
+ * Enqueues a job.
+ *
+ * Returns:
+ * - 0 on success, -1 if the queue is full
+ */
+static int inject_push(inject_queue_t *q, job_t *job) {
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  inject_cell_t *cell;
+  while (1) {
+    cell = &q->cells[pos & (INJECT_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    long diff = (long)seq - (long)pos;
+    if (diff == 0) {
+      // cell is free; try to claim it
+      if (atomic_compare_exchange_weak(&q->head, &pos, pos + 1))
+        break;
+    } else if (diff < 0) {
+      return -1; // full
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+  cell->job = job;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+/**
+ * Dequeues a job.
+ *
+ * Returns:
+ * - the job, or NULL if empty
+ */
+static job_t *inject_pop(inject_queue_t *q) {
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  inject_cell_t *cell;
+  while (1) {
+    cell = &q->cells[pos & (INJECT_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    long diff = (long)seq - (long)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak(&q->tail, &pos, pos + 1))
+        break;
+    } else if (diff < 0) {
+      return NULL; // empty
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+  job_t *job = cell->job;
+  atomic_store_explicit(&cell->seq, pos + INJECT_SIZE, memory_order_release);
+  return job;
+}
+
+static int inject_empty(inject_queue_t *q) {
+  return atomic_load(&q->tail) >= atomic_load(&q->head);
+}
+
+/* ===============================================================================
+ *                                  THREAD POOL
+ * ===============================================================================
+ */
+
+static const char *prio_names[NUM_JOB_PRIOS] = {"switch", "handshake",
+                                                "bulk"};
+
+/**
+ * Checks whether any queue in the pool has work.
+ */
+static int pool_has_work(thread_pool_t *t_pool) {
+  for (int c = 0; c < NUM_JOB_PRIOS; c++)
+    if (!inject_empty(&t_pool->inject[c]))
+      return 1;
+  for (size_t i = 0; i < t_pool->num_workers; i++)
+    if (!deque_empty(&t_pool->workers[i].deque))
+      return 1;
+  return 0;
+}
+
+/**
+ * Wakes up to `n` parked workers, if there are any. Must be called after the
+ * jobs are visible in a queue; see park_worker for why this can't miss anyone.
+ */
+static void wake_workers(thread_pool_t *t_pool, size_t n) {
+  // a deque push is only a release store, so order it before the load below
+  atomic_thread_fence(memory_order_seq_cst);
+  int sleeping = atomic_load(&t_pool->num_sleeping);
+  if (sleeping == 0)
+    return;
+
+  profiled_lock(&t_pool->mtx, "pool_wake");
+  if (n >= (size_t)sleeping)
+    pthread_cond_broadcast(&t_pool->cond);
+  else
+    for (size_t i = 0; i < n; i++)
+      pthread_cond_signal(&t_pool->cond);
+  profiled_unlock(&t_pool->mtx);
+}
+
+/**
+ * Frees a worker's slot as its thread exits. Must hold the pool's mutex.
+ */
+static void retire_worker(worker_t *worker) {
+  thread_pool_t *t_pool = worker->pool;
+  worker->active = 0;
+  // if this is last thread, notify to condition variable that we're done!
+  if (--t_pool->num_threads == 0)
+    pthread_cond_broadcast(&t_pool->finished);
+}
+
+/**
+ * Starts a thread in a free worker slot. Must hold the pool's mutex.
+ *
+ * Returns:
+ * - 0 on success, or an error number if the thread couldn't be started
+ */
+static int spawn_worker(thread_pool_t *t_pool) {
+  worker_t *worker = NULL;
+  for (size_t i = 0; i < t_pool->num_workers && worker == NULL; i++)
+    if (!t_pool->workers[i].active)
+      worker = &t_pool->workers[i];
+  if (worker == NULL)
+    return EAGAIN;
+
+  // the deque is left as is: it's empty, and stealers may still be looking
+  worker->passed_over = 0;
+  worker->active = 1;
+  int ret;
+  if ((ret = pthread_create(&worker->thread, NULL, work_loop, worker))) {
+    worker->active = 0;
+    return ret;
+  }
+  // detach it so we don't have to worry about joining
+  pthread_detach(worker->thread);
+  t_pool->num_threads++;
+  return 0;
+}
+
+/**
+ * Parks a worker until work appears, or the pool is stopped. If the pool has
+ * more threads than the monitor wants, the worker retires instead.
+ *
+ * A worker announces that it's going to sleep (num_sleeping) before its final
+ * check for work, while producers publish work before checking num_sleeping.
+ * The worker's side is sequentially consistent throughout; a producer's
+ * publish may be a plain release store (deque_push), so wake_workers puts a
+ * seq_cst fence between it and the check. Either the worker sees the work, or
+ * the producer sees the sleeper and signals it (under the mutex, so the signal
+ * can't slip in between the check and the wait). A retiring worker only leaves
+ * when it sees no work, and there's always another thread left to signal.
+ *
+ * Returns:
+ * - 1 if the worker retired (i.e. its thread should exit), 0 otherwise
+ */
+static int park_worker(worker_t *worker) {
+  thread_pool_t *t_pool = worker->pool;
+  int retire = 0;
+  profiled_lock(&t_pool->mtx, "pool_park");
+  atomic_fetch_add(&t_pool->num_sleeping, 1);
+  while (!atomic_load(&t_pool->stopped) && !pool_has_work(t_pool)) {
+    if (t_pool->num_threads > t_pool->target_threads) {
+      retire = 1;
+      break;
+    }
+    profiled_cond_wait(&t_pool->cond, &t_pool->mtx);
+  }
+  atomic_fetch_sub(&t_pool->num_sleeping, 1);
+  if (retire)
+    retire_worker(worker);
+  profiled_unlock(&t_pool->mtx);
+  return retire;
+}
+
+/**
+ * Takes a job from one class's injection queue, moving up to INJECT_BATCH - 1
+ * more onto the worker's own deque (where idle workers can steal them).
+ */
+static job_t *take_injected_class(worker_t *worker, job_prio_t prio) {
+  thread_pool_t *t_pool = worker->pool;
+  inject_queue_t *q = &t_pool->inject[prio];
+  job_t *job = inject_pop(q);
+  if (job == NULL)
+    return NULL;
+
+  size_t moved = 0;
+  for (size_t i = 1; i < INJECT_BATCH; i++) {
+    job_t *extra = inject_pop(q);
+    if (extra == NULL)
+      break;
+    // put it back if our deque is full (i.e. it's still full of older jobs)
+    if (deque_push(&worker->deque, extra)) {
+      while (inject_push(q, extra))
+        cpu_relax();
+      break;
+    }
+    moved++;
+  }
+  // let others help with the batch
+  if (moved > 0)
+    wake_workers(t_pool, moved);
+  return job;
+}
+
+/**
+ * Checks whether any class less urgent than `prio` has injected jobs waiting.
+ */
+static int lower_waiting(thread_pool_t *t_pool, job_prio_t prio) {
+  for (int c = prio + 1; c < NUM_JOB_PRIOS; c++)
+    if (!inject_empty(&t_pool->inject[c]))
+      return 1;
+  return 0;
+}
+
+/**
+ * Takes a job from the most urgent non-empty injection queue. However, once
+ * STARVATION_LIMIT jobs in a row have been taken while a less urgent class was
+ * waiting, the least urgent waiting class goes first instead.
+ */
+static job_t *take_injected(worker_t *worker) {
+  thread_pool_t *t_pool = worker->pool;
+  job_t *job;
+
+  if (worker->passed_over >= STARVATION_LIMIT) {
+    for (int c = NUM_JOB_PRIOS - 1; c > 0; c--) {
+      if ((job = take_injected_class(worker, c)) != NULL) {
+        worker->passed_over = 0;
+        return job;
+      }
+    }
+  }
+
+  for (int c = 0; c < NUM_JOB_PRIOS; c++) {
+    if ((job = take_injected_class(worker, c)) != NULL) {
+      if (lower_waiting(t_pool, c))
+        worker->passed_over += 1;
+      else
+        worker->passed_over = 0;
+      return job;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Steals a job from another worker, starting from a random victim.
+ */
+static job_t *steal_job(worker_t *worker) {
+  thread_pool_t *t_pool = worker->pool;
+  size_t n = t_pool->num_workers;
+  size_t start = rand_r(&worker->seed) % n;
+  for (size_t i = 0; i < n; i++) {
+    worker_t *victim = &t_pool->workers[(start + i) % n];
+    if (victim == worker)
+      continue;
+    job_t *job = deque_steal(&victim->deque);
+    if (job != NULL)
+      return job;
+  }
+  return NULL;
+}
+
+/**
+ * Looks for a job: own deque first, then the injection queues, then others.
+ * A job from our own deque yields to more urgent injected jobs.
+ */
+static job_t *find_job(worker_t *worker) {
+  thread_pool_t *t_pool = worker->pool;
+  job_t *job = deque_pop(&worker->deque);
+  if (job != NULL) {
+    for (int c = 0; c < (int)job->prio; c++) {
+      job_t *urgent = inject_pop(&t_pool->inject[c]);
+      if (urgent != NULL) {
+        // we just popped, so there's room to put it back
+        deque_push(&worker->deque, job);
+        return urgent;
+      }
+    }
+    return job;
+  }
+
+  job = take_injected(worker);
+  if (job == NULL)
+    job = steal_job(worker);
+  return job;
+}
+
+/**
+ * Enqueues an already-created job, preferring the current worker's own deque.
+ *
+ * Returns:
+ * - 0 on success, -1 if stopped
+ */
+static int enqueue_job(thread_pool_t *t_pool, job_t *job) {
+  // once pushed, another worker may run and destroy the job at any moment, so
+  // never look at it again
+  job_prio_t prio = job->prio;
+  worker_t *worker = current_worker;
+  if (worker != NULL && worker->pool == t_pool &&
+      deque_push(&worker->deque, job) == 0) {
+    probe2(job__enqueue, prio, job);
+    return 0;
+  }
+
+  // the injection queue is large, so this should only spin during huge bursts
+  while (inject_push(&t_pool->inject[prio], job)) {
+    if (atomic_load(&t_pool->stopped))
+      return -1;
+    sched_yield();
+  }
+  probe2(job__enqueue, prio, job);
+  return 0;
+}
+
+/**
+ * Marks a job as finished; wakes anyone in wait_thread_pool if it was the last.
+ */
+static void finish_job(thread_pool_t *t_pool) {
+  if (atomic_fetch_sub(&t_pool->pending, 1) == 1 &&
+      atomic_load(&t_pool->num_waiting) > 0) {
+    profiled_lock(&t_pool->mtx, "pool_finish");
+    pthread_cond_broadcast(&t_pool->finished);
+    profiled_unlock(&t_pool->mtx);
+  }
+}
+
+/**
+ * Grows or shrinks the pool based on the last tick's queue wait and worker
+ * utilization. Must hold the pool's mutex.
+ *
+ * Inputs:
+ * - thread_pool_t *t_pool: the pool to resize
+ * - uint64_t wait: p99 queue wait over the last tick, in ns
+ * - uint64_t util: worker utilization over the last tick, in 0.1%
+ * - int starved: whether jobs are queued but none started in the last tick
+ * - int *calm_ticks: number of ticks in a row the pool's been quiet
+ * - int *cooldown: ticks left before another resize is allowed
+ */
+static void resize_pool(thread_pool_t *t_pool, uint64_t wait, uint64_t util,
+                        int starved, int *calm_ticks, int *cooldown) {
+  int busy = wait > GROW_WAIT_NS || util > GROW_UTIL_PERMILLE || starved;
+  int calm = wait < SHRINK_WAIT_NS && util < SHRINK_UTIL_PERMILLE && !starved;
+  *calm_ticks = calm ? *calm_ticks + 1 : 0;
+
+  if (*cooldown > 0) {
+    *cooldown -= 1;
+    return;
+  }
+
+  if (busy && t_pool->num_threads < t_pool->max_threads) {
+    // bursts shouldn't queue up, so double rather than adding one at a time
+    size_t target = t_pool->num_threads * 2;
+    if (target > t_pool->max_threads)
+      target = t_pool->max_threads;
+    t_pool->target_threads = target;
+
+    int ret = 0;
+    while (t_pool->num_threads < target && !(ret = spawn_worker(t_pool)))
+      ;
+    if (ret) {
+      errno = ret;
+      perror("resize_pool: pthread_create");
+      t_pool->target_threads = t_pool->num_threads;
+    }
+    atomic_fetch_add(&t_pool->grows, 1);
+    *calm_ticks = 0;
+    *cooldown = RESIZE_COOLDOWN_TICKS;
+  } else if (*calm_ticks >= SHRINK_TICKS &&
+             t_pool->target_threads > t_pool->min_threads) {
+    // one at a time; as long as it stays calm, the next one goes after the
+    // cooldown rather than another full streak
+    t_pool->target_threads -= 1;
+    pthread_cond_broadcast(&t_pool->cond); // so an idle worker retires
+    atomic_fetch_add(&t_pool->shrinks, 1);
+    *cooldown = RESIZE_COOLDOWN_TICKS;
+  }
+}
+
+/**
+ * Samples the pool every MONITOR_TICK_MS and resizes it accordingly, until the
+ * pool is stopped.
+ *
+ * Inputs:
+ * - void *arg: casts to thread_pool_t*.
+ *
+ * Returns:
+ * - NULL
+ */
+static void *monitor_loop(void *arg) {
+  thread_pool_t *t_pool = (thread_pool_t *)arg;
+  hist_snapshot_t prev, cur, delta;
+  memset(&prev, 0, sizeof(prev));
+  uint64_t prev_busy = 0, prev_ns = get_time_ns();
+  int calm_ticks = 0, cooldown = 0;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  profiled_lock(&t_pool->mtx, "pool_monitor");
+  while (!atomic_load(&t_pool->stopped)) {
+    // sleep until the next tick, or until stopped
+    deadline.tv_nsec += MONITOR_TICK_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!atomic_load(&t_pool->stopped) &&
+           profiled_cond_timedwait(&t_pool->tick, &t_pool->mtx, &deadline) !=
+               ETIMEDOUT)
+      ;
+    if (atomic_load(&t_pool->stopped))
+      break;
+
+    // look at everything recorded since the last tick
+    memset(&cur, 0, sizeof(cur));
+    uint64_t busy = 0;
+    for (size_t i = 0; i < t_pool->num_workers; i++) {
+      worker_t *worker = &t_pool->workers[i];
+      busy += atomic_load_explicit(&worker->busy_ns, memory_order_relaxed);
+      for (int c = 0; c < NUM_JOB_PRIOS; c++)
+        hist_merge(&cur, &worker->wait_ns[c]);
+    }
+    uint64_t now = get_time_ns();
+    hist_diff(&delta, &cur, &prev);
+    prev = cur;
+
+    uint64_t wait = hist_percentile(&delta, 99);
+    uint64_t util = (busy - prev_busy) * 1000 /
+                    ((now - prev_ns) * t_pool->num_threads + 1);
+    if (util > 1000) // jobs longer than a tick are counted when they finish
+      util = 1000;
+    prev_busy = busy;
+    prev_ns = now;
+    atomic_store(&t_pool->recent_wait, wait);
+    atomic_store(&t_pool->recent_util, util);
+
+    // if the workers are stuck on long jobs, nothing gets recorded at all
+    int starved = delta.count == 0 && pool_has_work(t_pool);
+    resize_pool(t_pool, wait, util, starved, &calm_ticks, &cooldown);
+  }
+  profiled_unlock(&t_pool->mtx);
+
+  return NULL;
+}
+
+thread_pool_t *init_thread_pool(size_t min_threads, size_t max_threads) {
   // validate valid number of threads
-  assert(num_threads > 0);
+  assert(min_threads > 0 && min_threads <= max_threads);
 
-  // allocate space for thread pool
-  thread_pool_t *t_pool =
-      malloc(sizeof(thread_pool_t) + num_threads * sizeof(pthread_t));
-  if (t_pool == NULL) {
+  // allocate a slot for every thread we might run; deques must stay cache-line
+  // aligned
+  thread_pool_t *t_pool;
+  size_t size = sizeof(thread_pool_t) + max_threads * sizeof(worker_t);
+  if (posix_memalign((void **)&t_pool, CACHE_LINE, size)) {
     fprintf(stderr, "[init_thread_pool] Failed to malloc thread_pool.\n");
     return NULL;
   }
 
-  // initialize work queue
-  list_init(&t_pool->work_queue);
+  // initialize queues
+  for (int c = 0; c < NUM_JOB_PRIOS; c++)
+    inject_init(&t_pool->inject[c]);
+  for (size_t i = 0; i < max_threads; i++) {
+    worker_t *worker = &t_pool->workers[i];
+    deque_init(&worker->deque);
+    worker->pool = t_pool;
+    worker->index = i;
+    worker->seed = (unsigned int)(i + 1) * 2654435761u;
+    worker->passed_over = 0;
+    worker->active = 0;
+    atomic_init(&worker->busy_ns, 0);
+    for (int c = 0; c < NUM_JOB_PRIOS; c++)
+      hist_init(&worker->wait_ns[c]);
+  }
 
   // set flags and initial thread count
-  t_pool->stopped = 0;
-  t_pool->num_threads = num_threads;
+  atomic_init(&t_pool->pending, 0);
+  atomic_init(&t_pool->num_sleeping, 0);
+  atomic_init(&t_pool->num_waiting, 0);
+  atomic_init(&t_pool->stopped, 0);
+  atomic_init(&t_pool->grows, 0);
+  atomic_init(&t_pool->shrinks, 0);
+  atomic_init(&t_pool->recent_wait, 0);
+  atomic_init(&t_pool->recent_util, 0);
+  t_pool->num_threads = 0;
+  t_pool->target_threads = min_threads;
+  t_pool->min_threads = min_threads;
+  t_pool->max_threads = max_threads;
+  t_pool->num_workers = max_threads;
 
-  // initialize synchronization primitives
+  // initialize synchronization primitives; the monitor's ticks are measured on
+  // the monotonic clock, like everything else
   int ret;
+  pthread_condattr_t attr;
   if ((ret = pthread_mutex_init(&t_pool->mtx, NULL)) ||
       (ret = pthread_cond_init(&t_pool->cond, NULL)) ||
-      (ret = pthread_cond_init(&t_pool->finished, NULL))) {
+      (ret = pthread_cond_init(&t_pool->finished, NULL)) ||
+      (ret = pthread_condattr_init(&attr)) ||
+      (ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)) ||
+      (ret = pthread_cond_init(&t_pool->tick, &attr))) {
     free(t_pool);
     handle_error_en(ret, "init_thread_pool: pthread_{mutex, cond}_init");
   }
+  pthread_condattr_destroy(&attr);
 
-  // run worker threads! detach them so we don't have to worry about joining
-  for (size_t i = 0; i < num_threads; i++) {
-    if ((ret = (pthread_create(&t_pool->workers[i], NULL, work_loop, t_pool) ||
-                pthread_detach(t_pool->workers[i])))) {
-      // if creating any thread fails, cancel and join all existing threads
-      for (size_t j = 0; j < i; j++)
-        pthread_cancel(t_pool->workers[j]); // can't really error check this lol
-      // free remnants
-      free(t_pool);
-      handle_error_en(ret, "init_thread_pool: pthread_{create, detach}");
-    }
+  // run the minimum number of worker threads, then the monitor. Workers look at
+  // num_threads as soon as they start, so count them under the mutex.
+  pthread_mutex_lock(&t_pool->mtx);
+  for (size_t i = 0; i < min_threads && !ret; i++)
+    ret = spawn_worker(t_pool);
+  pthread_mutex_unlock(&t_pool->mtx);
+  if (ret ||
+      (ret = pthread_create(&t_pool->monitor, NULL, monitor_loop, t_pool))) {
+    // if creating any thread fails, cancel all existing threads
+    for (size_t i = 0; i < t_pool->num_workers; i++)
+      if (t_pool->workers[i].active)
+        pthread_cancel(t_pool->workers[i].thread); // can't really error check
+    // free remnants
+    free(t_pool);
+    handle_error_en(ret, "init_thread_pool: pthread_create");
   }
   return t_pool;
 }
@@ -46,39 +648,52 @@ thread_pool_t *init_thread_pool(size_t num_threads) {
 void wait_thread_pool(thread_pool_t *t_pool) {
   // synchronize access
   pthread_mutex_lock(&t_pool->mtx);
+  atomic_fetch_add(&t_pool->num_waiting, 1);
 
   // wait until no work, or stopped
-  while (!list_empty(&t_pool->work_queue) && !t_pool->stopped)
+  while (atomic_load(&t_pool->pending) > 0 && !atomic_load(&t_pool->stopped))
     pthread_cond_wait(&t_pool->finished, &t_pool->mtx);
 
+  atomic_fetch_sub(&t_pool->num_waiting, 1);
   pthread_mutex_unlock(&t_pool->mtx);
 }
 
 void destroy_thread_pool(thread_pool_t *t_pool) {
   // first, set stopped to true
   pthread_mutex_lock(&t_pool->mtx);
-  t_pool->stopped = 1;
+  atomic_store(&t_pool->stopped, 1);
 
   // broadcast to all sleeping threads to wakey wakey
   int ret = pthread_cond_broadcast(&t_pool->cond);
+  pthread_cond_broadcast(&t_pool->finished);
+  pthread_cond_broadcast(&t_pool->tick);
+
+  // the monitor may be about to start threads, so it must be gone before we
+  // count on the number of threads only going down
+  pthread_mutex_unlock(&t_pool->mtx);
+  ret = pthread_join(t_pool->monitor, NULL) || ret;
+  pthread_mutex_lock(&t_pool->mtx);
 
   // wait for all worker threads to finish their stuffs; we need to free up
   // thread pool mutex while we wait
   while (t_pool->num_threads > 0)
     pthread_cond_wait(&t_pool->finished, &t_pool->mtx);
 
-  // destroy any leftover jobs
+  // destroy any leftover jobs; no workers are left, so popping is safe
   job_t *job;
-  list_iterate_begin(&t_pool->work_queue, job, job_t, link) {
-    destroy_job(job);
-  }
-  list_iterate_end();
+  for (int c = 0; c < NUM_JOB_PRIOS; c++)
+    while ((job = inject_pop(&t_pool->inject[c])) != NULL)
+      destroy_job(job);
+  for (size_t i = 0; i < t_pool->num_workers; i++)
+    while ((job = deque_steal(&t_pool->workers[i].deque)) != NULL)
+      destroy_job(job);
 
   // unlock, then destroy synchronization primitives
   pthread_mutex_unlock(&t_pool->mtx);
   ret = ret || pthread_mutex_destroy(&t_pool->mtx) ||
         pthread_cond_destroy(&t_pool->cond) ||
-        pthread_cond_destroy(&t_pool->finished);
+        pthread_cond_destroy(&t_pool->finished) ||
+        pthread_cond_destroy(&t_pool->tick);
 
   // free thread pool
   free(t_pool);
@@ -86,97 +701,176 @@ void destroy_thread_pool(thread_pool_t *t_pool) {
     handle_error_en(ret, "destroy_thread_pool: pthread_{mutex, cond}_destroy");
 }
 
-job_t *init_job(thread_func_t work, void *arg) {
-  // allocate space, and check if malloc'd successfully
-  job_t *job = malloc(sizeof(job_t));
+job_t *init_job(job_prio_t prio, thread_func_t work, void *arg) {
+  // allocate space, and check if allocated successfully
+  job_t *job = slab_alloc(&job_slab);
   if (job == NULL) {
-    fprintf(stderr, "[init_job] Failed to malloc a job.\n");
+    fprintf(stderr, "[init_job] Failed to allocate a job.\n");
     return NULL;
   }
 
-  // initialize list_link, and set fields
-  list_link_init(&job->link);
+  // set fields
   job->work = work;
   job->arg = arg;
+  job->prio = prio;
+  job->enqueued_ns = get_time_ns();
 
   return job;
 }
 
-int add_job(thread_pool_t *t_pool, thread_func_t work, void *arg) {
-  // only attempt if the thread pool even exists
-  if (t_pool == NULL)
+int add_job(thread_pool_t *t_pool, job_prio_t prio, thread_func_t work,
+            void *arg) {
+  // only attempt if the thread pool even exists, and isn't stopped already
+  if (t_pool == NULL || atomic_load(&t_pool->stopped))
     return 0;
-  // synchronize access
-  pthread_mutex_lock(&t_pool->mtx);
-  // only add job if not stopped already! indicate with value
-  int success = 1;
-  if (!t_pool->stopped) {
-    // create job
-    job_t *job = init_job(work, arg);
-    if (job == NULL) {
-      pthread_mutex_unlock(&t_pool->mtx);
-      return -1;
-    }
-    // insert job to end of queue, and notify waiting threads!
-    list_insert_tail(&t_pool->work_queue, &job->link);
-    int ret;
-    if ((ret = pthread_cond_signal(&t_pool->cond))) {
-      fprintf(stderr, "Failed to signal to t_pool->cond.\n");
-      pthread_mutex_unlock(&t_pool->mtx);
-      return -1;
+
+  // create job
+  job_t *job = init_job(prio, work, arg);
+  if (job == NULL)
+    return -1;
+
+  // count it before it's visible, so it can't finish before it's counted
+  atomic_fetch_add(&t_pool->pending, 1);
+  if (enqueue_job(t_pool, job)) {
+    slab_free(job); // leave the arg to the caller
+    finish_job(t_pool);
+    return 0;
+  }
+
+  // notify a sleeping thread, if any
+  wake_workers(t_pool, 1);
+  return 1;
+}
+
+size_t add_jobs(thread_pool_t *t_pool, job_prio_t prio, thread_func_t work,
+                void **args, size_t num_jobs) {
+  if (t_pool == NULL || atomic_load(&t_pool->stopped))
+    return 0;
+
+  size_t added;
+  for (added = 0; added < num_jobs; added++) {
+    job_t *job = init_job(prio, work, args[added]);
+    if (job == NULL)
+      break;
+
+    atomic_fetch_add(&t_pool->pending, 1);
+    if (enqueue_job(t_pool, job)) {
+      slab_free(job);
+      finish_job(t_pool);
+      break;
     }
-  } else
-    success = 0;
-  // otherwise, do nothing
-  pthread_mutex_unlock(&t_pool->mtx);
-  return success;
+  }
+
+  // one round of wakeups for the whole batch
+  if (added > 0)
+    wake_workers(t_pool, added);
+  return added;
 }
 
 void destroy_job(job_t *job) {
-  // deallocate args (recall args must be dynamically allocated!)
-  free(job->arg);
-  free(job);
+  // deallocate args (recall args must come from a slab!)
+  slab_free(job->arg);
+  slab_free(job);
 }
 
-void *work_loop(void *arg) {
-  thread_pool_t *t_pool = (thread_pool_t *)arg;
+void get_pool_stats(thread_pool_t *t_pool, pool_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
 
-  // loop indefinitely for jobs
-  while (1) {
-    // acquire lock on thread pool
-    pthread_mutex_lock(&t_pool->mtx);
-    // check if a job is available; otherwise, wait
-    while (list_empty(&t_pool->work_queue) && !t_pool->stopped)
-      // wait until we have a job
-      pthread_cond_wait(&t_pool->cond, &t_pool->mtx);
-
-    // if stopped, exit thread
-    if (t_pool->stopped)
-      break;
+  profiled_lock(&t_pool->mtx, "pool_stats");
+  stats->num_threads = t_pool->num_threads;
+  stats->target_threads = t_pool->target_threads;
+  profiled_unlock(&t_pool->mtx);
+  stats->min_threads = t_pool->min_threads;
+  stats->max_threads = t_pool->max_threads;
+  stats->grows = atomic_load(&t_pool->grows);
+  stats->shrinks = atomic_load(&t_pool->shrinks);
+  stats->recent_wait_ns = atomic_load(&t_pool->recent_wait);
+  stats->recent_util = atomic_load(&t_pool->recent_util);
 
-    // pop first job from list
-    job_t *job = list_head(&t_pool->work_queue, job_t, link);
-    list_remove_head(&t_pool->work_queue);
+  for (int c = 0; c < NUM_JOB_PRIOS; c++) {
+    inject_queue_t *q = &t_pool->inject[c];
+    size_t head = atomic_load(&q->head), tail = atomic_load(&q->tail);
+    stats->queued[c] = head > tail ? head - tail : 0;
+    for (size_t i = 0; i < t_pool->num_workers; i++)
+      hist_merge(&stats->wait_ns[c], &t_pool->workers[i].wait_ns[c]);
+  }
+}
+
+void print_pool_stats(thread_pool_t *t_pool, FILE *out) {
+  pool_stats_t stats;
+  get_pool_stats(t_pool, &stats);
+
+  fprintf(out,
+          "threads: %zu running, %zu wanted, in [%zu, %zu]; grew %lu times, "
+          "shrank %lu times\n",
+          stats.num_threads, stats.target_threads, stats.min_threads,
+          stats.max_threads, stats.grows, stats.shrinks);
+  fprintf(out, "last tick: p99 wait %.1fus, utilization %.1f%%\n",
+          stats.recent_wait_ns / 1000.0, stats.recent_util / 10.0);
+
+  char name[MAXBUFSIZ];
+  for (int c = 0; c < NUM_JOB_PRIOS; c++) {
+    snprintf(name, sizeof(name), "wait[%s] (q=%zu)", prio_names[c],
+             stats.queued[c]);
+    hist_print_ns(out, name, &stats.wait_ns[c]);
+  }
+}
+
+void print_pool_metrics(thread_pool_t *t_pool, FILE *out) {
+  pool_stats_t stats;
+  get_pool_stats(t_pool, &stats);
+
+  fprintf(out, "snowcast_pool_threads %zu\n", stats.num_threads);
+  fprintf(out, "snowcast_pool_grows_total %lu\n", stats.grows);
+  fprintf(out, "snowcast_pool_shrinks_total %lu\n", stats.shrinks);
+  char labels[MAXBUFSIZ];
+  for (int c = 0; c < NUM_JOB_PRIOS; c++) {
+    snprintf(labels, sizeof(labels), "class=\"%s\"", prio_names[c]);
+    fprintf(out, "snowcast_pool_queue_depth{%s} %zu\n", labels,
+            stats.queued[c]);
+    hist_print_metric(out, "snowcast_pool_queue_wait_ns", labels,
+                      &stats.wait_ns[c]);
+  }
+}
 
-    // unlock mutex
-    pthread_mutex_unlock(&t_pool->mtx);
+const char *job_prio_name(job_prio_t prio) { return prio_names[prio]; }
 
-    // start work!
+void *work_loop(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  thread_pool_t *t_pool = worker->pool;
+  current_worker = worker;
+
+  // loop indefinitely for jobs
+  while (!atomic_load(&t_pool->stopped)) {
+    // look for a job, spinning for a bit before we give up and park
+    job_t *job = NULL;
+    for (int i = 0; i < SPIN_ITERS && job == NULL; i++) {
+      job = find_job(worker);
+      if (job == NULL)
+        cpu_relax();
+    }
+    if (job == NULL) {
+      // if there are too many of us, this worker is done
+      if (park_worker(worker))
+        return NULL;
+      continue;
+    }
+
+    // note how long the job waited, then start work!
+    uint64_t start = get_time_ns();
+    hist_record(&worker->wait_ns[job->prio], start - job->enqueued_ns);
+    probe3(job__dequeue, job->prio, job, start - job->enqueued_ns);
     job->work(job->arg);
 
-    // destroy when done (recall jobs are dynamically initialized!)
+    // destroy when done (recall jobs are allocated from a slab!)
     destroy_job(job);
-
-    // if list is empty, signal that we are done with work for now
-    pthread_mutex_lock(&t_pool->mtx);
-    if (list_empty(&t_pool->work_queue))
-      pthread_cond_signal(&t_pool->finished);
-    pthread_mutex_unlock(&t_pool->mtx);
+    finish_job(t_pool);
+    atomic_fetch_add_explicit(&worker->busy_ns, get_time_ns() - start,
+                              memory_order_relaxed);
   }
 
-  // if this is last thread, notify to condition variable that we're done!
-  if (--t_pool->num_threads == 0)
-    pthread_cond_signal(&t_pool->finished);
+  pthread_mutex_lock(&t_pool->mtx);
+  retire_worker(worker);
   pthread_mutex_unlock(&t_pool->mtx);
 
   return NULL;
@@ -1,6 +1,12 @@
 #ifndef __THREAD_POOL_H__
 #define __THREAD_POOL_H__
 
+#include <stdatomic.h>
+
+#include "histogram.h"
+#include "lock_profile.h"
+#include "probes.h"
+#include "slab.h"
 #include "util.h"
 
 #define handle_error_en(en, msg)                                               \
@@ -10,34 +16,158 @@
     exit(EXIT_FAILURE);                                                        \
   } while (0)
 
+#define CACHE_LINE 64 // keep independently written fields apart
+
+#define DEQUE_SIZE 256   // jobs per worker deque; must be a power of 2
+#define INJECT_SIZE 8192 // jobs in the injection queue; must be a power of 2
+#define INJECT_BATCH 16  // max jobs a worker takes from the injection queue
+#define SPIN_ITERS 64    // attempts to find work before a worker parks
+
+// after this many jobs in a row are taken ahead of a waiting lower class, the
+// lowest waiting class gets a turn
+#define STARVATION_LIMIT 8
+
+// elastic sizing: every tick, the monitor looks at the queue wait and worker
+// utilization since the last tick. The grow and shrink thresholds are far
+// apart, and shrinking needs a long calm streak, so the pool doesn't flap.
+#define MONITOR_TICK_MS 100         // how often the monitor samples the pool
+#define GROW_WAIT_NS 2000000        // grow if p99 queue wait exceeds this...
+#define GROW_UTIL_PERMILLE 850      // ...or if workers are busier than this
+#define SHRINK_WAIT_NS 250000       // shrink only if p99 wait is under this...
+#define SHRINK_UTIL_PERMILLE 250    // ...and workers are less busy than this...
+#define SHRINK_TICKS 30             // ...for this many ticks in a row
+#define RESIZE_COOLDOWN_TICKS 3     // ticks to let a resize settle
+
 typedef void (*thread_func_t)(void *arg); // define a job to do
 
+/**
+ * Priority classes, most urgent first. Workers always take the most urgent job
+ * available, except that lower classes can't be starved forever (see
+ * STARVATION_LIMIT).
+ */
+typedef enum {
+  JOB_PRIO_SWITCH,    // requests from connected clients (i.e. station switches)
+  JOB_PRIO_HANDSHAKE, // accepting new clients
+  JOB_PRIO_BULK,      // background/admin work
+  NUM_JOB_PRIOS
+} job_prio_t;
+
 typedef struct {
-  list_link_t link;   // for linked list purposes
-  thread_func_t work; // job
-  void *arg;          // argument(s) of the job
+  thread_func_t work;   // job
+  void *arg;            // argument(s) of the job
+  job_prio_t prio;      // priority class of the job
+  uint64_t enqueued_ns; // when the job was added, for measuring queue wait
 } job_t;
 
+/**
+ * Chase-Lev work-stealing deque. Only the owning worker pushes and pops (at the
+ * bottom); any other worker may steal (from the top). The capacity is fixed, so
+ * a push onto a full deque simply fails and the job goes elsewhere.
+ */
 typedef struct {
-  list_t work_queue;       // work queue; synchronize access with mutex!
-  int stopped;             // flag for stopped; 0 -> running, 1 -> stopped
-  pthread_mutex_t mtx;     // synchronize access to thread pool
-  pthread_cond_t cond;     // allow threads to wait until work appears
-  pthread_cond_t finished; // wait for threads to finish work before destroying
-  size_t num_threads;      // keep track of number of threads
-  pthread_t workers[];     // VLA for worker threads
+  _Alignas(CACHE_LINE) atomic_long top;    // next index to steal
+  _Alignas(CACHE_LINE) atomic_long bottom; // next index to push
+  _Atomic(job_t *) buf[DEQUE_SIZE];        // ring buffer of jobs
+} work_deque_t;
+
+/**
+ * Bounded multi-producer, multi-consumer queue for jobs submitted from outside
+ * the pool (e.g. the poller). Each cell carries a sequence number that tells
+ * producers and consumers whose turn it is, so neither side takes a lock.
+ */
+typedef struct {
+  atomic_size_t seq; // turn of this cell
+  job_t *job;        // job stored in this cell
+} inject_cell_t;
+
+typedef struct {
+  _Alignas(CACHE_LINE) atomic_size_t head; // next position to enqueue
+  _Alignas(CACHE_LINE) atomic_size_t tail; // next position to dequeue
+  inject_cell_t cells[INJECT_SIZE];        // ring buffer of cells
+} inject_queue_t;
+
+struct thread_pool;
+
+typedef struct {
+  work_deque_t deque;                 // jobs owned by this worker
+  struct thread_pool *pool;           // pool this worker belongs to
+  size_t index;                       // index of this worker in the pool
+  unsigned int seed;                  // for picking steal victims
+  int passed_over;                    // jobs taken ahead of a lower class
+  int active;                         // whether a thread runs in this slot
+  pthread_t thread;                   // worker thread
+  atomic_ulong busy_ns;               // time spent running jobs
+  histogram_t wait_ns[NUM_JOB_PRIOS]; // queue wait of jobs this worker ran
+} worker_t;
+
+/**
+ * Elastic work-stealing thread pool.
+ * - Jobs added from outside the pool go through the lock-free injection queue
+ * of their priority class; jobs added by a worker go onto that worker's own
+ * deque.
+ * - Idle workers first drain their own deque (unless a more urgent class is
+ * waiting), then take a batch from the most urgent non-empty injection queue,
+ * then steal from other workers. Only after spinning on all of those for a
+ * while do they park on `cond`.
+ * - `mtx` is only used for parking, waiting and resizing; submitting and
+ * running jobs never touches it unless somebody is asleep.
+ * - There are `max_threads` worker slots, but only `num_threads` of them have
+ * a running thread. A monitor thread samples the pool every MONITOR_TICK_MS and
+ * moves `target_threads` between `min_threads` and `max_threads`: growing
+ * spawns threads into free slots right away, while shrinking lets idle workers
+ * retire (instead of parking) until there are only `target_threads` left.
+ */
+typedef struct thread_pool {
+  inject_queue_t inject[NUM_JOB_PRIOS];         // jobs submitted externally
+  _Alignas(CACHE_LINE) atomic_size_t pending;   // jobs added but not finished
+  _Alignas(CACHE_LINE) atomic_int num_sleeping; // workers parked on cond
+  atomic_int num_waiting;     // threads in wait_thread_pool
+  atomic_int stopped;         // flag for stopped; 0 -> running, 1 -> stopped
+  pthread_mutex_t mtx;        // synchronize parking/waiting/resizing
+  pthread_cond_t cond;        // allow threads to wait until work appears
+  pthread_cond_t finished;    // wait for threads to finish before destroying
+  pthread_cond_t tick;        // monitor sleeps on this between samples
+  pthread_t monitor;          // thread that resizes the pool
+  size_t num_threads;         // keep track of number of running threads
+  size_t target_threads;      // number of threads the monitor wants
+  size_t min_threads;         // never shrink below this
+  size_t max_threads;         // never grow above this
+  size_t num_workers;         // number of worker slots (i.e. max_threads)
+  atomic_ulong grows;         // number of times the pool grew
+  atomic_ulong shrinks;       // number of times the pool shrank
+  atomic_ulong recent_wait;   // p99 queue wait over the last tick, in ns
+  atomic_ulong recent_util;   // worker utilization over the last tick, in 0.1%
+  worker_t workers[];         // VLA for worker slots
 } thread_pool_t;
 
 /**
- * Creates a thread pool with the specified number of threads.
+ * Snapshot of a pool's statistics.
+ */
+typedef struct {
+  size_t num_threads;                     // running worker threads
+  size_t target_threads;                  // threads the monitor wants
+  size_t min_threads;                     // lower bound on threads
+  size_t max_threads;                     // upper bound on threads
+  uint64_t grows;                         // times the pool grew
+  uint64_t shrinks;                       // times the pool shrank
+  uint64_t recent_wait_ns;                // p99 queue wait over the last tick
+  uint64_t recent_util;                   // last tick's utilization, in 0.1%
+  size_t queued[NUM_JOB_PRIOS];           // jobs waiting in injection queues
+  hist_snapshot_t wait_ns[NUM_JOB_PRIOS]; // time from add_job to start
+} pool_stats_t;
+
+/**
+ * Creates a thread pool that sizes itself between the given bounds, starting
+ * with min_threads threads.
  *
  * Inputs:
- * - size_t num_threads: the desired number of threads in the pool
+ * - size_t min_threads: the fewest threads to keep around, even when idle
+ * - size_t max_threads: the most threads to run, even when busy
  *
  * Returns:
  * - a dynamically allocated thread pool, or NULL if error
  */
-thread_pool_t *init_thread_pool(size_t num_threads);
+thread_pool_t *init_thread_pool(size_t min_threads, size_t max_threads);
 
 /**
  * Wait until all work is done, or server is stopped.
@@ -61,42 +191,108 @@ void destroy_thread_pool(thread_pool_t *t_pool);
  * Create a job to run.
  *
  * Inputs:
+ * - job_prio_t prio: the job's priority class
  * - thread_func_t work: work function to perform
- * - void *arg: a DYNAMICALLY ALLOCATED struct containing arguments to work
+ * - void *arg: a struct containing arguments to work, ALLOCATED WITH slab_alloc
+ * (or NULL)
  *
  * Returns:
- * - the dynamically allocated job struct.
+ * - the job struct, allocated from the pool's job slab.
  */
-job_t *init_job(thread_func_t work, void *arg);
+job_t *init_job(job_prio_t prio, thread_func_t work, void *arg);
 
 /**
  * Adds a job to the thread pool.
  *
  * Inputs:
  * - thread_pool_t *t_pool: the desired thread pool
+ * - job_prio_t prio: the job's priority class
  * - thread_func_t work: the work to perform
- * - void *arg: the arguments of the work function; MUST BE DYNAMICALLY
- * ALLOCATED!
+ * - void *arg: the arguments of the work function; MUST BE ALLOCATED WITH
+ * slab_alloc (or NULL)!
  *
  * Returns:
  * - 1 if successfully added, 0 if stopped, -1 if error
  */
-int add_job(thread_pool_t *t_pool, thread_func_t work, void *arg);
+int add_job(thread_pool_t *t_pool, job_prio_t prio, thread_func_t work,
+            void *arg);
+
+/**
+ * Adds a batch of jobs running the same function to the thread pool. Cheaper
+ * than calling add_job in a loop, since sleeping workers are woken once per
+ * batch rather than once per job.
+ *
+ * Inputs:
+ * - thread_pool_t *t_pool: the desired thread pool
+ * - job_prio_t prio: the priority class of every job in the batch
+ * - thread_func_t work: the work to perform
+ * - void **args: the arguments of each job; MUST BE ALLOCATED WITH slab_alloc
+ * (or NULL)!
+ * - size_t num_jobs: the number of jobs (i.e. length of args)
+ *
+ * Returns:
+ * - the number of jobs added. If fewer than num_jobs (i.e. the pool stopped,
+ * or a job couldn't be allocated), the remaining args are still owned by the
+ * caller.
+ */
+size_t add_jobs(thread_pool_t *t_pool, job_prio_t prio, thread_func_t work,
+                void **args, size_t num_jobs);
 
 /**
  * Destroys an allocated job.
  *
  * Inputs:
- * - job_t *job: the dynamically allocated job struct. Note that job's args were
- * DYNAMICALLY ALLOCATED TOO, so YOU MUST FREE THESE!
+ * - job_t *job: the job struct. Note that job's args were ALLOCATED FROM A SLAB
+ * TOO, so these are returned to their slab as well!
  */
 void destroy_job(job_t *job);
 
+/**
+ * Collects a pool's statistics. Read while workers are running, so only
+ * approximately consistent.
+ *
+ * Inputs:
+ * - thread_pool_t *t_pool: the pool of interest
+ * - pool_stats_t *stats: where to store the statistics
+ */
+void get_pool_stats(thread_pool_t *t_pool, pool_stats_t *stats);
+
+/**
+ * Prints a pool's size and resizing history, along with its queue depth and
+ * queue wait per priority class.
+ *
+ * Inputs:
+ * - thread_pool_t *t_pool: the pool of interest
+ * - FILE *out: where to print
+ */
+void print_pool_stats(thread_pool_t *t_pool, FILE *out);
+
+/**
+ * Prints a pool's metrics (see metrics.h): its size, and its queue depth and
+ * queue wait per priority class.
+ *
+ * Inputs:
+ * - thread_pool_t *t_pool: the pool of interest
+ * - FILE *out: where to print
+ */
+void print_pool_metrics(thread_pool_t *t_pool, FILE *out);
+
+/**
+ * Gets the name a priority class is reported under.
+ *
+ * Inputs:
+ * - job_prio_t prio: the priority class
+ *
+ * Returns:
+ * - its name, e.g. "switch"
+ */
+const char *job_prio_name(job_prio_t prio);
+
 /**
  * Work loop for each worker thread; runs indefinitely until stopped.
  *
  * Inputs:
- * - void *arg: casts to thread_pool_t*.
+ * - void *arg: casts to worker_t*.
  *
  * Returns:
  * - NULL
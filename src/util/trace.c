@@ -0,0 +1,43 @@
+#include "trace.h"
+
+void init_trace_ring(trace_ring_t *ring) {
+  atomic_init(&ring->head, 0);
+  memset(ring->entries, 0, sizeof(ring->entries));
+}
+
+void trace_record(trace_ring_t *ring, const trace_entry_t *entry) {
+  // nobody else writes head, so no need for anything stronger than a load
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  // readers must see the last head before any of the entry it overwrites
+  // changes (like a seqlock's writer)
+  atomic_thread_fence(memory_order_release);
+  ring->entries[head & (TRACE_RING_SIZE - 1)] = *entry;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+size_t trace_snapshot(trace_ring_t *ring, trace_entry_t out[TRACE_RING_SIZE],
+                      uint64_t *first) {
+  // copy everything that was complete when we started, oldest first
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  size_t n = head - start;
+  for (size_t i = 0; i < n; i++)
+    out[i] = ring->entries[(start + i) & (TRACE_RING_SIZE - 1)];
+  // the copy must be done before we look at head again
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t after = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+  // the streamer may have come around to some of what we copied since,
+  // including the entry it may be writing right now (at `after`)
+  uint64_t safe =
+      after + 1 > TRACE_RING_SIZE ? after + 1 - TRACE_RING_SIZE : 0;
+  if (safe > start) {
+    size_t skip = safe - start < n ? safe - start : n;
+    memmove(out, out + skip, (n - skip) * sizeof(trace_entry_t));
+    n -= skip;
+    start += skip;
+  }
+
+  *first = start;
+  return n;
+}
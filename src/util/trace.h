@@ -0,0 +1,67 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdatomic.h>
+
+#include "util.h"
+
+/**
+ * Per-tick trace of a streamer, for working out where stutter comes from (a
+ * late wakeup, a slow read, or a slow fan-out).
+ *
+ * Each station keeps the last TRACE_RING_SIZE ticks in a ring. The streamer is
+ * the only writer: it fills in the next entry, then publishes it by bumping
+ * `head`, so recording a tick is a handful of plain stores and one release
+ * store. Readers never stop the streamer; they copy the ring, then throw away
+ * whatever the streamer may have overwritten while they were copying.
+ */
+
+#define TRACE_RING_SIZE 1024 // ticks kept per station; must be a power of 2
+
+/**
+ * One tick. Times are from get_time_ns.
+ */
+typedef struct {
+  uint64_t scheduled_ns; // when the tick was due
+  uint64_t wake_ns;      // when the streamer actually woke up for it
+  uint32_t read_ns;      // time spent reading the chunk
+  uint32_t fanout_ns;    // time spent sending it to every listener
+  uint32_t listeners;    // listeners on the station at fan-out
+  uint32_t sent;         // datagrams actually sent
+} trace_entry_t;
+
+typedef struct {
+  atomic_ulong head;                      // ticks recorded so far
+  trace_entry_t entries[TRACE_RING_SIZE]; // the last TRACE_RING_SIZE ticks
+} trace_ring_t;
+
+/**
+ * Empties a ring.
+ */
+void init_trace_ring(trace_ring_t *ring);
+
+/**
+ * Records a tick. Only the ring's owner (i.e. the streamer) may call this.
+ *
+ * Inputs:
+ * - trace_ring_t *ring: the ring
+ * - const trace_entry_t *entry: the tick
+ */
+void trace_record(trace_ring_t *ring, const trace_entry_t *entry);
+
+/**
+ * Copies the ticks still in a ring, oldest first.
+ *
+ * Inputs:
+ * - trace_ring_t *ring: the ring
+ * - trace_entry_t out[TRACE_RING_SIZE]: where to copy the ticks
+ * - uint64_t *first: where to store the sequence number of the first tick
+ * copied (i.e. how many ticks were recorded before it)
+ *
+ * Returns:
+ * - the number of ticks copied
+ */
+size_t trace_snapshot(trace_ring_t *ring, trace_entry_t out[TRACE_RING_SIZE],
+                      uint64_t *first);
+
+#endif
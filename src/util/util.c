@@ -26,6 +26,17 @@ void set_in_port(struct sockaddr *sa, uint16_t port) {
     ((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
 }
 
+int same_address(struct sockaddr *a, struct sockaddr *b) {
+  if (a->sa_family != b->sa_family || get_in_port(a) != get_in_port(b))
+    return 0;
+  if (a->sa_family == AF_INET)
+    return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+           ((struct sockaddr_in *)b)->sin_addr.s_addr;
+  return !memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+                 &((struct sockaddr_in6 *)b)->sin6_addr,
+                 sizeof(struct in6_addr));
+}
+
 void get_addr_str(char ipstr[INET6_ADDRSTRLEN], struct sockaddr *sa) {
   if (inet_ntop(sa->sa_family, get_in_addr(sa), ipstr, INET6_ADDRSTRLEN) ==
       NULL)
@@ -119,6 +130,25 @@ int recvall(int sockfd, void *buf, int len) {
   return 0;
 }
 
+uint64_t get_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int ratelimit_allow(ratelimit_t *rl, uint64_t interval_ns,
+                    unsigned long *suppressed) {
+  uint64_t now = get_time_ns();
+  if (now < rl->next_ns) {
+    rl->suppressed++;
+    return 0;
+  }
+  rl->next_ns = now + interval_ns;
+  *suppressed = rl->suppressed;
+  rl->suppressed = 0;
+  return 1;
+}
+
 int get_socket(const char *hostname, const char *port, int socktype) {
   struct addrinfo hints, *res, *r;
   // set hints
@@ -4,17 +4,25 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "list.h"
@@ -68,6 +76,18 @@ unsigned short get_in_port(struct sockaddr *sa);
  */
 void set_in_port(struct sockaddr *sa, uint16_t port);
 
+/**
+ * Checks whether two struct sockaddrs have the same family, address and port.
+ *
+ * Inputs:
+ * - struct sockaddr *a: the first sockaddr
+ * - struct sockaddr *b: the second sockaddr
+ *
+ * Returns:
+ * - 1 if they're the same, 0 otherwise
+ */
+int same_address(struct sockaddr *a, struct sockaddr *b);
+
 /**
  * Converts the internet address of a struct sockaddr into a string.
  *
@@ -130,6 +150,39 @@ int recvall(int sockfd, void *buf, int len);
 int sendtoall(int sockfd, void *val, int len, struct sockaddr *sa,
               socklen_t sa_len);
 
+/**
+ * Reads the monotonic clock.
+ *
+ * Returns:
+ * - the current time, in nanoseconds since some arbitrary point
+ */
+uint64_t get_time_ns(void);
+
+/**
+ * Limits how often something (e.g. a log message) happens. Not thread-safe;
+ * give each thread its own.
+ */
+typedef struct {
+  uint64_t next_ns;         // when it may happen again
+  unsigned long suppressed; // times it was denied since it last happened
+} ratelimit_t;
+
+/**
+ * Checks whether a rate-limited event may happen now, i.e. at most once per
+ * interval.
+ *
+ * Inputs:
+ * - ratelimit_t *rl: the rate limit (zeroed initially)
+ * - uint64_t interval_ns: the least time between two events
+ * - unsigned long *suppressed: where to store how many were denied before this
+ * one (only set if allowed)
+ *
+ * Returns:
+ * - 1 if it may happen, 0 if it's suppressed
+ */
+int ratelimit_allow(ratelimit_t *rl, uint64_t interval_ns,
+                    unsigned long *suppressed);
+
 /**
  * Given a hostname and port, attempts to open a socket.
  *